@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include "epoch.h"
+
+int veinit(vepoch *ep) {
+  if (NULL == ep) return VERROR;
+
+  atomic_store(&ep->global, 0);
+  ep->recs = NULL;
+  ep->limbo = NULL;
+  if (thrd_success != mtx_init(&ep->_lock, mtx_plain)) return VENOMEM;
+
+  return VOK;
+}
+
+int vedestroy(vepoch *ep) {
+  if (NULL == ep) return VERROR;
+
+  // nobody's left to use them
+  while (NULL != ep->limbo) {
+    veitem *it = ep->limbo;
+    ep->limbo = it->next;
+    it->fn(it->ptr);
+    free(it);
+  }
+  ep->recs = NULL;
+  mtx_destroy(&ep->_lock);
+
+  return VOK;
+}
+
+int vejoin(vepoch *ep, verec *rec) {
+  if (NULL == ep || NULL == rec) return VERROR;
+
+  atomic_store(&rec->local, atomic_load(&ep->global));
+  mtx_lock(&ep->_lock);
+  rec->next = ep->recs;
+  ep->recs = rec;
+  mtx_unlock(&ep->_lock);
+
+  return VOK;
+}
+
+int veleave(vepoch *ep, verec *rec) {
+  if (NULL == ep || NULL == rec) return VERROR;
+
+  mtx_lock(&ep->_lock);
+  verec **at = &ep->recs;
+  while (NULL != *at && rec != *at) at = &(*at)->next;
+  if (NULL != *at) *at = rec->next;
+  mtx_unlock(&ep->_lock);
+
+  return VOK;
+}
+
+// the oldest epoch a thread online may still be in, the caller holds the lock
+static vqword v__eoldest(vepoch *ep) {
+  vqword oldest = atomic_load(&ep->global);
+  for (verec *rec = ep->recs; NULL != rec; rec = rec->next) {
+    vqword local = atomic_load(&rec->local);
+    if (local < oldest) oldest = local;
+  }
+  return oldest;
+}
+
+// free what was retired before the oldest epoch in use
+static void v__ereclaim(vepoch *ep) {
+  veitem *due = NULL;
+
+  mtx_lock(&ep->_lock);
+  vqword oldest = v__eoldest(ep);
+  veitem **at = &ep->limbo;
+  while (NULL != *at) {
+    veitem *it = *at;
+    if (it->epoch < oldest) {
+      *at = it->next;
+      it->next = due;
+      due = it;
+    }
+    else at = &it->next;
+  }
+  mtx_unlock(&ep->_lock);
+
+  // out of the lock, 'fn' may be slow
+  while (NULL != due) {
+    veitem *it = due;
+    due = it->next;
+    it->fn(it->ptr);
+    free(it);
+  }
+}
+
+int veretire(vepoch *ep, void *ptr, void (*fn)(void*)) {
+  if (NULL == ep || NULL == fn) return VERROR;
+
+  veitem *it = (veitem*)malloc(sizeof(veitem));
+  if (NULL == it) return VENOMEM;
+  it->ptr = ptr;
+  it->fn = fn;
+
+  // close the epoch it's retired in, the threads move past it at their next
+  // quiescent point
+  mtx_lock(&ep->_lock);
+  it->epoch = atomic_fetch_add(&ep->global, 1);
+  it->next = ep->limbo;
+  ep->limbo = it;
+  mtx_unlock(&ep->_lock);
+
+  v__ereclaim(ep);
+  return VOK;
+}
+
+int vesync(vepoch *ep, verec *self) {
+  if (NULL == ep) return VERROR;
+
+  vqword target = atomic_fetch_add(&ep->global, 1) + 1;
+  if (NULL != self) atomic_store(&self->local, target);
+
+  // wait for the others to catch up. they're not waited for under the lock,
+  // they may be on their way to leave
+  for (;;) {
+    mtx_lock(&ep->_lock);
+    vqword oldest = v__eoldest(ep);
+    mtx_unlock(&ep->_lock);
+    if (oldest >= target) break;
+    thrd_yield();
+  }
+
+  v__ereclaim(ep);
+  return VOK;
+}
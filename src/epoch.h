@@ -0,0 +1,100 @@
+#ifndef _VYT_EPOCH_H
+#define _VYT_EPOCH_H
+#include <threads.h>
+#include <stdatomic.h>
+#include "vyt.h"
+
+/* the epoch of a thread that's offline, it holds nothing back */
+#define VEOFF       (~(vqword)0)
+
+/* a thread taking part in an epoch domain */
+typedef struct _verec_s {
+  _Atomic vqword    local;     /* the epoch it was last seen in */
+  struct _verec_s   *next;
+} verec;
+
+/* something retired, freed once no thread can be using it anymore */
+typedef struct _veitem_s {
+  void              *ptr;
+  void              (*fn)(void*);
+  vqword            epoch;     /* the one it was retired in */
+  struct _veitem_s  *next;
+} veitem;
+
+/* an epoch domain
+ *
+ * NOTE:
+ * - the threads taking part announce quiescent points, where they hold no
+ *   pointer to anything shared without a lock. the guest threads do it
+ *   before each instruction
+ * - an object unlinked and retired in epoch e is freed once every thread
+ *   online has announced an epoch past e
+ * - threads that block for long should go offline meanwhile */
+typedef struct {
+  _Atomic vqword    global;
+  verec             *recs;     /* the threads taking part */
+  veitem            *limbo;    /* retired, not freed yet */
+  mtx_t             _lock;     /* the lists */
+} vepoch;
+
+/**
+ * initialize an epoch domain
+ */
+int veinit(vepoch *ep);
+
+/**
+ * destroy an epoch domain, freeing everything still retired. no thread should
+ * be taking part anymore
+ */
+int vedestroy(vepoch *ep);
+
+/**
+ * take part in an epoch domain, online from now on. 'rec' stays in use until
+ * veleave
+ */
+int vejoin(vepoch *ep, verec *rec);
+
+/**
+ * stop taking part in an epoch domain
+ */
+int veleave(vepoch *ep, verec *rec);
+
+/**
+ * retire 'ptr', it's passed to 'fn' once no thread can be using it anymore.
+ * it should be unlinked already, so the threads that get to it from now on
+ * can't find it
+ */
+int veretire(vepoch *ep, void *ptr, void (*fn)(void*));
+
+/**
+ * wait until every thread online has passed a quiescent point. 'self' is the
+ * caller's own record if it takes part, it's counted as passing one now
+ */
+int vesync(vepoch *ep, verec *self);
+
+/**
+ * announce a quiescent point
+ */
+static inline void vequiesce(vepoch *ep, verec *rec) {
+  vqword g = atomic_load(&ep->global);
+
+  // avoid writing to the record if nothing changed
+  if (atomic_load_explicit(&rec->local, memory_order_relaxed) != g)
+    atomic_store(&rec->local, g);
+}
+
+/**
+ * go offline, before blocking for long
+ */
+static inline void veoffline(verec *rec) {
+  atomic_store(&rec->local, VEOFF);
+}
+
+/**
+ * get back online
+ */
+static inline void veonline(vepoch *ep, verec *rec) {
+  atomic_store(&rec->local, atomic_load(&ep->global));
+}
+
+#endif // _VYT_EPOCH_H
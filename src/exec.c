@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
 #include "exec.h"
 #include "locks.h"
 #include "utils.h"
@@ -42,16 +43,86 @@
 #include "inst/imul.h"
 #include "inst/idiv.h"
 #include "inst/imod.h"
-
-// a data structure for passing parameters into threads
-struct __vyt_thrdarg {
-  vthrd *thr;
-  vproc *proc;
-};
+#include "inst/cas.h"
+#include "inst/xadd.h"
+#include "inst/xchg.h"
+#include "inst/fence.h"
 
 // TODO: make this more customizable
 
-int vpinit(vproc *proc, struct vopts *opt) {
+// the workers spawned up front, for the first threads the guest makes
+#define V__WSPARE     2
+
+// the instructions a task runs for before the others get their turn, when
+// they're run as tasks and there's no quantum set
+#define V__SSLICE     4096
+
+// the blocks run between the checks of the time quantum, a power of two
+#define V__SBLOCKS    16
+
+// the time, for the time quanta
+static inline vqword v__snow(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (vqword)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// the time, for the futex timeouts. deterministic, an instruction takes a
+// nanosecond
+static inline vqword v__pnow(vproc *proc) {
+  if (!proc->_det) return v__snow();
+  return atomic_load(&proc->nexec) + atomic_load(&proc->_dskip);
+}
+
+// add 'n' to a counter of the process. while solo, the thread running is the
+// only one writing it, it goes without the atomic read-modify-write
+#define V__PADD(ctr, n, solo)                                                 \
+  ((solo) ? atomic_store_explicit(&(ctr), atomic_load_explicit(&(ctr),        \
+              memory_order_relaxed) + (n), memory_order_relaxed)              \
+          : (void)atomic_fetch_add(&(ctr), (n)))
+
+// another thread may start, the locks are taken from now on. the memory
+// accesses main started without them are waited for
+static void v__pshare(vproc *proc) {
+  if (1 == atomic_exchange(&proc->_solo, -1)) vmunsolo(&proc->mem, NULL);
+}
+
+// the start and the end of a thread, see v__execunit
+static void v__tenter(vthrd *thr);
+static int v__texit(vthrd *thr, int stat);
+
+// destroy the first 'n' buckets of the futex table
+static void v__fdestroy(vproc *proc, int n) {
+  for (int i = 0; i < n; i++) {
+    mtx_destroy(&proc->_futex[i].lock);
+    cnd_destroy(&proc->_futex[i].cnd);
+  }
+}
+
+// initialize the futex table
+static int v__finit(vproc *proc) {
+  for (int i = 0; i < VFBUCKETS; i++) {
+    vfbucket *b = &proc->_futex[i];
+    b->head = NULL;
+    if (thrd_success != mtx_init(&b->lock, mtx_plain)) {
+      v__fdestroy(proc, i);
+      return VENOMEM;
+    }
+    if (thrd_success != cnd_init(&b->cnd)) {
+      mtx_destroy(&b->lock);
+      v__fdestroy(proc, i);
+      return VENOMEM;
+    }
+  }
+  atomic_store(&proc->_ftimed, 0);
+  atomic_store(&proc->_funtil, ~(vqword)0);
+  atomic_store(&proc->_fscan, 0);
+
+  return VOK;
+}
+
+// initialize a process context, with a frame pool if it's asked for
+static int v__pinit(vproc *proc, struct vopts *opt, char pool) {
   if (NULL == proc) return VERROR;
   int stat = VOK;
 
@@ -60,31 +131,138 @@ int vpinit(vproc *proc, struct vopts *opt) {
   if (VOK != stat)
     return stat;
 
-  // initialize the thread list
-  proc->thrd = (vthrd**)malloc(sizeof(vthrd*));
-  if (NULL == proc->thrd) {
+  // the epochs of the guest threads, before anything runs in the background
+  stat = veinit(&proc->epoch);
+  if (VOK != stat) {
     vmdestroy(&proc->mem);
+    return stat;
+  }
+  proc->mem.epoch = &proc->epoch;
+
+  // bound the resident memory
+  if (NULL != opt) proc->mem.limit = opt->memlimit;
+
+  // back the frames with huge pages, if asked to. this falls back to the
+  // regular pages by itself
+  if (pool && NULL != opt && 0 < opt->hugesz) {
+    stat = vmhuge(&proc->mem, opt->hugesz);
+    if (VOK != stat) {
+      vmdestroy(&proc->mem);
+      vedestroy(&proc->epoch);
+      return stat;
+    }
+  }
+
+  // compress the cold pages in the background
+  if (NULL != opt && 0 < opt->coldms) {
+    stat = vmcompress(&proc->mem, opt->coldms);
+    if (VOK != stat) {
+      vmdestroy(&proc->mem);
+      vedestroy(&proc->epoch);
+      return stat;
+    }
+  }
+
+  // swap the memory out once it's over the budget
+  if (NULL != opt && NULL != opt->swapfile) {
+    stat = vmswap(&proc->mem, opt->swapfile, opt->budget);
+    if (VOK != stat) {
+      vmdestroy(&proc->mem);
+      vedestroy(&proc->epoch);
+      return stat;
+    }
+  }
+
+  // initialize the thread list, with its first chunk
+  memset(proc->thrd, 0, sizeof(proc->thrd));
+  proc->thrd[0] = (vthrd**)calloc(VTCHUNK, sizeof(vthrd*));
+  if (NULL == proc->thrd[0]) {
+    vmdestroy(&proc->mem);
+    vedestroy(&proc->epoch);
     return VENOMEM;
   }
 
   // pre-allocate main thread ctx
-  proc->thrd[0] = (vthrd*)malloc(sizeof(vthrd));
-  if (NULL == proc->thrd) {
+  vthrd *mainthr = (vthrd*)calloc(1, sizeof(vthrd));
+  if (NULL == mainthr) {
     vmdestroy(&proc->mem);
-    free(proc->thrd);
+    vedestroy(&proc->epoch);
+    free(proc->thrd[0]);
     return VENOMEM;
   }
+  mainthr->proc = proc;
+  proc->thrd[0][0] = mainthr;
 
   // setup the thrd list lock
-  if (0 != rw_init(&proc->_thrd_lock)) {
+  amtx_init(&proc->_thrd_lock);
+
+  // and what the threads waiting on the others sleep on
+  if (thrd_success != mtx_init(&proc->_exit_lock, mtx_plain)) {
+    vmdestroy(&proc->mem);
+    vedestroy(&proc->epoch);
+    free(mainthr);
+    free(proc->thrd[0]);
+    return VENOMEM;
+  }
+  if (thrd_success != cnd_init(&proc->_exit)) {
+    mtx_destroy(&proc->_exit_lock);
+    vmdestroy(&proc->mem);
+    vedestroy(&proc->epoch);
+    free(mainthr);
+    free(proc->thrd[0]);
+    return VENOMEM;
+  }
+
+  // the workers are spawned once there are threads to run, the scheduler's
+  // once the process runs
+  memset(&proc->_workers, 0, sizeof(vworkers));
+  memset(&proc->_sched, 0, sizeof(vsched));
+  proc->_parked = NULL;
+  if (thrd_success != mtx_init(&proc->_workers.lock, mtx_plain) ||
+      thrd_success != cnd_init(&proc->_workers.cnd) ||
+      thrd_success != mtx_init(&proc->_sched.lock, mtx_plain) ||
+      thrd_success != cnd_init(&proc->_sched.cnd))
+  {
+    mtx_destroy(&proc->_sched.lock);
+    cnd_destroy(&proc->_workers.cnd);
+    mtx_destroy(&proc->_workers.lock);
+    mtx_destroy(&proc->_exit_lock);
+    cnd_destroy(&proc->_exit);
+    vmdestroy(&proc->mem);
+    vedestroy(&proc->epoch);
+    free(mainthr);
+    free(proc->thrd[0]);
+    return VENOMEM;
+  }
+
+  // and the futex table
+  if (VOK != v__finit(proc)) {
+    mtx_destroy(&proc->_sched.lock);
+    cnd_destroy(&proc->_sched.cnd);
+    mtx_destroy(&proc->_workers.lock);
+    cnd_destroy(&proc->_workers.cnd);
+    mtx_destroy(&proc->_exit_lock);
+    cnd_destroy(&proc->_exit);
     vmdestroy(&proc->mem);
-    free(proc->thrd);
+    vedestroy(&proc->epoch);
+    free(mainthr);
     free(proc->thrd[0]);
     return VENOMEM;
   }
+  vlname(&proc->_thrd_lock, "vproc._thrd_lock");
 
   proc->opts = opt;
 
+  // the tasks take turns every so often. the threads each on a host thread
+  // run until they're preempted by it, unless there's a quantum
+  proc->_slice = ~(vqword)0;
+  proc->_slicens = 0;
+  proc->_det = NULL != opt && opt->deterministic;
+  atomic_store(&proc->_dskip, 0);
+  if (NULL != opt && (0 < opt->tasks || proc->_det)) proc->_slice = V__SSLICE;
+  if (NULL != opt && 0 < opt->quantum) proc->_slice = opt->quantum;
+  if (NULL != opt && !proc->_det) proc->_slicens = opt->quantumus * 1000;
+
   // set some variables
   atomic_store(&proc->nexec, 0);
   atomic_store(&proc->exitcode, 0);
@@ -92,13 +270,46 @@ int vpinit(vproc *proc, struct vopts *opt) {
   atomic_store(&proc->crash_stat, 0);
   atomic_store(&proc->alive, 0);
   atomic_store(&proc->active, 0);
+  atomic_store(&proc->_solo, 0);
   proc->_thrd_used = 0;
-  proc->_thrd_alloc = 1;
+  proc->_thrd_daemons = 0;
+  proc->_thrd_next = 1;
+  proc->_thrd_pool = NULL;
 
   atomic_store(&proc->state, VSINIT);
   return VOK;
 }
 
+int vpinit(vproc *proc, struct vopts *opt) {
+  return v__pinit(proc, opt, 1);
+}
+
+int vpclone(vproc *dst, vproc *src) {
+  if (NULL == dst || NULL == src) return VERROR;
+
+  // only a loaded process that's not running yet can be cloned
+  if (VSLOAD != atomic_load(&src->state)) return VERROR;
+
+  // the clone uses the frame pool of the source
+  int stat = v__pinit(dst, src->opts, 0);
+  if (VOK != stat) return stat;
+
+  stat = vmclone(&dst->mem, &src->mem);
+  if (VOK != stat) {
+    atomic_store(&dst->state, VSDONE);
+    vpdestroy(dst);
+    return stat;
+  }
+
+  // main starts from where the one of the source would
+  vthrd *mainthr = v__thrd(dst, 0);
+  memcpy(mainthr->reg, v__thrd(src, 0)->reg, sizeof(vqword) * 16);
+  mainthr->flags = v__thrd(src, 0)->flags & VTRESUME;
+
+  atomic_store(&dst->state, VSLOAD);
+  return VOK;
+}
+
 int vpdestroy(vproc *proc) {
   if (NULL == proc) return VERROR;
 
@@ -108,14 +319,30 @@ int vpdestroy(vproc *proc) {
 
   proc->opts = NULL;
 
-  // destroy the page table
-  vmdestroy(&proc->mem);
+  // the workers finish what's left in their queue first
+  v__wstop(proc);
+  v__sstop(proc);
+
+  vlforget(&proc->_thrd_lock);
+  mtx_destroy(&proc->_exit_lock);
+  cnd_destroy(&proc->_exit);
+  v__fdestroy(proc, VFBUCKETS);
 
-  // de-allocate the thread list
-  if (NULL != proc->thrd) {
-    if (NULL != proc->thrd[0]) free(proc->thrd[0]);
-    free(proc->thrd);
-    proc->thrd = NULL;
+  // destroy the page table, then what it retired
+  vmdestroy(&proc->mem);
+  vedestroy(&proc->epoch);
+
+  // de-allocate the thread list, the contexts left in it and the pooled ones
+  for (vdword c = 0; c < VTCHUNKS && NULL != proc->thrd[c]; c++) {
+    for (vdword i = 0; i < VTCHUNK; i++)
+      free(proc->thrd[c][i]);
+    free(proc->thrd[c]);
+    proc->thrd[c] = NULL;
+  }
+  while (NULL != proc->_thrd_pool) {
+    vthrd *thr = proc->_thrd_pool;
+    proc->_thrd_pool = thr->_next;
+    free(thr);
   }
   // set some variables
   atomic_store(&proc->nexec, 0);
@@ -124,16 +351,18 @@ int vpdestroy(vproc *proc) {
   atomic_store(&proc->crash_stat, 0);
   atomic_store(&proc->alive, 0);
   atomic_store(&proc->active, 0);
+  atomic_store(&proc->_solo, 0);
   proc->_thrd_used = 0;
-  proc->_thrd_alloc = 0;
-  // destroy the thrd lock
-  rw_destroy(&proc->_thrd_lock);
+  proc->_thrd_daemons = 0;
+  proc->_thrd_next = 0;
 
   atomic_store(&proc->state, VSEMPTY);
   return VOK;
 }
 
-int vload(vproc *proc, vbyte *stream, vqword sz) {
+// load the program. segments are populated from the stream lazily, when
+// 'zcopy' is set, page-aligned segments are mapped straight from it instead
+static int v__load(vproc *proc, vbyte *stream, vqword sz, int zcopy) {
   if (NULL == proc || NULL == stream || VSINIT != atomic_load(&proc->state))
     return VERROR;
 
@@ -154,7 +383,7 @@ int vload(vproc *proc, vbyte *stream, vqword sz) {
   d++;
 
   // extract the entry address
-  proc->thrd[0]->reg[RIP] = v__urq(d);
+  v__thrd(proc, 0)->reg[RIP] = v__urq(d);
   d += 8;
 
   // parse and process the load table
@@ -174,9 +403,32 @@ int vload(vproc *proc, vbyte *stream, vqword sz) {
 
     if (foffst >= sz || foffst + size > sz) return VEMALF;
 
+    // map the whole pages of page-aligned segments directly from the
+    // stream, only the trailing partial page needs to be populated. a page an
+    // earlier segment put something in keeps it, and is populated as well
+    if (VLLOAD == type && zcopy && 0 == (maddr & VPAGEMASK) &&
+        0 == (foffst & VPAGEMASK))
+    {
+      vqword done = 0;
+      for ( ; done + VPAGESZ <= size; done += VPAGESZ) {
+        vqword ndx = (maddr + done) >> VPAGESHIFT;
+        vmpage *pg = NULL;
+        if (VESEGV == vmgetp(&proc->mem, ndx, &pg))
+          stat = vmmapf(&proc->mem, ndx, flags, stream + foffst + done);
+        else
+          stat = vmlazy(&proc->mem, maddr + done, stream + foffst + done,
+                        VPAGESZ);
+        if (VOK != stat) return stat;
+      }
+      foffst += done;
+      maddr += done;
+      size -= done;
+      if (0 == size) continue;
+    }
+
     // map pages
-    vqword pgfrom = maddr >> 14;
-    vqword pgto = (maddr + size - 1) >> 14;
+    vqword pgfrom = maddr >> VPAGESHIFT;
+    vqword pgto = (maddr + size - 1) >> VPAGESHIFT;
     for ( ; pgfrom <= pgto; pgfrom++) {
       stat = vmmap(&proc->mem, pgfrom, flags);
       if (VOK != stat) return stat;
@@ -185,10 +437,10 @@ int vload(vproc *proc, vbyte *stream, vqword sz) {
     // store segment onto memory
     switch (type) {
       case VLLOAD:
-        stat = vmsetd(&proc->mem, stream + foffst, maddr, size, flags & 7);
+        stat = vmlazy(&proc->mem, maddr, stream + foffst, size);
         break;
       case VLINIT:
-        stat = vmfilld(&proc->mem, maddr, size, 0);
+        stat = vmlazy(&proc->mem, maddr, NULL, size);
         break;
       default:
         stat = VEMALF;
@@ -201,6 +453,14 @@ int vload(vproc *proc, vbyte *stream, vqword sz) {
   return VOK;
 }
 
+int vload(vproc *proc, vbyte *stream, vqword sz) {
+  return v__load(proc, stream, sz, 0);
+}
+
+int vloadmap(vproc *proc, vbyte *stream, vqword sz) {
+  return v__load(proc, stream, sz, 1);
+}
+
 int vstart(vproc *proc, int *tid, vqword instptr, vqword staddr) {
   if (NULL == proc) return VERROR;
 
@@ -208,96 +468,547 @@ int vstart(vproc *proc, int *tid, vqword instptr, vqword staddr) {
   int state = atomic_load(&proc->state);
   if (VSLOAD != state && VSACTIVE != state) return VERROR;
 
-  // allocate 'arg', passed to the new thread
-  struct __vyt_thrdarg *arg = (struct __vyt_thrdarg*)malloc(
-    sizeof(struct __vyt_thrdarg));
-  if (NULL == arg)
-    return VENOMEM;
-  arg->proc = proc;
+  // main isn't alone anymore. the caller is offline if it's a guest thread,
+  // in a syscall, so it's not waited for
+  v__pshare(proc);
 
-  // allocate thread ctx structure
-  vthrd *thr = (vthrd*)malloc(sizeof(vthrd));
-  if (NULL == thr) {
-    free(arg);
-    return VENOMEM;
+  // acquire the thread list lock
+  amtx_lock(&proc->_thrd_lock);
+
+  // reuse the ctx of a thread that's gone, along with its tid. otherwise
+  // hand out the next tid, the table grows by a chunk every so often
+  vthrd *thr = proc->_thrd_pool;
+  if (NULL != thr) {
+    proc->_thrd_pool = thr->_next;
+  }
+  else {
+    vdword at = proc->_thrd_next;
+    if (VTCHUNK * VTCHUNKS <= at) {
+      amtx_unlock(&proc->_thrd_lock);
+      return VETHRD;
+    }
+    if (NULL == proc->thrd[at / VTCHUNK])
+      proc->thrd[at / VTCHUNK] = (vthrd**)calloc(VTCHUNK, sizeof(vthrd*));
+    thr = NULL == proc->thrd[at / VTCHUNK] ? NULL :
+          (vthrd*)calloc(1, sizeof(vthrd));
+    if (NULL == thr) {
+      amtx_unlock(&proc->_thrd_lock);
+      return VENOMEM;
+    }
+    thr->tid = at;
+    thr->proc = proc;
+    proc->_thrd_next++;
   }
 
   // initialize the thread ctx
   thr->flags = VTALIVE;
+  thr->_stframe = NULL;
+  atomic_store(&thr->_kill, 0);
+  thr->_daemon = 0;
+  thr->_runs++;
   memset(&thr->reg[0], 0, sizeof(vqword) * 16);
   thr->reg[RIP] = instptr;
   thr->reg[RSP] = staddr;
   thr->reg[RBP] = staddr;
-  arg->thr = thr;
+  proc->thrd[thr->tid / VTCHUNK][thr->tid % VTCHUNK] = thr;
+  if (NULL != tid) *tid = thr->tid;
+
+  // a loaded process is running from now on, before the thread can see it.
+  // one that's running may have crashed in the meantime, don't bring it back
+  atomic_compare_exchange_strong(&proc->state, &state, VSACTIVE);
+
+  // hand it to the scheduler, or to the workers
+  if (0 < proc->_sched.n) {
+    v__tenter(thr);
+    veoffline(&thr->_ep);
+    v__spush(proc, thr);
+  }
+  else if (VOK != v__wpush(proc, thr)) {
+    // failed to start new thread, do cleanup and return
+    proc->thrd[thr->tid / VTCHUNK][thr->tid % VTCHUNK] = NULL;
+    thr->_next = proc->_thrd_pool;
+    proc->_thrd_pool = thr;
 
-  // acquire the thread list lock
-  rw_wlock(&proc->_thrd_lock);
-
-  // check if there's still some free slots in the thread list
-  // +1 for the main thread (slot 0 is reserved for main)
-  if (proc->_thrd_alloc > proc->_thrd_used + 1) {
-    for (vqword i = 1; i < proc->_thrd_alloc; i++) {
-      if (NULL == proc->thrd[i]) {
-
-        // this slot is unused! let's use it
-        proc->thrd[i] = thr;
-        thr->tid = i;
-        if (NULL != tid) *tid = i;
-        break;
+    amtx_unlock(&proc->_thrd_lock);
+
+    // set the vm state to crashed
+    atomic_store(&proc->state, VSCRASH);
+    v__pwake(proc);
+    return VETHRD;
+  }
+
+  // increment the number of thread allocated on the list
+  proc->_thrd_used++;
+
+  amtx_unlock(&proc->_thrd_lock);
+
+  return VOK;
+}
+
+// a worker, it runs the queued threads one after the other
+static int v__wwork(void *arg) {
+  vworkers *w = &((vproc*)arg)->_workers;
+
+  mtx_lock(&w->lock);
+  for (;;) {
+    while (NULL == w->head && !w->stop) {
+      w->idle++;
+      cnd_wait(&w->cnd, &w->lock);
+      w->idle--;
+    }
+
+    // stopped, once the queue is drained
+    if (NULL == w->head) break;
+
+    vthrd *thr = w->head;
+    w->head = thr->_next;
+    if (NULL == w->head) w->tail = NULL;
+    w->queued--;
+    mtx_unlock(&w->lock);
+
+    v__execunit(thr);
+
+    mtx_lock(&w->lock);
+  }
+  mtx_unlock(&w->lock);
+
+  return 0;
+}
+
+// spawn another worker, the caller holds the lock of the workers
+static int v__wspawn(vproc *proc) {
+  vworkers *w = &proc->_workers;
+
+  if (w->used >= w->alloc) {
+    vdword n = 0 == w->alloc ? 4 : w->alloc * 2;
+    thrd_t *list = (thrd_t*)realloc(w->thrd, sizeof(thrd_t) * n);
+    if (NULL == list) return VENOMEM;
+    w->thrd = list;
+    w->alloc = n;
+  }
+  if (thrd_success != thrd_create(&w->thrd[w->used], v__wwork, proc))
+    return VETHRD;
+  w->used++;
+
+  return VOK;
+}
 
+int v__wpush(vproc *proc, vthrd *thr) {
+  vworkers *w = &proc->_workers;
+  int stat = VOK;
+
+  mtx_lock(&w->lock);
+  thr->_next = NULL;
+  if (NULL == w->tail) w->head = thr;
+  else w->tail->_next = thr;
+  w->tail = thr;
+  w->queued++;
+
+  // wake an idle worker up, or make one. the queued threads may be waited on
+  // by the ones running, so they can't wait for a worker to free up. unless
+  // there are none at all
+  if (w->idle >= w->queued) cnd_signal(&w->cnd);
+  else if (VOK != (stat = v__wspawn(proc)) && 0 < w->used) stat = VOK;
+
+  // take it back out, it would never run
+  if (VOK != stat) {
+    w->head = w->tail = NULL;
+    w->queued = 0;
+  }
+  mtx_unlock(&w->lock);
+
+  return stat;
+}
+
+void v__wstop(vproc *proc) {
+  vworkers *w = &proc->_workers;
+
+  mtx_lock(&w->lock);
+  w->stop = 1;
+  cnd_broadcast(&w->cnd);
+  mtx_unlock(&w->lock);
+
+  // nothing spawns them anymore
+  for (vdword i = 0; i < w->used; i++)
+    thrd_join(w->thrd[i], NULL);
+  free(w->thrd);
+  w->thrd = NULL;
+  w->used = 0;
+  w->alloc = 0;
+
+  mtx_destroy(&w->lock);
+  cnd_destroy(&w->cnd);
+}
+
+// the bucket of the futex at 'addr'
+static inline vfbucket *v__fbucket(vproc *proc, vqword addr) {
+  return &proc->_futex[((addr >> 2) * 2654435761u) & (VFBUCKETS - 1)];
+}
+
+// the time a timeout of 'ns' from now ends, for cnd_timedwait
+static inline struct timespec v__fts(vqword ns) {
+  struct timespec ts = {
+    .tv_sec  = ns / 1000000000ull,
+    .tv_nsec = ns % 1000000000ull,
+  };
+  return ts;
+}
+
+// lower the first timeout of the tasks to 'until'
+static inline void v__funtil(vproc *proc, vqword until) {
+  vqword at = atomic_load(&proc->_funtil);
+  while (until < at &&
+         !atomic_compare_exchange_weak(&proc->_funtil, &at, until));
+}
+
+// take a waiting thread out of its bucket, the caller holds the bucket lock
+static void v__funlink(vproc *proc, vfbucket *b, vthrd *thr, int state) {
+  for (vthrd **at = &b->head; NULL != *at; at = &(*at)->_fnext) {
+    if (thr != *at) continue;
+    *at = thr->_fnext;
+    break;
+  }
+  thr->_fstate = state;
+  if (0 != thr->_funtil && 0 < proc->_sched.n)
+    atomic_fetch_sub(&proc->_ftimed, 1);
+}
+
+int v__fwait(vproc *proc, vthrd *thr, vqword addr, vdword expect, vqword ns) {
+  // a dword, like the ones cas works on
+  if (0 != (addr & 3)) return VEALIGN;
+
+  vfbucket *b = v__fbucket(proc, addr);
+  vbyte buf[4];
+
+  // the wakers change it before they take the lock, so it's either seen
+  // changed here or they find the thread waiting
+  mtx_lock(&b->lock);
+  int stat = vmgetd(&proc->mem, buf, addr, 4, VPREAD);
+  if (VOK != stat || v__urd(buf) != expect) {
+    mtx_unlock(&b->lock);
+    thr->reg[R8] = 1;
+    return stat;
+  }
+
+  // the same goes for v__fcancel, it's done waiting already
+  if (VSACTIVE != atomic_load(&proc->state) || atomic_load(&thr->_kill)) {
+    mtx_unlock(&b->lock);
+    thr->reg[R8] = 0;
+    return VOK;
+  }
+
+  // in the order they came in
+  vthrd **at = &b->head;
+  while (NULL != *at) at = &(*at)->_fnext;
+  *at = thr;
+  thr->_fnext = NULL;
+  thr->_faddr = addr;
+  thr->_fstate = V__FWAIT;
+  thr->_funtil = 0 != ns ? v__pnow(proc) + ns : 0;
+  thr->reg[R8] = 0;
+
+  // a task is parked, and woken up by whoever takes it out of the bucket.
+  // the workers look after the timeouts
+  if (0 < proc->_sched.n) {
+    if (0 != thr->_funtil) {
+      atomic_fetch_add(&proc->_ftimed, 1);
+      v__funtil(proc, thr->_funtil);
+    }
+    thr->_sw = V__SWSLEEP;
+    mtx_unlock(&b->lock);
+    return VOK;
+  }
+
+  struct timespec ts = v__fts(thr->_funtil);
+  while (V__FWAIT == thr->_fstate) {
+    if (0 == thr->_funtil) {
+      cnd_wait(&b->cnd, &b->lock);
+    }
+    else if (thrd_timedout == cnd_timedwait(&b->cnd, &b->lock, &ts) &&
+             V__FWAIT == thr->_fstate)
+    {
+      v__funlink(proc, b, thr, V__FTIME);
+    }
+  }
+  if (V__FTIME == thr->_fstate) thr->reg[R8] = 2;
+  thr->_fstate = V__FNONE;
+  mtx_unlock(&b->lock);
+
+  return VOK;
+}
+
+vqword v__fwake(vproc *proc, vqword addr, vqword n) {
+  vfbucket *b = v__fbucket(proc, addr);
+  vthrd *woken = NULL;
+  vqword count = 0;
+
+  mtx_lock(&b->lock);
+  vthrd *thr = b->head;
+  while (NULL != thr && count < n) {
+    vthrd *next = thr->_fnext;
+    if (addr == thr->_faddr) {
+      v__funlink(proc, b, thr, V__FWOKEN);
+      thr->_fnext = woken;
+      woken = thr;
+      count++;
+    }
+    thr = next;
+  }
+  if (0 < count && 0 == proc->_sched.n) cnd_broadcast(&b->cnd);
+  mtx_unlock(&b->lock);
+
+  // the tasks are queued again, the others wake up by themselves
+  while (0 < proc->_sched.n && NULL != woken) {
+    thr = woken;
+    woken = thr->_fnext;
+    v__tunpark(proc, thr);
+  }
+
+  return count;
+}
+
+void v__fcancel(vproc *proc) {
+  int over = VSACTIVE != atomic_load(&proc->state);
+
+  for (int i = 0; i < VFBUCKETS; i++) {
+    vfbucket *b = &proc->_futex[i];
+    vthrd *woken = NULL;
+
+    mtx_lock(&b->lock);
+    vthrd *thr = b->head;
+    while (NULL != thr) {
+      vthrd *next = thr->_fnext;
+      if (over || atomic_load(&thr->_kill)) {
+        v__funlink(proc, b, thr, V__FWOKEN);
+        thr->_fnext = woken;
+        woken = thr;
       }
+      thr = next;
+    }
+    if (NULL != woken && 0 == proc->_sched.n) cnd_broadcast(&b->cnd);
+    mtx_unlock(&b->lock);
+
+    while (0 < proc->_sched.n && NULL != woken) {
+      thr = woken;
+      woken = thr->_fnext;
+      v__tunpark(proc, thr);
     }
   }
+}
 
-  // the thread list is full, try re-allocate
-  else {
-    vthrd **tmp = (vthrd**)realloc(proc->thrd,
-                                   sizeof(vthrd*) * proc->_thrd_alloc * 2);
-
-    // failed to re-allocate the thread list
-    if (NULL == tmp) {
-      free(arg);
-      free(thr);
-      rw_wunlock(&proc->_thrd_lock);
-      return VENOMEM;
+// wake up the tasks that timed out on a futex, one worker at a time
+static void v__ftimers(vproc *proc) {
+  if (0 == atomic_load(&proc->_ftimed) ||
+      v__pnow(proc) < atomic_load(&proc->_funtil) ||
+      atomic_exchange(&proc->_fscan, 1))
+    return;
+
+  // the ones that wait from now on lower it again by themselves
+  atomic_store(&proc->_funtil, ~(vqword)0);
+  vqword now = v__pnow(proc);
+
+  for (int i = 0; i < VFBUCKETS; i++) {
+    vfbucket *b = &proc->_futex[i];
+    vthrd *timed = NULL;
+
+    mtx_lock(&b->lock);
+    vthrd *thr = b->head;
+    while (NULL != thr) {
+      vthrd *next = thr->_fnext;
+      if (0 != thr->_funtil && now >= thr->_funtil) {
+        v__funlink(proc, b, thr, V__FTIME);
+        thr->reg[R8] = 2;
+        thr->_fnext = timed;
+        timed = thr;
+      }
+      else if (0 != thr->_funtil) {
+        v__funtil(proc, thr->_funtil);
+      }
+      thr = next;
     }
+    mtx_unlock(&b->lock);
+
+    while (NULL != timed) {
+      thr = timed;
+      timed = thr->_fnext;
+      v__tunpark(proc, thr);
+    }
+  }
+
+  atomic_store(&proc->_fscan, 0);
+}
 
-    // initialize new structures
-    for (vqword i = 0; i < proc->_thrd_alloc; i++)
-      tmp[proc->_thrd_alloc + i] = NULL;
+// the scheduler of the worker running on this host thread, and its queue
+static _Thread_local vsched *v__scur = NULL;
+static _Thread_local vdword v__sself = 0;
 
-    // the end of the last allocation is now available! use it
-    tmp[proc->_thrd_alloc] = thr;
-    thr->tid = proc->_thrd_alloc;
-    if (NULL != tid) *tid = proc->_thrd_alloc;
+// take the first task of a queue
+static vthrd *v__spop(vsched *s, vdword at) {
+  vrunq *q = &s->q[at];
 
-    proc->_thrd_alloc *= 2;
-    proc->thrd = tmp;
+  fmtx_lock(&q->lock);
+  vthrd *thr = q->head;
+  if (NULL != thr) {
+    q->head = thr->_next;
+    if (NULL == q->head) q->tail = NULL;
   }
+  fmtx_unlock(&q->lock);
 
-  // try start new thread
-  if (thrd_create(&thr->handle, v__execunit, arg) != 0) {
-    // failed to start new thread, do cleanup and return
-    proc->thrd[thr->tid] = NULL;
-    free(arg);
-    free(thr);
+  if (NULL != thr) atomic_fetch_sub(&s->ready, 1);
+  return thr;
+}
 
-    rw_wunlock(&proc->_thrd_lock);
+// run a task for a slice, then queue it again unless it's gone or parked
+static void v__srun(vproc *proc, vthrd *thr) {
+  int stat = VOK;
 
-    // set the vm state to crashed
-    atomic_store(&proc->state, VSCRASH);
-    return VETHRD;
+  veonline(&proc->epoch, &thr->_ep);
+  int r = v__tstep(thr, proc->_slice, proc->_slicens, &stat);
+  if (V__TEXIT == r) {
+    v__texit(thr, stat);
+    return;
   }
+  veoffline(&thr->_ep);
 
-  // increment the number of thread allocated on the list
-  proc->_thrd_used++;
+  // it may have been woken up already, then it's up to us to queue it
+  if (V__TPARK == r) {
+    if (V__PWOKEN != atomic_exchange(&thr->_park, V__PPARKED)) return;
+    atomic_store(&thr->_park, V__PNONE);
+  }
+  v__spush(proc, thr);
+}
 
-  rw_wunlock(&proc->_thrd_lock);
-  atomic_store(&proc->state, VSACTIVE);
+// a worker of the scheduler, it runs the tasks of its own queue and steals
+// the others' once it runs out
+static int v__swork(void *arg) {
+  vproc *proc = (vproc*)arg;
+  vsched *s = &proc->_sched;
+  vdword self = atomic_fetch_add(&s->started, 1);
+
+  v__scur = s;
+  v__sself = self;
+  for (;;) {
+    v__ftimers(proc);
+
+    vthrd *thr = v__spop(s, self);
+    for (vdword i = 1; NULL == thr && i < s->n; i++)
+      thr = v__spop(s, (self + i) % s->n);
+    if (NULL != thr) {
+      v__srun(proc, thr);
+      continue;
+    }
+
+    // nothing to run anywhere, sleep until something's queued or a task times
+    // out. stopped, once everything's run
+    mtx_lock(&s->lock);
+    atomic_fetch_add(&s->idle, 1);
+    while (0 == atomic_load(&s->ready) && !atomic_load(&s->stop)) {
+      if (0 == atomic_load(&proc->_ftimed)) {
+        cnd_wait(&s->cnd, &s->lock);
+        continue;
+      }
+
+      // deterministic, there's nothing to run until the first timeout. the
+      // clock is moved on to it, rather than waited on
+      if (proc->_det) {
+        vqword now = v__pnow(proc);
+        vqword until = atomic_load(&proc->_funtil);
+        if (until > now) atomic_fetch_add(&proc->_dskip, until - now);
+        break;
+      }
+      struct timespec ts = v__fts(atomic_load(&proc->_funtil));
+      if (thrd_timedout == cnd_timedwait(&s->cnd, &s->lock, &ts)) break;
+    }
+    atomic_fetch_sub(&s->idle, 1);
+    int done = 0 == atomic_load(&s->ready) && atomic_load(&s->stop);
+    mtx_unlock(&s->lock);
+    if (done) break;
+  }
+  v__scur = NULL;
+
+  return 0;
+}
+
+// start the scheduler, with 'n' workers
+static int v__sstart(vproc *proc, vdword n) {
+  vsched *s = &proc->_sched;
+
+  s->q = (vrunq*)calloc(n, sizeof(vrunq));
+  s->thrd = (thrd_t*)calloc(n, sizeof(thrd_t));
+  if (NULL == s->q || NULL == s->thrd) {
+    free(s->q);
+    free(s->thrd);
+    s->q = NULL;
+    s->thrd = NULL;
+    return VENOMEM;
+  }
+  for (vdword i = 0; i < n; i++) {
+    fmtx_init(&s->q[i].lock);
+    vlname(&s->q[i].lock, "vsched.q.lock");
+  }
+  s->n = n;
+
+  // the queues of the workers that couldn't be spawned are stolen from
+  for (vdword i = 0; i < n; i++)
+    if (thrd_success == thrd_create(&s->thrd[s->used], v__swork, proc))
+      s->used++;
+  if (0 == s->used) return VETHRD;
+
+  return VOK;
+}
+
+int v__spush(vproc *proc, vthrd *thr) {
+  vsched *s = &proc->_sched;
+
+  // the workers keep what they make and yield to themselves, the rest is
+  // spread over the queues
+  vdword at = s == v__scur ? v__sself :
+              atomic_fetch_add_explicit(&s->next, 1, memory_order_relaxed) %
+              s->n;
+  vrunq *q = &s->q[at];
+
+  atomic_fetch_add(&s->ready, 1);
+  thr->_next = NULL;
+  fmtx_lock(&q->lock);
+  if (NULL == q->tail) q->head = thr;
+  else q->tail->_next = thr;
+  q->tail = thr;
+  fmtx_unlock(&q->lock);
+
+  // an idle worker steals it, if there's one
+  if (0 < atomic_load(&s->idle)) {
+    mtx_lock(&s->lock);
+    cnd_signal(&s->cnd);
+    mtx_unlock(&s->lock);
+  }
 
   return VOK;
 }
 
+void v__sstop(vproc *proc) {
+  vsched *s = &proc->_sched;
+
+  mtx_lock(&s->lock);
+  atomic_store(&s->stop, 1);
+  cnd_broadcast(&s->cnd);
+  mtx_unlock(&s->lock);
+
+  for (vdword i = 0; i < s->used; i++)
+    thrd_join(s->thrd[i], NULL);
+  for (vdword i = 0; i < s->n; i++)
+    vlforget(&s->q[i].lock);
+  free(s->q);
+  free(s->thrd);
+  s->q = NULL;
+  s->thrd = NULL;
+  s->n = 0;
+  s->used = 0;
+  atomic_store(&s->started, 0);
+
+  mtx_destroy(&s->lock);
+  cnd_destroy(&s->cnd);
+}
+
 int vrun(vproc *proc) {
   if (NULL == proc) return VERROR;
 
@@ -306,42 +1017,74 @@ int vrun(vproc *proc) {
 
   int stat = VOK;
 
-  // setup 'arg', passed to main's execution unit
-  struct __vyt_thrdarg *arg = (struct __vyt_thrdarg*)malloc(
-    sizeof(struct __vyt_thrdarg));
-  if (NULL == arg)
-    return VENOMEM;
-  arg->thr = proc->thrd[0];
-  arg->proc = proc;
-  proc->thrd[0]->flags = VTALIVE;
-
-  // setup main's stack
-  proc->thrd[0]->reg[RSP] = MAIN_STACK_START;
-  proc->thrd[0]->reg[RBP] = MAIN_STACK_START;
-
-  // map the stack memory
-  for (vqword loc = MAIN_STACK_START - 1,
-       to = (MAIN_STACK_START - proc->opts->stacksz);
-       loc >= to;
-       loc -= VPAGESZ)
-  {
-    stat = vmmap(&proc->mem, loc >> 14, VPREAD | VPWRITE);
-    if (VOK != stat) return stat;
+  vthrd *mainthr = v__thrd(proc, 0);
+
+  // main resumed from a snapshot already has its stack
+  if (!(VTRESUME & mainthr->flags)) {
+
+    // setup main's stack
+    mainthr->reg[RSP] = MAIN_STACK_START;
+    mainthr->reg[RBP] = MAIN_STACK_START;
+
+    // map the stack memory
+    for (vqword loc = MAIN_STACK_START - 1,
+         to = (MAIN_STACK_START - proc->opts->stacksz);
+         loc >= to;
+         loc -= VPAGESZ)
+    {
+      stat = vmmap(&proc->mem, loc >> VPAGESHIFT, VPREAD | VPWRITE);
+      if (VOK != stat) return stat;
+    }
   }
 
+  mainthr->flags = VTALIVE;
+  mainthr->_stframe = NULL;
+
   // TODO: setup args
 
   // increment number of active threads and set the vm state to active
   proc->_thrd_used++;
+
+  // the only thread so far, it goes without the locks until it's joined by
+  // another one. unless one was started in the meantime
+  if (1 == proc->_thrd_used && VOK == vmsolo(&proc->mem, &mainthr->_ep) &&
+      !atomic_compare_exchange_strong(&proc->_solo, &(int){ 0 }, 1))
+    vmunsolo(&proc->mem, NULL);
+
   atomic_store(&proc->state, VSACTIVE);
 
-  // run main
-  v__execunit(arg);
-  arg = NULL;
+  // the threads run as tasks, main too. deterministic, on a single worker
+  vdword tasks = NULL == proc->opts ? 0 : proc->opts->tasks;
+  if (proc->_det) tasks = 1;
+  if (0 < tasks) {
+    stat = v__sstart(proc, tasks);
+    if (VOK != stat) {
+      atomic_store(&proc->state, VSCRASH);
+      atomic_store(&proc->crash_stat, stat);
+      return stat;
+    }
+    v__tenter(mainthr);
+    veoffline(&mainthr->_ep);
+    v__spush(proc, mainthr);
+  }
+  else {
+    // the spare workers, it's fine if they can't be spawned yet
+    mtx_lock(&proc->_workers.lock);
+    for (int i = 0; i < V__WSPARE; i++)
+      v__wspawn(proc);
+    mtx_unlock(&proc->_workers.lock);
+
+    // run main
+    v__execunit(mainthr);
+  }
 
-  // main is done, wait for other threads to finish
-  while (atomic_load(&proc->state) == VSACTIVE)
-    thrd_yield();
+  // main is done, sleep until the other threads are too. after a crash,
+  // until they've seen it
+  mtx_lock(&proc->_exit_lock);
+  while (VSACTIVE == atomic_load(&proc->state) ||
+         0 < atomic_load(&proc->alive))
+    cnd_wait(&proc->_exit, &proc->_exit_lock);
+  mtx_unlock(&proc->_exit_lock);
 
   // handle any crashes
   v__handle_crash(proc);
@@ -357,7 +1100,7 @@ int v__handle_crash(vproc *proc) {
 
   // get the crashed thread
   vdword tid = atomic_load(&proc->crash_tid);
-  vthrd *thr = proc->thrd[tid];
+  vthrd *thr = v__thrd(proc, tid);
   int stat = atomic_load(&proc->crash_stat);
 
   // print some useful crash details
@@ -365,7 +1108,28 @@ int v__handle_crash(vproc *proc) {
   // ... cli args, program name, program args
   fprintf(stderr, "abi:       %u\n", VVERSION);
   fprintf(stderr, "tid:       %d\n", tid);
+  struct vmstats ms;
+  vmstat(&proc->mem, &ms);
   fprintf(stderr, "mem:       %llu pages\n", proc->mem._used);
+  fprintf(stderr, "mapped:    %llu KiB\n", (unsigned long long)ms.mapped >> 10);
+  fprintf(stderr, "resident:  %llu KiB\n",
+          (unsigned long long)ms.resident >> 10);
+  fprintf(stderr, "owned:     %llu KiB\n", (unsigned long long)ms.owned >> 10);
+  if (0 != ms.limit)
+    fprintf(stderr, "limit:     %llu KiB\n", (unsigned long long)ms.limit >> 10);
+  if (0 != ms.store)
+    fprintf(stderr, "comp:      %llu KiB in %llu KiB (%.1fx), %llu faults\n",
+            (unsigned long long)ms.compressed >> 10,
+            (unsigned long long)ms.store >> 10,
+            (double)ms.compressed / ms.store,
+            (unsigned long long)ms.cfaults);
+  if (0 != ms.swapout)
+    fprintf(stderr, "swap:      %llu KiB out, %llu faults, %llu KiB read, "
+            "%llu KiB written\n",
+            (unsigned long long)ms.swapped >> 10,
+            (unsigned long long)ms.sfaults,
+            (unsigned long long)ms.swapin >> 10,
+            (unsigned long long)ms.swapout >> 10);
   fprintf(stderr, "code:      %d\n", stat);
   fprintf(stderr, "cause:     ");
   vperr(stat);
@@ -387,38 +1151,49 @@ int v__handle_crash(vproc *proc) {
   fprintf(stderr, "     rfl %016llx %lld\n", thr->reg[RFL], thr->reg[RFL]);
   fprintf(stderr, "\n");
 
-  // free the crashed thread ctx
-  free(thr);
-  proc->thrd[tid] = NULL;
+  // the crashed thread ctx is freed along with the process
   return VOK;
 }
 
-int v__execunit(void *arg) {
-  // get the thread info
-  vthrd* thr  = ((struct __vyt_thrdarg*)arg)->thr;
-  vproc *proc = ((struct __vyt_thrdarg*)arg)->proc;
-  free(arg);
+// a thread starts running
+static void v__tenter(vthrd *thr) {
+  vproc *proc = thr->proc;
 
   // increment number of alive threads
   atomic_fetch_add(&proc->alive, 1);
+
+  // each instruction boundary is a quiescent point
+  vejoin(&proc->epoch, &thr->_ep);
+}
+
+int v__tstep(vthrd *thr, vqword slice, vqword ns, int *res) {
+  vproc *proc = thr->proc;
   int stat = VOK;
+  vqword ran = 0;
+  vqword blocks = 0;
+  vqword until = 0 != ns ? v__snow() + ns : 0;
   vbyte buf[23];
 
+  thr->_sw = V__SWNONE;
   while (1) {
+    vequiesce(&proc->epoch, &thr->_ep);
+
     // check if there's no error in last execution, the runtime is still active,
     // and this thread is still alive
     if (
       VOK != stat ||
       atomic_load(&proc->state) != VSACTIVE ||
-      !(thr->flags & VTALIVE)
+      !(thr->flags & VTALIVE) ||
+      atomic_load_explicit(&thr->_kill, memory_order_relaxed)
     ) break;
     // increment active threads count
-    atomic_fetch_add(&proc->active, 1);
+    int solo = 1 == atomic_load(&proc->_solo);
+    V__PADD(proc->active, 1, solo);
 
     // decode the instruction here
     stat = vmgetd(&proc->mem, buf, thr->reg[RIP], 3, VPREAD | VPEXEC);
     if (VOK != stat) {
-      atomic_fetch_sub(&proc->active, 1);
+      V__PADD(proc->active, -1, solo);
       break;
     }
     // get the opcode
@@ -437,7 +1212,7 @@ int v__execunit(void *arg) {
                   op1sz + op2sz,
                   VPREAD | VPEXEC);
     if (VOK != stat) {
-      atomic_fetch_sub(&proc->active, 1);
+      V__PADD(proc->active, -1, solo);
       break;
     }
     vbyte *op1 = buf + 3;
@@ -446,7 +1221,9 @@ int v__execunit(void *arg) {
     // - 3     - opcode and wordsize
     // - op1sz - size of the first opcode
     // - op2sz - size of the second opcode
+    vqword at = thr->reg[RIP];
     thr->reg[RIP] += 3 + op1sz + op2sz;
+    vqword next = thr->reg[RIP];
 
     // switch though opcodes
     switch (opcode) {
@@ -455,7 +1232,12 @@ int v__execunit(void *arg) {
     proc, thr, wsz, mop1, op1sz, op1, mop2, op2sz, op2      \
   ); break
 
-      ICALL(0x0001, sys);
+      // the syscalls may block, don't hold the others back meanwhile
+      case 0x0001:
+        veoffline(&thr->_ep);
+        stat = VINST_sys(proc, thr, wsz, mop1, op1sz, op1, mop2, op2sz, op2);
+        veonline(&proc->epoch, &thr->_ep);
+        break;
       ICALL(0x0002, lod);
       ICALL(0x0003, mov);
       ICALL(0x0004, call);
@@ -492,35 +1274,99 @@ int v__execunit(void *arg) {
       ICALL(0x0023, imul);
       ICALL(0x0024, idiv);
       ICALL(0x0025, imod);
+      ICALL(0x0030, cas);
+      ICALL(0x0031, xadd);
+      ICALL(0x0032, xchg);
+      ICALL(0x0033, fence);
 
 #undef ICALL
       default: stat = VEINST;
     }
 
-    // decrement active threads count
-    atomic_fetch_sub(&proc->active, 1);
-    atomic_fetch_add(&proc->nexec, 1);
+    // decrement active threads count. a syscall may have started another
+    // thread, that's not alone anymore then
+    solo = 1 == atomic_load(&proc->_solo);
+    V__PADD(proc->active, -1, solo);
+    if (VOK != stat) continue;
+
+    // a blocking syscall parked it, it's run again from the syscall once
+    // woken up. so it doesn't count yet
+    if (V__SWPARK == thr->_sw) {
+      thr->reg[RIP] = at;
+      return V__TPARK;
+    }
+    V__PADD(proc->nexec, 1, solo);
+    if (V__SWSLEEP == thr->_sw) return V__TPARK;
+    if (V__SWYIELD == thr->_sw) return V__TRUN;
+
+    // the slice is over at the end of a block only, where nothing's half done.
+    // the clock is read every so many blocks
+    ran++;
+    if (next != thr->reg[RIP]) {
+      if (slice <= ran) return V__TRUN;
+      if (0 != until && 0 == (++blocks & (V__SBLOCKS - 1)) &&
+          v__snow() >= until)
+        return V__TRUN;
+    }
   }
 
+  *res = stat;
+  return V__TEXIT;
+}
+
+// a thread is gone, after 'stat'
+static int v__texit(vthrd *thr, int stat) {
+  vproc *proc = thr->proc;
+
+  veleave(&proc->epoch, &thr->_ep);
+
+  // main's record may be gone with it
+  v__pshare(proc);
+
   // error occured, crash the vm!
   if (VOK != stat) {
     atomic_store(&proc->state, VSCRASH);
     atomic_store(&proc->crash_tid, thr->tid);
     atomic_store(&proc->crash_stat, stat);
+
+    // the thread ctx is kept for the crash report
+    atomic_fetch_sub(&proc->alive, 1);
+    v__pwake(proc);
     return stat;
   }
 
-  // do some clean-ups
-  rw_wlock(&proc->_thrd_lock);
-  proc->thrd[thr->tid] = NULL;
+  // do some clean-ups. the thread ctx goes back to the pool, but main's, its
+  // tid is not handed out again
+  amtx_lock(&proc->_thrd_lock);
+  proc->thrd[thr->tid / VTCHUNK][thr->tid % VTCHUNK] = NULL;
+  if (0 != thr->tid) {
+    thr->_next = proc->_thrd_pool;
+    proc->_thrd_pool = thr;
+  }
   proc->_thrd_used--;
-  if (0 == proc->_thrd_used) atomic_store(&proc->state, VSDONE);
-  rw_wunlock(&proc->_thrd_lock);
+  if (thr->_daemon) proc->_thrd_daemons--;
+  if (proc->_thrd_daemons == proc->_thrd_used)
+    atomic_store(&proc->state, VSDONE);
+  amtx_unlock(&proc->_thrd_lock);
 
-  // free thread ctx
-  free(thr);
+  // the thread ctx may be reused as soon as it's back in the pool
+  if (0 == thr->tid) free(thr);
 
   // decrement number of alive threads
   atomic_fetch_sub(&proc->alive, 1);
+  v__pwake(proc);
   return VOK;
 }
+
+int v__execunit(void *arg) {
+  vthrd *thr = (vthrd*)arg;
+  int stat = VOK;
+
+  // the host schedules the threads here, they give up their host thread
+  // between the slices
+  v__tenter(thr);
+  while (V__TEXIT != v__tstep(thr, thr->proc->_slice, thr->proc->_slicens,
+                              &stat))
+    thrd_yield();
+  return v__texit(thr, stat);
+}
@@ -2,6 +2,7 @@
 #define _VYT_EXEC_H
 #include <threads.h>
 #include <stdatomic.h>
+#include <string.h>
 #include "vyt.h"
 #include "mem.h"
 #include "locks.h"
@@ -12,16 +13,151 @@
 
 struct vopts {
   vqword            stacksz;          /* main's stack size */
+  char              *snapfile;        /* written by the snap syscall */
+  vqword            hugesz;           /* huge page frame pool, 0 if unused */
+  vqword            memlimit;         /* max resident bytes, 0 for no limit */
+  vqword            coldms;           /* cold page sampling period, 0 if off */
+  char              *swapfile;        /* swap file, NULL for no swapping */
+  vqword            budget;           /* resident bytes to keep when swapping */
+  vdword            tasks;            /* host threads to run the guest threads
+                                         on as tasks, 0 for one each */
+  vqword            quantum;          /* instructions a thread runs for before
+                                         the others get a turn, 0 for the
+                                         default */
+  vqword            quantumus;        /* microseconds it runs for at most, 0 if
+                                         unbounded */
+  char              deterministic;    /* run the threads as tasks on a single
+                                         host thread, by quantum only. the
+                                         futex timeouts count instructions */
 };
 
-typedef struct {
+/* the thread table is chunked, the chunks never move once allocated */
+#define VTCHUNK     256   /* threads per chunk */
+#define VTCHUNKS    256   /* chunks, so at most 65536 threads */
+
+struct _vproc_s;
+
+typedef struct _vthrd_s {
   vdword            tid;
-  thrd_t            handle;
+  struct _vproc_s   *proc;
   vbyte             flags;
   vqword            reg[16];
+
+  /* the current stack page, for the push and pop fast path */
+  vbyte             *_stframe;
+  vqword            _stbase;
+  vqword            _stslot;
+  vqword            _stgen;
+
+  /* its record in the epochs of the process */
+  verec             _ep;
+
+  /* set by tkill, the thread stops before its next instruction */
+  _Atomic int       _kill;
+
+  /* a daemon doesn't keep the process alive, see tdaem */
+  char              _daemon;
+
+  /* how many threads ran on this context, to tell them apart */
+  vqword            _runs;
+
+  /* why it stopped running before its slice was over, see V__SW*. and
+   * whether it's parked, see v__tpark */
+  vbyte             _sw;
+  _Atomic int       _park;
+
+  /* the futex it waits on, see v__fwait. under the lock of its bucket */
+  vqword            _faddr;
+  vqword            _funtil;          /* when it times out, 0 if it doesn't */
+  int               _fstate;          /* see V__F* */
+  struct _vthrd_s   *_fnext;          /* in the bucket */
+
+  /* the next context in the pool once the thread is gone, in the queue of
+   * the workers before it runs, or in the parked ones */
+  struct _vthrd_s   *_next;
 } vthrd;
 
+/* internal: why a thread stops running before its slice is over */
+#define V__SWNONE   0
+#define V__SWYIELD  1     /* tyld */
+#define V__SWPARK   2     /* a blocking syscall parked it */
+#define V__SWSLEEP  3     /* parked, but the syscall's done */
+
+/* internal: the states of a thread on a futex */
+#define V__FNONE    0
+#define V__FWAIT    1
+#define V__FWOKEN   2
+#define V__FTIME    3     /* timed out */
+
+/* internal: the states of a parked thread, the worker it ran on and the one
+ * waking it up race to run it again */
+#define V__PNONE    0
+#define V__PPARKED  1     /* stopped running */
+#define V__PWOKEN   2     /* woken up before it stopped */
+
+/* internal: what a thread stopped running for, see v__tstep */
+#define V__TRUN     0     /* its slice is over, or it yielded */
+#define V__TPARK    1
+#define V__TEXIT    2
+
+/**
+ * the host threads the guest threads run on, but main. they're kept around
+ * once spawned, a new one is only spawned when none of them is idle
+ */
+typedef struct {
+  vthrd             *head;            /* the queue of threads to run */
+  vthrd             *tail;
+  vdword            queued;
+  vdword            idle;
+  char              stop;
+  thrd_t            *thrd;
+  vdword            used;
+  vdword            alloc;
+  mtx_t             lock;
+  cnd_t             cnd;
+} vworkers;
+
+/* a run queue of the scheduler */
+typedef struct {
+  vthrd             *head;
+  vthrd             *tail;
+  fmtx_t            lock;
+} vrunq;
+
+/* the buckets of the futex table, a power of two */
+#define VFBUCKETS   64
+
+/* a bucket of the futex table, the threads waiting on the addresses that
+ * hash to it */
+typedef struct {
+  vthrd             *head;
+  mtx_t             lock;
+  cnd_t             cnd;              /* the ones on a host thread of their
+                                         own sleep on it */
+} vfbucket;
+
+/**
+ * the scheduler of the guest threads when they're run as tasks, on a fixed
+ * number of host threads (see vopts.tasks). each worker has a run queue of
+ * its own, and steals from the others once it runs out. the tasks switch at
+ * the end of a block, once their slice is over, on tyld, and when they're
+ * parked by a blocking syscall
+ */
 typedef struct {
+  vrunq             *q;               /* one per worker */
+  thrd_t            *thrd;
+  vdword            n;
+  vdword            used;             /* the workers spawned */
+  _Atomic vdword    started;          /* hands out the queues to the workers */
+  _Atomic vdword    next;             /* the queue to push to from outside */
+  _Atomic int       ready;            /* queued, in all of the queues */
+  _Atomic int       idle;
+  _Atomic int       stop;
+  mtx_t             lock;             /* the idle workers sleep on it */
+  cnd_t             cnd;
+} vsched;
+
+typedef struct _vproc_s {
   struct vopts      *opts;
 
   _Atomic vqword    nexec;
@@ -31,13 +167,48 @@ typedef struct {
   _Atomic int       crash_stat;
 
   vmem              mem;
+  vepoch            epoch;            /* of the guest threads */
 
-  vthrd             **thrd;
+  /* the threads by tid, see v__thrd. the contexts of the threads that are
+   * gone are pooled, they keep their tid and are handed out first */
+  vthrd             **thrd[VTCHUNKS];
   _Atomic vdword    alive;
   _Atomic vdword    active;
   vdword            _thrd_used;
-  vdword            _thrd_alloc;
-  rw_t              _thrd_lock;
+  vdword            _thrd_daemons;
+  vdword            _thrd_next;       /* the first tid never handed out */
+  vthrd             *_thrd_pool;
+  amtx_t            _thrd_lock;
+
+  /* 1 while main is the only thread there's been, it goes without the locks
+   * and the atomics meant for the others. -1 once another one is started */
+  _Atomic int       _solo;
+
+  /* broadcast whenever a thread exits, for the ones waiting on it */
+  mtx_t             _exit_lock;
+  cnd_t             _exit;
+
+  /* the tasks parked until then, under the same lock */
+  vthrd             *_parked;
+
+  /* the threads waiting on a futex, by address. the tasks with a timeout are
+   * woken up by the workers, see v__ftimers */
+  vfbucket          _futex[VFBUCKETS];
+  _Atomic int       _ftimed;          /* the tasks with a timeout */
+  _Atomic vqword    _funtil;          /* the first of them to time out */
+  _Atomic int       _fscan;
+
+  vworkers          _workers;
+  vsched            _sched;
+
+  /* the quanta of the threads, see vopts.quantum */
+  vqword            _slice;
+  vqword            _slicens;
+
+  /* deterministic, see vopts.deterministic. the clock of the futex timeouts
+   * is the instructions run, plus the time skipped while they all slept */
+  char              _det;
+  _Atomic vqword    _dskip;
 } vproc;
 
 /* process states */
@@ -50,6 +221,7 @@ typedef struct {
 
 /* thread flags */
 #define VTALIVE     0x1   /* the thread is alive */
+#define VTRESUME    0x2   /* resumed from a snapshot, keep its registers */
 
 /* load type */
 #define VLLOAD      0x1   /* load from payload */
@@ -97,16 +269,34 @@ typedef struct {
  */
 int vpinit(vproc *proc, struct vopts *opt);
 
+/**
+ * initialize 'dst' as a clone of 'src', a loaded process context that's not
+ * running. the memory of 'src' is shared copy-on-write rather than copied, so
+ * this is cheap regardless of the image size. the clone starts from the entry
+ * point of 'src' with a fresh thread list, and 'src' can be cloned again
+ */
+int vpclone(vproc *dst, vproc *src);
+
 /**
  * destroy the given process context
  */
 int vpdestroy(vproc *proc);
 
 /**
- * load program into given process context
+ * load program into given process context. the pages are populated from
+ * 'stream' the first time they are accessed, so it must stay valid until the
+ * process is destroyed
  */
 int vload(vproc *proc, vbyte *stream, vqword sz);
 
+/**
+ * load program into given process context, without copying the page-aligned
+ * segments. their pages are backed by 'stream' itself, so it must stay valid
+ * until the process is destroyed. writable segments are written through, so
+ * pass a private (copy-on-write) file mapping to keep the image intact
+ */
+int vloadmap(vproc *proc, vbyte *stream, vqword sz);
+
 /**
  * make a new thread
  */
@@ -123,10 +313,112 @@ int vrun(vproc *proc);
 int v__handle_crash(vproc *proc);
 
 /**
- * internal: thread execution unit
+ * internal: thread execution unit, 'arg' is the thread ctx
  */
 int v__execunit(void *arg);
 
+/**
+ * internal: run a thread for 'slice' instructions, or 'ns' nanoseconds unless
+ * it's 0. it's only stopped at the end of a block. returns what it stopped
+ * for, its status is set in 'stat' once it exits
+ */
+int v__tstep(vthrd *thr, vqword slice, vqword ns, int *stat);
+
+/**
+ * internal: queue a task for the scheduler to run
+ */
+int v__spush(vproc *proc, vthrd *thr);
+
+/**
+ * internal: wait on the futex at 'addr' while it holds 'expect', for 'ns'
+ * nanoseconds unless it's 0. a task is parked instead of blocking. sets r8 of
+ * 'thr' to 0 once woken up, 1 if it didn't hold 'expect' and 2 if it timed
+ * out. returns the status of the access
+ */
+int v__fwait(vproc *proc, vthrd *thr, vqword addr, vdword expect, vqword ns);
+
+/**
+ * internal: wake up to 'n' threads waiting on the futex at 'addr', returns how
+ * many were woken up
+ */
+vqword v__fwake(vproc *proc, vqword addr, vqword n);
+
+/**
+ * internal: wake up the threads waiting on a futex that were killed, or all
+ * of them once the process isn't running anymore
+ */
+void v__fcancel(vproc *proc);
+
+/**
+ * internal: stop the scheduler, once it's run what's queued
+ */
+void v__sstop(vproc *proc);
+
+/**
+ * internal: queue a thread for the workers to run
+ */
+int v__wpush(vproc *proc, vthrd *thr);
+
+/**
+ * internal: stop the workers, once they've run what's queued
+ */
+void v__wstop(vproc *proc);
+
+/**
+ * internal: the thread ctx of 'tid', NULL if there's no such thread. the
+ * entries only change under the thread list lock
+ */
+static inline vthrd *v__thrd(vproc *proc, vdword tid) {
+  if (VTCHUNK * VTCHUNKS <= tid) return NULL;
+  vthrd **chunk = proc->thrd[tid / VTCHUNK];
+  return NULL == chunk ? NULL : chunk[tid % VTCHUNK];
+}
+
+/**
+ * internal: park a task instead of blocking its host thread, when they're run
+ * as tasks. the syscall runs again once it's woken up by v__pwake, so it
+ * checks what it waits for again. the caller holds the exit lock, returns
+ * whether it's parked
+ */
+static inline int v__tpark(vproc *proc, vthrd *thr) {
+  if (0 == proc->_sched.n) return 0;
+  thr->_next = proc->_parked;
+  proc->_parked = thr;
+  thr->_sw = V__SWPARK;
+  return 1;
+}
+
+/**
+ * internal: queue a parked task again, unless it's still running. then the
+ * worker it runs on does it once it's stopped
+ */
+static inline void v__tunpark(vproc *proc, vthrd *thr) {
+  if (V__PPARKED != atomic_exchange(&thr->_park, V__PWOKEN)) return;
+  atomic_store(&thr->_park, V__PNONE);
+  v__spush(proc, thr);
+}
+
+/**
+ * internal: wake the threads waiting for another one to exit, they check
+ * what they wait for themselves
+ */
+static inline void v__pwake(vproc *proc) {
+  mtx_lock(&proc->_exit_lock);
+  cnd_broadcast(&proc->_exit);
+  vthrd *parked = proc->_parked;
+  proc->_parked = NULL;
+  mtx_unlock(&proc->_exit_lock);
+
+  while (NULL != parked) {
+    vthrd *thr = parked;
+    parked = thr->_next;
+    v__tunpark(proc, thr);
+  }
+
+  // the ones on a futex don't wait for the others, unless the process is over
+  if (VSACTIVE != atomic_load(&proc->state)) v__fcancel(proc);
+}
+
 /* returns the data size in bytes from given wordsize */
 static inline int v__wsz(vbyte wsz) {
   switch (wsz) {
@@ -178,15 +470,81 @@ static inline vqword v__maddr(vbyte opmode, vbyte *op, vthrd *thr) {
   }
 }
 
+/* whether a naturally aligned 'sz' bytes at 'addr' are in the cached stack
+ * page of a thread */
+static inline int v__sthit(vproc *proc, vthrd *thr, vqword addr, vqword sz) {
+  if (NULL == thr->_stframe || 0 != (addr & (sz - 1)) ||
+      VPAGESZ <= addr - thr->_stbase)
+    return 0;
+
+  // mark it as accessed before checking that the frame is still there, the
+  // compressor checks them the other way around
+  vmtouch(&proc->mem, thr->_stslot);
+  return thr->_stgen == atomic_load(&proc->mem._gen);
+}
+
+/* cache the stack page at 'addr', once it's populated */
+static inline void v__stcache(vproc *proc, vthrd *thr, vqword addr) {
+  vqword gen = atomic_load(&proc->mem._gen);
+  vmpage *pg = NULL;
+  thr->_stframe = NULL;
+
+  // the page 0 is never accessible
+  if (0 == addr >> VPAGESHIFT) return;
+  if (VOK != vmgetp(&proc->mem, addr >> VPAGESHIFT, &pg)) return;
+  if ((pg->flags & (VPREAD | VPWRITE)) != (VPREAD | VPWRITE)) return;
+  if (NULL == pg->frame) return;
+
+  // shared frames are copied by vmsetd first
+  if (VPCOW & pg->flags) return;
+
+  // stores through the cache bypass vmsetd, so mark it now. checkpoints
+  // invalidate the cache, so it's marked again after each of them
+  vmdirty(&proc->mem, pg);
+
+  thr->_stframe = pg->frame;
+  thr->_stbase = addr & ~VPAGEMASK;
+  thr->_stslot = pg - proc->mem.page;
+  thr->_stgen = gen;
+}
+
+/* copy the 1, 2, 4 or 8 bytes of a stack slot, in a single host access */
+static inline void v__stcopy(vbyte *dst, vbyte *src, vqword sz) {
+  switch (sz) {
+    case 1:   memcpy(dst, src, 1); break;
+    case 2:   memcpy(dst, src, 2); break;
+    case 4:   memcpy(dst, src, 4); break;
+    case 8:   memcpy(dst, src, 8); break;
+    default:  memcpy(dst, src, sz);
+  }
+}
+
 /* push bytes to a thread's stack */
 static inline int vstpush(vproc *proc, vthrd *thr, vbyte *data, vqword sz) {
   thr->reg[RSP] -= sz;
-  return vmsetd(&proc->mem, data, thr->reg[RSP], sz, VPWRITE);
+
+  // fast path, the slot is within the cached stack page
+  if (v__sthit(proc, thr, thr->reg[RSP], sz)) {
+    v__stcopy(thr->_stframe + (thr->reg[RSP] - thr->_stbase), data, sz);
+    return VOK;
+  }
+
+  int stat = vmsetd(&proc->mem, data, thr->reg[RSP], sz, VPWRITE);
+  if (VOK == stat) v__stcache(proc, thr, thr->reg[RSP]);
+  return stat;
 }
 
 /* pop bytes from a thread's stack */
 static inline int vstpop(vproc *proc, vthrd *thr, vbyte *data, vqword sz) {
+  // fast path, the slot is within the cached stack page
+  if (v__sthit(proc, thr, thr->reg[RSP], sz)) {
+    v__stcopy(data, thr->_stframe + (thr->reg[RSP] - thr->_stbase), sz);
+    thr->reg[RSP] += sz;
+    return VOK;
+  }
+
   int stat = vmgetd(&proc->mem, data, thr->reg[RSP], sz, VPREAD);
+  if (VOK == stat) v__stcache(proc, thr, thr->reg[RSP]);
   thr->reg[RSP] += sz;
   return stat;
 }
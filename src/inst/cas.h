@@ -0,0 +1,29 @@
+#ifndef _VYT_INST_CAS_H
+#define _VYT_INST_CAS_H
+#include "../vyt.h"
+#include "../exec.h"
+#include "../mem.h"
+
+static inline int VINST_cas(vproc *proc, vthrd *thr, vbyte wsz, vbyte mop1, vbyte op1sz, vbyte *op1, vbyte mop2, vbyte op2sz, vbyte *op2) {
+  if ((DRELADDR != mop1 && DABSADDR != mop1 && DDYNADDR != mop1) ||
+      DREG != mop2)
+    return VEINST;
+
+  // the value expected is in r8, it's compared in the operand size
+  vqword sz = v__wsz(wsz);
+  vqword mask = 8 == sz ? ~(vqword)0 : ((vqword)1 << (sz * 8)) - 1;
+  vqword cmp = thr->reg[R8] & mask;
+  vqword val = thr->reg[*op2];
+
+  int stat = vmatomic(&proc->mem, v__maddr(mop1, op1, thr), sz, VMACAS, &val,
+                      cmp);
+  if (VOK != stat) return stat;
+
+  // r8 gets what was found, and whether it was swapped
+  thr->reg[R8] = val;
+  vfset(thr, RFL_ZF, val == cmp);
+
+  return VOK;
+}
+
+#endif // _VYT_INST_CAS_H
@@ -0,0 +1,17 @@
+#ifndef _VYT_INST_FENCE_H
+#define _VYT_INST_FENCE_H
+#include <stdatomic.h>
+#include "../vyt.h"
+#include "../exec.h"
+
+static inline int VINST_fence(vproc *proc, vthrd *thr, vbyte wsz, vbyte mop1, vbyte op1sz, vbyte *op1, vbyte mop2, vbyte op2sz, vbyte *op2) {
+  if (DNONE != mop1 || DNONE != mop2)
+    return VEINST;
+
+  // the plain accesses before it are seen before the ones after it
+  atomic_thread_fence(memory_order_seq_cst);
+
+  return VOK;
+}
+
+#endif // _VYT_INST_FENCE_H
@@ -11,6 +11,15 @@ static inline int VINST_sys(vproc *proc, vthrd *thr, vbyte wsz, vbyte mop1, vbyt
 
   switch (v__urw(op1)) {
     case 0x0001: return VSYCL_exit(proc, thr);
+    case 0x000a: return VSYCL_tmake(proc, thr);
+    case 0x000b: return VSYCL_tjoin(proc, thr);
+    case 0x000c: return VSYCL_tdaem(proc, thr);
+    case 0x000d: return VSYCL_tkill(proc, thr);
+    case 0x000e: return VSYCL_tyld(proc, thr);
+    case 0x000f: return VSYCL_tself(proc, thr);
+    case 0x0010: return VSYCL_snap(proc, thr);
+    case 0x0011: return VSYCL_fwait(proc, thr);
+    case 0x0012: return VSYCL_fwake(proc, thr);
   }
 
   return VESYCL;
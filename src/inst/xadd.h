@@ -0,0 +1,22 @@
+#ifndef _VYT_INST_XADD_H
+#define _VYT_INST_XADD_H
+#include "../vyt.h"
+#include "../exec.h"
+#include "../mem.h"
+
+static inline int VINST_xadd(vproc *proc, vthrd *thr, vbyte wsz, vbyte mop1, vbyte op1sz, vbyte *op1, vbyte mop2, vbyte op2sz, vbyte *op2) {
+  if ((DRELADDR != mop1 && DABSADDR != mop1 && DDYNADDR != mop1) ||
+      DREG != mop2)
+    return VEINST;
+
+  // the register gets what was there before it was added to
+  vqword val = thr->reg[*op2];
+  int stat = vmatomic(&proc->mem, v__maddr(mop1, op1, thr), v__wsz(wsz),
+                      VMAADD, &val, 0);
+  if (VOK != stat) return stat;
+  thr->reg[*op2] = val;
+
+  return VOK;
+}
+
+#endif // _VYT_INST_XADD_H
@@ -0,0 +1,21 @@
+#ifndef _VYT_INST_XCHG_H
+#define _VYT_INST_XCHG_H
+#include "../vyt.h"
+#include "../exec.h"
+#include "../mem.h"
+
+static inline int VINST_xchg(vproc *proc, vthrd *thr, vbyte wsz, vbyte mop1, vbyte op1sz, vbyte *op1, vbyte mop2, vbyte op2sz, vbyte *op2) {
+  if ((DRELADDR != mop1 && DABSADDR != mop1 && DDYNADDR != mop1) ||
+      DREG != mop2)
+    return VEINST;
+
+  vqword val = thr->reg[*op2];
+  int stat = vmatomic(&proc->mem, v__maddr(mop1, op1, thr), v__wsz(wsz),
+                      VMAXCHG, &val, 0);
+  if (VOK != stat) return stat;
+  thr->reg[*op2] = val;
+
+  return VOK;
+}
+
+#endif // _VYT_INST_XCHG_H
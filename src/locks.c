@@ -0,0 +1,171 @@
+#include <string.h>
+#include <time.h>
+#include "vyt.h"
+#include "locks.h"
+
+#ifdef VLOCKSTATS
+
+// NOTE:
+// - the named locks are found by address, in an open-addressed table that's
+//   read without locking. the forgotten ones leave a tombstone behind
+// - the locks held by a thread are stacked with the time they were taken at,
+//   for the hold times
+#define V__LNAMES     32
+#define V__LTABLE     1024
+#define V__LHOLDS     16
+#define V__LTOMB      ((const void*)v__ltable)
+
+static vlstat v__lnames[V__LNAMES];
+static int v__lnames_used = 0;
+
+static struct {
+  _Atomic(const void*) lock;
+  vlstat            *stat;
+} v__ltable[V__LTABLE];
+
+// the registry, the names and the table entries
+static fmtx_t v__lreg = 0;
+
+static _Thread_local struct {
+  const void        *lock;
+  uint64_t          at;
+} v__lheld[V__LHOLDS];
+static _Thread_local int v__lheld_used = 0;
+
+static inline unsigned v__lhash(const void *lock) {
+  return ((uintptr_t)lock >> 4) * 2654435761u & (V__LTABLE - 1);
+}
+
+uint64_t v__lnow(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+vlstat *v__lstat(const void *lock) {
+  unsigned h = v__lhash(lock);
+  for (unsigned i = 0; i < V__LTABLE; i++, h = (h + 1) & (V__LTABLE - 1)) {
+    const void *at = atomic_load_explicit(&v__ltable[h].lock,
+                                          memory_order_acquire);
+    if (NULL == at) return NULL;
+    if (lock == at) return v__ltable[h].stat;
+  }
+  return NULL;
+}
+
+void v__lacq(const void *lock, vlstat *st, uint64_t t0, int contended) {
+  uint64_t now = v__lnow();
+  uint64_t wait = now - t0;
+
+  atomic_fetch_add_explicit(&st->acquires, 1, memory_order_relaxed);
+  if (contended) {
+    atomic_fetch_add_explicit(&st->contended, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->wait_ns, wait, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&st->wait_max, memory_order_relaxed);
+    while (wait > max && !atomic_compare_exchange_weak(&st->wait_max, &max,
+                                                       wait));
+  }
+
+  // too many held at once, this one's hold time goes uncounted
+  if (V__LHOLDS <= v__lheld_used) return;
+  v__lheld[v__lheld_used].lock = lock;
+  v__lheld[v__lheld_used].at = now;
+  v__lheld_used++;
+}
+
+void v__lrel(const void *lock, vlstat *st) {
+  // most likely the last one taken
+  for (int i = v__lheld_used - 1; i >= 0; i--) {
+    if (lock != v__lheld[i].lock) continue;
+    atomic_fetch_add_explicit(&st->hold_ns, v__lnow() - v__lheld[i].at,
+                              memory_order_relaxed);
+    v__lheld_used--;
+    memmove(&v__lheld[i], &v__lheld[i + 1],
+            sizeof(*v__lheld) * (v__lheld_used - i));
+    return;
+  }
+}
+
+void vlname(const void *lock, const char *name) {
+  if (NULL == lock || NULL == name) return;
+
+  fmtx_lock(&v__lreg);
+
+  // the locks going by the same name share the statistics
+  vlstat *st = NULL;
+  for (int i = 0; NULL == st && i < v__lnames_used; i++)
+    if (0 == strcmp(name, v__lnames[i].name)) st = &v__lnames[i];
+  if (NULL == st && V__LNAMES > v__lnames_used) {
+    st = &v__lnames[v__lnames_used++];
+    st->name = name;
+  }
+
+  // take the first free entry, unless it's in there already
+  int slot = -1;
+  unsigned h = v__lhash(lock);
+  for (unsigned i = 0; NULL != st && i < V__LTABLE;
+       i++, h = (h + 1) & (V__LTABLE - 1))
+  {
+    const void *at = atomic_load(&v__ltable[h].lock);
+    if (lock == at) {
+      v__ltable[h].stat = st;
+      slot = -1;
+      break;
+    }
+    if (-1 == slot && (NULL == at || V__LTOMB == at)) slot = h;
+    if (NULL == at) break;
+  }
+  if (-1 != slot) {
+    v__ltable[slot].stat = st;
+    atomic_store_explicit(&v__ltable[slot].lock, lock, memory_order_release);
+  }
+
+  fmtx_unlock(&v__lreg);
+}
+
+void vlforget(const void *lock) {
+  if (NULL == lock) return;
+
+  fmtx_lock(&v__lreg);
+  unsigned h = v__lhash(lock);
+  for (unsigned i = 0; i < V__LTABLE; i++, h = (h + 1) & (V__LTABLE - 1)) {
+    const void *at = atomic_load(&v__ltable[h].lock);
+    if (NULL == at) break;
+    if (lock == at) {
+      atomic_store_explicit(&v__ltable[h].lock, V__LTOMB,
+                            memory_order_release);
+      break;
+    }
+  }
+  fmtx_unlock(&v__lreg);
+}
+
+int vlstats(FILE *out) {
+  if (NULL == out) return VERROR;
+
+  fprintf(out, "%-20s %10s %10s %12s %12s %12s\n", "lock", "acquires",
+          "contended", "wait (us)", "max (us)", "hold (us)");
+
+  fmtx_lock(&v__lreg);
+  for (int i = 0; i < v__lnames_used; i++) {
+    vlstat *st = &v__lnames[i];
+    fprintf(out, "%-20s %10llu %10llu %12.1f %12.1f %12.1f\n", st->name,
+            (unsigned long long)atomic_load(&st->acquires),
+            (unsigned long long)atomic_load(&st->contended),
+            atomic_load(&st->wait_ns) / 1e3,
+            atomic_load(&st->wait_max) / 1e3,
+            atomic_load(&st->hold_ns) / 1e3);
+  }
+  fmtx_unlock(&v__lreg);
+
+  return VOK;
+}
+
+#else
+
+int vlstats(FILE *out) {
+  (void)out;
+  return VERROR;
+}
+
+#endif // VLOCKSTATS
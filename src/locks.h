@@ -1,17 +1,126 @@
 #ifndef _VYT_LOCKS_H
 #define _VYT_LOCKS_H
+#include <stdio.h>
+#include <stdint.h>
 #include <threads.h>
 #include <stdatomic.h>
+#include <limits.h>
+
+// for parking the threads waiting on an adaptive mutex
+#if defined(__linux__)
+#   include <unistd.h>
+#   include <sys/syscall.h>
+#   include <linux/futex.h>
+#   define HAVE_FUTEX
+#endif
+
+// spins to back off up to, before giving the cpu away
+#define V__LSPINMAX   1024
+
+#ifdef VLOCKSTATS
 
 /**
- * a fast-mutex, avoids context switching and blocking overhead
- * 
+ * the statistics of the locks going by a name
+ */
+typedef struct {
+  const char        *name;
+  _Atomic uint64_t  acquires;
+  _Atomic uint64_t  contended; /* the ones that had to wait */
+  _Atomic uint64_t  wait_ns;
+  _Atomic uint64_t  wait_max;
+  _Atomic uint64_t  hold_ns;
+} vlstat;
+
+/**
+ * count the lock under 'name' from now on, the locks sharing a name add up
+ */
+void vlname(const void *lock, const char *name);
+
+/**
+ * stop counting the lock, before it's destroyed
+ */
+void vlforget(const void *lock);
+
+// the statistics of a lock, NULL if it has no name
+vlstat *v__lstat(const void *lock);
+
+// the monotonic clock, in nanoseconds
+uint64_t v__lnow(void);
+
+// the lock was taken, after waiting since 't0'
+void v__lacq(const void *lock, vlstat *st, uint64_t t0, int contended);
+
+// the lock is about to be released
+void v__lrel(const void *lock, vlstat *st);
+
+// the hooks in the locks, one acquire starts with V__LSTART and ends with
+// V__LTAKEN, telling if it had to wait
+#define V__LSTART(lock)                                                     \
+  vlstat *v__ls = v__lstat(lock);                                           \
+  uint64_t v__lt0 = NULL != v__ls ? v__lnow() : 0
+#define V__LTAKEN(lock, c)                                                  \
+  do { if (NULL != v__ls) v__lacq(lock, v__ls, v__lt0, c); } while (0)
+#define V__LDROP(lock)                                                      \
+  do {                                                                      \
+    vlstat *v__ls = v__lstat(lock);                                         \
+    if (NULL != v__ls) v__lrel(lock, v__ls);                                \
+  } while (0)
+
+#else
+
+#define vlname(lock, name)    ((void)0)
+#define vlforget(lock)        ((void)0)
+#define V__LSTART(lock)
+#define V__LTAKEN(lock, c)    ((void)(c))
+#define V__LDROP(lock)        ((void)0)
+
+#endif // VLOCKSTATS
+
+/**
+ * print the statistics of the named locks. returns VERROR if they're not
+ * counted, in the builds without VLOCKSTATS
+ */
+int vlstats(FILE *out);
+
+// spins of an adaptive mutex before it parks the thread
+#define V__LADAPT     128
+
+/**
+ * tell the cpu we're spinning, it's a hint to go easy on the sibling
+ * hyperthread and the memory bus
+ */
+static inline void v__lpause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * back off for 'n' spins, doubling it for the next time. yields once it gets
+ * too long
+ */
+static inline void v__lbackoff(unsigned *n) {
+  if (V__LSPINMAX < *n) {
+    thrd_yield();
+    return;
+  }
+  for (unsigned i = 0; i < *n; i++)
+    v__lpause();
+  *n <<= 1;
+}
+
+/**
+ * a fast-mutex, a test-and-test-and-set spinlock with exponential backoff
+ *
  * NOTE:
- * - it may not be as cpu efficient as the traditional mutex
+ * - waiters spin on a plain load, the cache line is only fought over when
+ *   the lock looks free
+ * - it's not fair, use the ticket lock when that matters
  * - only use for performance critical and short operations
- * - bad in high contention
  */
-typedef _Atomic char fmtx_t;
+typedef _Atomic int fmtx_t;
 
 /**
  * initialize fmtx lock (same as fmtx_unlock)
@@ -20,22 +129,277 @@ static inline void fmtx_init(fmtx_t *mtx) {
   atomic_store(mtx, 0);
 }
 
+/**
+ * try to acquire fmtx lock, returns 1 if it's taken
+ */
+static inline int fmtx_trylock(fmtx_t *mtx) {
+  return 0 == atomic_load_explicit(mtx, memory_order_relaxed) &&
+         0 == atomic_exchange_explicit(mtx, 1, memory_order_acquire);
+}
+
 /**
  * acquire fmtx lock
  */
 static inline void fmtx_lock(fmtx_t *mtx) {
-  while (atomic_load(mtx) != 0)
-    thrd_yield();
-  atomic_store(mtx, 1);
+  V__LSTART(mtx);
+  unsigned n = 1;
+  int waited = 0;
+  while (!fmtx_trylock(mtx)) {
+    v__lbackoff(&n);
+    waited = 1;
+  }
+  V__LTAKEN(mtx, waited);
 }
 
 /**
  * release fmtx lock (same as fmtx_init)
  */
 static inline void fmtx_unlock(fmtx_t *mtx) {
+  V__LDROP(mtx);
+  atomic_store_explicit(mtx, 0, memory_order_release);
+}
+
+/**
+ * a ticket lock, the threads get it in the order they asked for it
+ *
+ * NOTE:
+ * - waiters back off in proportion to how far back in line they are
+ * - a waiter that gets preempted holds up the ones behind it, so keep it to
+ *   short operations as well
+ */
+typedef struct {
+  _Atomic unsigned  next;
+  _Atomic unsigned  serving;
+} tmtx_t;
+
+/**
+ * initialize a ticket lock
+ */
+static inline void tmtx_init(tmtx_t *mtx) {
+  atomic_store(&mtx->next, 0);
+  atomic_store(&mtx->serving, 0);
+}
+
+/**
+ * acquire a ticket lock
+ */
+static inline void tmtx_lock(tmtx_t *mtx) {
+  unsigned me = atomic_fetch_add_explicit(&mtx->next, 1, memory_order_relaxed);
+  unsigned n = 1;
+  for (;;) {
+    unsigned at = atomic_load_explicit(&mtx->serving, memory_order_acquire);
+    if (at == me) return;
+    if (n < (me - at) * 32) n = (me - at) * 32;
+    v__lbackoff(&n);
+  }
+}
+
+/**
+ * release a ticket lock
+ */
+static inline void tmtx_unlock(tmtx_t *mtx) {
+  unsigned at = atomic_load_explicit(&mtx->serving, memory_order_relaxed);
+  atomic_store_explicit(&mtx->serving, at + 1, memory_order_release);
+}
+
+/**
+ * an adaptive mutex, spins for a while then parks the thread on a futex
+ * (or yields, where there are none)
+ *
+ * NOTE:
+ * - 0 when free, 1 when held, 2 when held and someone may be parked on it
+ * - unlocking only makes a syscall when someone may be parked
+ * - good for the operations that are short, but may contend heavily
+ */
+typedef _Atomic int amtx_t;
+
+/**
+ * initialize an adaptive mutex
+ */
+static inline void amtx_init(amtx_t *mtx) {
   atomic_store(mtx, 0);
 }
 
+/**
+ * park on the mutex while it's still 'val'
+ */
+static inline void v__lpark(amtx_t *mtx, int val) {
+#ifdef HAVE_FUTEX
+  syscall(SYS_futex, (int*)mtx, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+  (void)mtx;
+  (void)val;
+  thrd_yield();
+#endif
+}
+
+/**
+ * wake up to 'n' threads parked on the mutex
+ */
+static inline void v__lwake(amtx_t *mtx, int n) {
+#ifdef HAVE_FUTEX
+  syscall(SYS_futex, (int*)mtx, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+  (void)mtx;
+  (void)n;
+#endif
+}
+
+/**
+ * acquire an adaptive mutex
+ */
+static inline void amtx_lock(amtx_t *mtx) {
+  V__LSTART(mtx);
+  int c = 0;
+
+  // the holder is likely to be done soon
+  for (int i = 0; i < V__LADAPT; i++) {
+    c = 0;
+    if (atomic_compare_exchange_weak_explicit(mtx, &c, 1,
+          memory_order_acquire, memory_order_relaxed))
+    {
+      V__LTAKEN(mtx, 0 < i);
+      return;
+    }
+    v__lpause();
+  }
+
+  // it's not, mark it contended and wait for our turn
+  c = atomic_exchange_explicit(mtx, 2, memory_order_acquire);
+  while (0 != c) {
+    v__lpark(mtx, 2);
+    c = atomic_exchange_explicit(mtx, 2, memory_order_acquire);
+  }
+  V__LTAKEN(mtx, 1);
+}
+
+/**
+ * release an adaptive mutex
+ */
+static inline void amtx_unlock(amtx_t *mtx) {
+  V__LDROP(mtx);
+  if (2 == atomic_exchange_explicit(mtx, 0, memory_order_release))
+    v__lwake(mtx, 1);
+}
+
+// reader slots of a brlock, and the size of a cache line
+#define V__BRSLOTS    32
+#define V__LINESZ     64
+
+/**
+ * a big-reader lock, for the data that's read all the time and changed once
+ * in a while. readers only write to their own slot (picked by thread), so
+ * they don't fight over a cache line. writers are expensive, they wait for
+ * every slot to drain
+ *
+ * NOTE:
+ * - writer-preferring, readers stay out while a writer waits
+ * - brw_rlock returns the slot, it's handed back to brw_runlock
+ * - not recursive, a thread holding it must not take it again
+ */
+typedef struct {
+  struct {
+    _Atomic int     n;
+    char            _pad[V__LINESZ - sizeof(_Atomic int)];
+  } slot[V__BRSLOTS];
+  amtx_t            wmtx;   /* writers, one at a time */
+  amtx_t            writer; /* 0, 1 when a writer is in, 2 if readers wait */
+} brw_t;
+
+/**
+ * the reader slot of the calling thread
+ */
+static inline int v__brslot(void) {
+  static _Atomic unsigned next = 0;
+  static _Thread_local int slot = -1;
+  if (-1 == slot) slot = atomic_fetch_add(&next, 1) % V__BRSLOTS;
+  return slot;
+}
+
+/**
+ * initialize a brlock
+ */
+static inline void brw_init(brw_t *rw) {
+  for (int i = 0; i < V__BRSLOTS; i++)
+    atomic_store(&rw->slot[i].n, 0);
+  amtx_init(&rw->wmtx);
+  atomic_store(&rw->writer, 0);
+}
+
+/**
+ * destroy a brlock
+ */
+static inline void brw_destroy(brw_t *rw) {
+  (void)rw;
+}
+
+/**
+ * acquire a brlock for reading, returns the slot to release it with
+ */
+static inline int brw_rlock(brw_t *rw) {
+  V__LSTART(rw);
+  int s = v__brslot();
+  int waited = 0;
+  for (;; waited = 1) {
+    // announce ourselves first, then look for a writer. the writer does the
+    // same the other way around, so one of us always sees the other
+    atomic_fetch_add(&rw->slot[s].n, 1);
+    if (0 == atomic_load(&rw->writer)) {
+      V__LTAKEN(rw, waited);
+      return s;
+    }
+    atomic_fetch_sub(&rw->slot[s].n, 1);
+
+    // wait it out, briefly spinning and then parked
+    for (int i = 0; i < V__LADAPT && 0 != atomic_load(&rw->writer); i++)
+      v__lpause();
+    int w = atomic_load(&rw->writer);
+    while (0 != w) {
+      if (2 == w || atomic_compare_exchange_weak(&rw->writer, &w, 2))
+        v__lpark(&rw->writer, 2);
+      w = atomic_load(&rw->writer);
+    }
+  }
+}
+
+/**
+ * release a brlock held for reading
+ */
+static inline void brw_runlock(brw_t *rw, int slot) {
+  V__LDROP(rw);
+  atomic_fetch_sub_explicit(&rw->slot[slot].n, 1, memory_order_release);
+}
+
+/**
+ * acquire a brlock for writing
+ */
+static inline void brw_wlock(brw_t *rw) {
+  V__LSTART(rw);
+  int waited = 0 != atomic_load_explicit(&rw->wmtx, memory_order_relaxed);
+  amtx_lock(&rw->wmtx);
+  atomic_store(&rw->writer, 1);
+
+  // wait for the readers to leave
+  for (int i = 0; i < V__BRSLOTS; i++) {
+    unsigned n = 1;
+    while (0 != atomic_load(&rw->slot[i].n)) {
+      v__lbackoff(&n);
+      waited = 1;
+    }
+  }
+  V__LTAKEN(rw, waited);
+}
+
+/**
+ * release a brlock held for writing
+ */
+static inline void brw_wunlock(brw_t *rw) {
+  V__LDROP(rw);
+  if (2 == atomic_exchange_explicit(&rw->writer, 0, memory_order_release))
+    v__lwake(&rw->writer, INT_MAX);
+  amtx_unlock(&rw->wmtx);
+}
+
 /**
  * a writer-preferring rw lock implementation, based on:
  * https://en.m.wikipedia.org/wiki/Readers%E2%80%93writer_lock#Using_a_condition_variable_and_a_mutex
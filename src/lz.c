@@ -0,0 +1,140 @@
+#include <string.h>
+#include "lz.h"
+
+// NOTE:
+// - the compressed data is a series of sequences, each of them is:
+//     token      1 B (literal count << 4 | match length - 4)
+//     count      (0xff ... n, when the literal count in the token is 15)
+//     literals   (count B)
+//     offset     2 B (how far back the match is)
+//     length     (0xff ... n, when the match length in the token is 15)
+// - the last sequence has its literals only
+#define V__LZMIN      4
+#define V__LZHASH     12
+#define V__LZWINDOW   0xffff
+
+// read 4 bytes for matching, in host order
+static inline vdword v__lzrd(vbyte *p) {
+  vdword v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// write an extended length, the part that doesn't fit in the token
+static inline int v__lzlen(vbyte *out, vqword *op, vqword cap, vqword n) {
+  for (; n >= 0xff; n -= 0xff) {
+    if (*op >= cap) return 0;
+    out[(*op)++] = 0xff;
+  }
+  if (*op >= cap) return 0;
+  out[(*op)++] = n;
+  return 1;
+}
+
+// write a sequence, a match of 'mlen' bytes at 'off' back after the literals.
+// 'mlen' is 0 for the last sequence
+static int v__lzseq(vbyte *out, vqword *op, vqword cap, vbyte *lit,
+                    vqword nlit, vqword off, vqword mlen)
+{
+  vqword ml = 0 < mlen ? mlen - V__LZMIN : 0;
+
+  if (*op >= cap) return 0;
+  out[(*op)++] = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+  if (15 <= nlit && !v__lzlen(out, op, cap, nlit - 15)) return 0;
+
+  if (cap - *op < nlit) return 0;
+  memcpy(out + *op, lit, nlit);
+  *op += nlit;
+
+  if (0 == mlen) return 1;
+  if (cap - *op < 2) return 0;
+  out[(*op)++] = off & 0xff;
+  out[(*op)++] = off >> 8;
+  if (15 <= ml && !v__lzlen(out, op, cap, ml - 15)) return 0;
+  return 1;
+}
+
+vqword vlzenc(vbyte *in, vqword sz, vbyte *out, vqword cap) {
+  // positions of the recently seen 4-byte sequences, plus one (0 is empty)
+  vdword table[1 << V__LZHASH];
+  memset(table, 0, sizeof(table));
+
+  vqword ip = 0;
+  vqword anchor = 0;
+  vqword op = 0;
+
+  while (ip + V__LZMIN <= sz) {
+    vdword seq = v__lzrd(in + ip);
+    vdword h = (seq * 2654435761u) >> (32 - V__LZHASH);
+    vqword ref = table[h];
+    table[h] = ip + 1;
+
+    // no match here, skip faster the longer we go without one
+    if (0 == ref || ip - (ref - 1) > V__LZWINDOW ||
+        v__lzrd(in + ref - 1) != seq)
+    {
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    ref--;
+
+    // extend the match as far as it goes
+    vqword len = V__LZMIN;
+    while (ip + len < sz && in[ref + len] == in[ip + len]) len++;
+
+    if (!v__lzseq(out, &op, cap, in + anchor, ip - anchor, ip - ref, len))
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+
+  // the trailing literals
+  if (!v__lzseq(out, &op, cap, in + anchor, sz - anchor, 0, 0)) return 0;
+  return op;
+}
+
+int vlzdec(vbyte *in, vqword sz, vbyte *out, vqword outsz) {
+  vqword ip = 0;
+  vqword op = 0;
+
+  while (ip < sz) {
+    vbyte token = in[ip++];
+
+    // the literals
+    vqword n = token >> 4;
+    if (15 == n) {
+      vbyte b;
+      do {
+        if (ip >= sz) return VEMALF;
+        b = in[ip++];
+        n += b;
+      } while (0xff == b);
+    }
+    if (sz - ip < n || outsz - op < n) return VEMALF;
+    memcpy(out + op, in + ip, n);
+    ip += n;
+    op += n;
+
+    // the last sequence has no match
+    if (ip == sz) break;
+
+    // the match, which may overlap with what it produces
+    if (sz - ip < 2) return VEMALF;
+    vqword off = in[ip] | (vqword)in[ip + 1] << 8;
+    ip += 2;
+    n = token & 0xf;
+    if (15 == n) {
+      vbyte b;
+      do {
+        if (ip >= sz) return VEMALF;
+        b = in[ip++];
+        n += b;
+      } while (0xff == b);
+    }
+    n += V__LZMIN;
+    if (0 == off || off > op || outsz - op < n) return VEMALF;
+    for (vqword i = 0; i < n; i++, op++) out[op] = out[op - off];
+  }
+
+  return op == outsz ? VOK : VEMALF;
+}
@@ -0,0 +1,21 @@
+#ifndef _VYT_LZ_H
+#define _VYT_LZ_H
+#include "vyt.h"
+
+/**
+ * compress 'sz' bytes from 'in' onto 'out', a buffer of 'cap' bytes. returns
+ * the compressed size, or 0 if it doesn't fit in 'cap'
+ *
+ * NOTE:
+ * - it's a byte-oriented lz77, tuned for speed rather than ratio
+ * - matches reach back at most 64 KiB
+ */
+vqword vlzenc(vbyte *in, vqword sz, vbyte *out, vqword cap);
+
+/**
+ * decompress 'sz' bytes from 'in', which should expand to exactly 'outsz'
+ * bytes onto 'out'. returns VEMALF if it doesn't
+ */
+int vlzdec(vbyte *in, vqword sz, vbyte *out, vqword outsz);
+
+#endif // _VYT_LZ_H
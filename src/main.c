@@ -2,6 +2,7 @@
 #include "utils.h"
 #include "exec.h"
 #include "mem.h"
+#include "snap.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -18,17 +19,44 @@
 #   include <unistd.h>
 #endif
 
+// for mapping the program image
+#if !defined(_WIN32) && !defined(_WIN64)
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   define HAVE_MMAP
+#endif
+
 // print help message
 void print_help(char *prog);
 
 // print a byte array
 void print_data(char *data, int size, char cols);
 
+// release the program image, either mapped or buffered
+void free_image(vbyte *buffer, size_t size, char mapped);
+
+// print the lock statistics
+void print_stats(char *prog);
+
+// the number of cores online, 1 if it can't be told
+vqword count_cores(void);
+
 int main(int argc, char **argv) {
 
   // arguments
   char    arg_help  = 0;
+  char    arg_stats = 0;
   vqword  arg_stack = 1048576; // default: 1 MiB
+  vqword  arg_huge  = 0;       // default: no huge pages
+  vqword  arg_limit = 0;       // default: no memory limit
+  vqword  arg_cold  = 0;       // default: no compression
+  char   *arg_snap  = NULL;    // default: snapshots are ignored
+  char   *arg_swap  = NULL;    // default: no swapping
+  vqword  arg_budget = 67108864; // default: 64 MiB
+  vqword  arg_tasks = 0;       // default: a host thread per guest thread
+  vqword  arg_quantum = 0;     // default: 4096 instructions for the tasks
+  vqword  arg_quantumus = 0;   // default: no time quantum
+  char    arg_det   = 0;       // default: the host schedules the threads
 
   // source file
   char srcset    = 0;
@@ -87,8 +115,18 @@ int main(int argc, char **argv) {
       continue;
     }
 
-    // stack size option
-    if (arg[1] == 't') {
+    // stack size, huge page pool, memory limit, compression, swap budget,
+    // task workers and quanta options
+    if (arg[1] == 't' || arg[1] == 'H' || arg[1] == 'm' || arg[1] == 'z' ||
+        arg[1] == 'b' || arg[1] == 'M' || arg[1] == 'q' || arg[1] == 'Q')
+    {
+      vqword *target = arg[1] == 't' ? &arg_stack :
+                       arg[1] == 'H' ? &arg_huge  :
+                       arg[1] == 'm' ? &arg_limit :
+                       arg[1] == 'b' ? &arg_budget :
+                       arg[1] == 'M' ? &arg_tasks :
+                       arg[1] == 'q' ? &arg_quantum :
+                       arg[1] == 'Q' ? &arg_quantumus : &arg_cold;
       char *num = arg + 2;
       // -t=123
       if (arg[2] == '=') {
@@ -121,7 +159,32 @@ int main(int argc, char **argv) {
         return 1;
       }
       // parse the number
-      arg_stack = strtoull(num, NULL, 10);
+      *target = strtoull(num, NULL, 10);
+      // as many task workers as there are cores
+      if (arg[1] == 'M' && 0 == arg_tasks) arg_tasks = count_cores();
+      i++;
+      continue;
+    }
+
+    // snapshot and swap files
+    if (arg[1] == 'S' || arg[1] == 'w') {
+      char *file = arg + 2;
+      // -S=file
+      if (arg[2] == '=') {
+        file++;
+      }
+      // -S file OR -S= file
+      if (file[0] == '\0') {
+        i++;
+        // too few arguments
+        if (i >= argc) {
+          ARGERR("%s: required option argument not specified\n", arg);
+          return 1;
+        }
+        file = argv[i];
+      }
+      if (arg[1] == 'S') arg_snap = file;
+      else arg_swap = file;
       i++;
       continue;
     }
@@ -131,7 +194,8 @@ int main(int argc, char **argv) {
       for (int c = 1; c < len; c++) {
         switch (arg[c]) {
           case 'h': arg_help = 1; break;
-          case 't':
+          case 't': case 'H': case 'm': case 'z': case 'S': case 'w':
+          case 'b': case 'M': case 'q': case 'Q':
             ARGERR(
               "-%c: cannot use this independent option as a flag\n",
               arg[c]
@@ -148,7 +212,9 @@ int main(int argc, char **argv) {
     }
 
     // long flags (--flag)
-    if      (strcmp(arg + 2, "help") == 0) { arg_help = 1; }
+    if      (strcmp(arg + 2, "help") == 0)  { arg_help = 1; }
+    else if (strcmp(arg + 2, "stats") == 0) { arg_stats = 1; }
+    else if (strcmp(arg + 2, "deterministic") == 0) { arg_det = 1; }
     // unknown flag
     else {
       ARGERR("%s: unknown flag\n", arg);
@@ -199,19 +265,44 @@ int main(int argc, char **argv) {
     }
   }
 
-  // allocate memory on buffer
-  vbyte *buffer  = (vbyte*)malloc(4096);
-  size_t bufalloc = 4096;
+  // the program image
+  vbyte *buffer   = NULL;
+  size_t bufalloc = 0;
   size_t bufsize  = 0;
+  char   mapped   = 0;
+
+#ifdef HAVE_MMAP
+  // map regular files straight into memory instead of reading them. the
+  // mapping is private, so writes to it are copy-on-write and never reach the
+  // file, while the untouched pages are shared with the page cache
+  struct stat st;
+  if (use_file && 0 == fstat(fileno(src), &st) && S_ISREG(st.st_mode) &&
+      0 < st.st_size)
+  {
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fileno(src), 0);
+    if (MAP_FAILED != map) {
+      buffer  = (vbyte*)map;
+      bufsize = st.st_size;
+      mapped  = 1;
+    }
+  }
+#endif
 
-  // allocation failed
-  if (!buffer) {
-    fprintf(stderr, "%s: error allocating memory for buffer\n", argv[0]);
-    return 1;
+  // allocate memory on buffer
+  if (!mapped) {
+    buffer   = (vbyte*)malloc(4096);
+    bufalloc = 4096;
+
+    // allocation failed
+    if (!buffer) {
+      fprintf(stderr, "%s: error allocating memory for buffer\n", argv[0]);
+      return 1;
+    }
   }
 
   // buffered reading
-  while (1) {
+  while (!mapped) {
     size_t bytes_in = fread(buffer + bufsize, 1, 4096, src);
     bufsize += bytes_in;
 
@@ -229,8 +320,8 @@ int main(int argc, char **argv) {
 
     // resize the buffer when needed
     if (bufalloc - bufsize < 4096) {
-      bufsize *= 2;
-      vbyte *tmp = (vbyte*)realloc(buffer, bufsize);
+      bufalloc *= 2;
+      vbyte *tmp = (vbyte*)realloc(buffer, bufalloc);
       if (tmp == NULL) {
         fprintf(stderr, "%s: error resizing the buffer\n", argv[0]);
         free(buffer);
@@ -247,7 +338,17 @@ int main(int argc, char **argv) {
 
   // our startup options
   struct vopts opt = {
-    .stacksz = arg_stack,
+    .stacksz  = arg_stack,
+    .hugesz   = arg_huge,
+    .memlimit = arg_limit,
+    .coldms   = arg_cold,
+    .snapfile = arg_snap,
+    .swapfile = arg_swap,
+    .budget   = arg_budget,
+    .tasks    = arg_tasks,
+    .quantum  = arg_quantum,
+    .quantumus = arg_quantumus,
+    .deterministic = arg_det,
   };
 
   vproc p;
@@ -258,18 +359,32 @@ int main(int argc, char **argv) {
   if (VOK != stat) {
     fprintf(stderr, "%s: failed to initialize vm: ", argv[0]);
     vperr(stat);
-    free(buffer);
+    free_image(buffer, bufsize, mapped);
     return stat;
   }
-  stat = vload(&p, buffer, bufsize);
+
+  // tell when we couldn't get the huge pages we've asked for
+  if (0 < arg_huge && VHNONE == p.mem.hugepg) {
+    fprintf(stderr, "%s: huge pages unavailable, using regular pages\n",
+            argv[0]);
+  }
+
+  // mapped images back the guest memory directly, the buffered ones populate
+  // the pages on demand. either way, the image must outlive the vm. snapshots
+  // are told apart from programs by their magic
+  if (4 <= bufsize && 0 == memcmp(buffer, "\0VYS", 4))
+    stat = vsnapload(&p, buffer, bufsize);
+  else if (mapped)
+    stat = vloadmap(&p, buffer, bufsize);
+  else
+    stat = vload(&p, buffer, bufsize);
   if (VOK != stat) {
     fprintf(stderr, "%s: failed to load program: ", argv[0]);
     vperr(stat);
     vpdestroy(&p);
-    free(buffer);
+    free_image(buffer, bufsize, mapped);
     return stat;
   }
-  free(buffer);
 
   // prints memory mappings (uncomment if needed)
   // for (vqword n = 0; n < p._page_alloc; n++) {
@@ -287,19 +402,33 @@ int main(int argc, char **argv) {
 
   // execute the program
   stat = vrun(&p); // name, &argv[i], argc - i);
+  if (arg_stats) print_stats(argv[0]);
   if (VOK != stat) {
     fprintf(stderr, "%s: aborting due to critical error: ", argv[0]);
     vperr(stat);
     vpdestroy(&p);
+    free_image(buffer, bufsize, mapped);
     return stat;
   }
 
   // free resources
   int extc = atomic_load(&p.exitcode);
   vpdestroy(&p);
+  free_image(buffer, bufsize, mapped);
   return extc;
 }
 
+void free_image(vbyte *buffer, size_t size, char mapped) {
+  if (NULL == buffer) return;
+#ifdef HAVE_MMAP
+  if (mapped) {
+    munmap(buffer, size);
+    return;
+  }
+#endif
+  free(buffer);
+}
+
 void print_help(char *prog) {
 	fprintf(stderr,
 		"usage: %s [options ...] [file | -] [args ...]\n"
@@ -309,6 +438,25 @@ void print_help(char *prog) {
 		"    -              read file from stdin\n"
 		"    -h, --help     show this help and exit\n"
 		"    -t size        set the stack size\n"
+		"    -H size        back guest memory with a pool of huge pages\n"
+		"    -m size        limit the resident guest memory\n"
+		"    -z ms          compress the pages left untouched for a while,\n"
+		"                   sampled every 'ms' milliseconds\n"
+		"    -S file        where the snap syscall saves the snapshot\n"
+		"    -w file        swap the guest memory out to a file\n"
+		"    -b size        the resident guest memory to keep within when\n"
+		"                   swapping (default: 64 MiB)\n"
+		"    -M count       run the threads as tasks on 'count' host threads,\n"
+		"                   0 for one per core\n"
+		"    -q count       the instructions a thread runs for before the\n"
+		"                   others get a turn (default: 4096 for the tasks)\n"
+		"    -Q us          the microseconds it runs for at most\n"
+		"    --deterministic\n"
+		"                   run the threads one at a time on a single host\n"
+		"                   thread, by instruction quanta only (-M and -Q are\n"
+		"                   ignored). the same input runs the same way\n"
+		"    --stats        print the lock statistics on exit, in the builds\n"
+		"                   made with LOCKSTATS=1\n"
 		"\n"
 		"arguments:\n"
 		"    file           input file name\n"
@@ -319,6 +467,20 @@ void print_help(char *prog) {
 	);
 }
 
+void print_stats(char *prog) {
+  if (VOK != vlstats(stderr))
+    fprintf(stderr, "%s: built without lock statistics, rebuild with "
+            "'make LOCKSTATS=1'\n", prog);
+}
+
+vqword count_cores(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (0 < n) return (vqword)n;
+#endif
+  return 1;
+}
+
 void print_data(char *data, int size, char cols) {
   for (int i = 0; i < size; i += cols) {
     printf("%08x:   ", i);
@@ -1,10 +1,282 @@
 #include <stdlib.h>
+#include <string.h>
 #include "mem.h"
+#include "utils.h"
+#include "lz.h"
+
+// for the huge page frame pool, and the swap file
+#if !defined(_WIN32) && !defined(_WIN64)
+#   include <sys/mman.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   define HAVE_MMAP
+#   define HAVE_PREAD
+#endif
 
 // NOTE:
 // - when ndx is -1, that page slot is available for reuse
 // - we use lru caching!
 
+// returns whether one more frame fits within the resident limit
+static inline int v__mfits(vmem *mem) {
+  return 0 == mem->limit ||
+         atomic_load(&mem->_resident) + VPAGESZ <= mem->limit;
+}
+
+// take a frame from the pool, zeroed. returns NULL when the pool ran out
+static vbyte *v__mpalloc(vmpool *pool) {
+  vbyte *frame = NULL;
+  if (NULL == pool) return NULL;
+
+  mtx_lock(&pool->_lock);
+
+  // reuse a recycled frame
+  if (NULL != pool->_free) {
+    frame = pool->_free;
+    memcpy(&pool->_free, frame, sizeof(vbyte*));
+    memset(frame, 0, VPAGESZ);
+  }
+
+  // grab a fresh one, these are still zeroed
+  else if (pool->_next + VPAGESZ <= pool->size) {
+    frame = pool->base + pool->_next;
+    pool->_next += VPAGESZ;
+  }
+
+  mtx_unlock(&pool->_lock);
+  return frame;
+}
+
+// give a frame back to the pool it came from, or to the host
+static void v__mpfree(vmpool *pool, vbyte *frame) {
+
+  // not from the pool
+  if (NULL == pool || frame < pool->base || frame >= pool->base + pool->size) {
+    free(frame);
+    return;
+  }
+
+  mtx_lock(&pool->_lock);
+  memcpy(frame, &pool->_free, sizeof(vbyte*));
+  pool->_free = frame;
+  mtx_unlock(&pool->_lock);
+}
+
+// drop a reference to a pool, unmapping it after the last one
+static void v__mpput(vmpool *pool) {
+  if (NULL == pool || 1 != atomic_fetch_sub(&pool->_refs, 1)) return;
+#ifdef HAVE_MMAP
+  munmap(pool->_map, pool->_mapsz);
+#endif
+  mtx_destroy(&pool->_lock);
+  free(pool);
+}
+
+// drop a reference to a share group, freeing its frames after the last one
+static void v__msput(vmshare *sh) {
+  if (1 != atomic_fetch_sub(&sh->_refs, 1)) return;
+  for (vqword i = 0; i < sh->nframes; i++)
+    v__mpfree(sh->pool, sh->frames[i]);
+  v__mpput(sh->pool);
+  free(sh);
+}
+
+// allocate a zeroed frame, from the pool if there's still room in it. the
+// caller must hold the fault lock
+static vbyte *v__mfalloc(vmem *mem) {
+  vbyte *frame = NULL;
+
+  // keep within the resident limit
+  if (!v__mfits(mem)) return NULL;
+
+  // the pool ran out (or there's none), use the regular host pages
+  frame = v__mpalloc(mem->pool);
+  if (NULL == frame) {
+    frame = (vbyte*)calloc(1, VPAGESZ);
+    if (NULL == frame) return NULL;
+  }
+
+  atomic_fetch_add(&mem->_resident, VPAGESZ);
+  atomic_fetch_add(&mem->_owned, VPAGESZ);
+  return frame;
+}
+
+// release a frame owned by the memory
+static void v__mffree(vmem *mem, vbyte *frame) {
+  atomic_fetch_sub(&mem->_resident, VPAGESZ);
+  atomic_fetch_sub(&mem->_owned, VPAGESZ);
+  v__mpfree(mem->pool, frame);
+}
+
+// drop the compressed contents of a page
+static void v__mbput(vmem *mem, vmpage *pg) {
+  atomic_fetch_sub(&mem->_comp, VPAGESZ);
+  atomic_fetch_sub(&mem->_store, pg->blob->size);
+  if (1 == atomic_fetch_sub(&pg->blob->_refs, 1)) free(pg->blob);
+  pg->blob = NULL;
+  pg->flags &= ~VPCOMP;
+}
+
+// take a free slot of the swap file
+static vqword v__msalloc(vmem *mem) {
+  mtx_lock(&mem->_swap_lock);
+  vqword slot = 0 < mem->_sfree_used ? mem->_sfree[--mem->_sfree_used] :
+                mem->_snext++;
+  mtx_unlock(&mem->_swap_lock);
+  return slot;
+}
+
+// give a slot of the swap file back, it's only ever written over
+static void v__msfree(vmem *mem, vqword slot) {
+  mtx_lock(&mem->_swap_lock);
+  if (mem->_sfree_used >= mem->_sfree_alloc) {
+    vqword alloc = 0 == mem->_sfree_alloc ? 64 : mem->_sfree_alloc * 2;
+    vqword *list = (vqword*)realloc(mem->_sfree, sizeof(vqword) * alloc);
+
+    // leak the slot instead, the file grows a little further
+    if (NULL == list) {
+      mtx_unlock(&mem->_swap_lock);
+      return;
+    }
+    mem->_sfree = list;
+    mem->_sfree_alloc = alloc;
+  }
+  mem->_sfree[mem->_sfree_used++] = slot;
+  mtx_unlock(&mem->_swap_lock);
+}
+
+// drop the swapped out contents of a page
+static void v__mwput(vmem *mem, vmpage *pg) {
+  atomic_fetch_sub(&mem->_swapped, VPAGESZ);
+  v__msfree(mem, pg->swap);
+  pg->swap = 0;
+  pg->flags &= ~VPSWAP;
+}
+
+// drop a reference to a merged frame, freeing it after the last one
+static void v__mrput(vmpage *pg) {
+  vmref *ref = pg->ref;
+  vmksm *ksm = ref->ksm;
+  pg->ref = NULL;
+  pg->flags &= ~VPMERGED;
+
+  mtx_lock(&ksm->_lock);
+  ksm->_pages--;
+  if (1 != atomic_fetch_sub(&ref->_refs, 1)) {
+    mtx_unlock(&ksm->_lock);
+    return;
+  }
+
+  // the last one, take it off the table
+  vmref **at = &ksm->table[ref->hash & (ksm->_buckets - 1)];
+  while (*at != ref) at = &(*at)->next;
+  *at = ref->next;
+  ksm->_frames--;
+  mtx_unlock(&ksm->_lock);
+
+  free(ref->frame);
+  free(ref);
+}
+
+// drop the frame of a page, freeing it if the page owns it
+static void v__mfdrop(vmem *mem, vmpage *pg) {
+  if (VPCOMP & pg->flags) v__mbput(mem, pg);
+  if (VPSWAP & pg->flags) v__mwput(mem, pg);
+  if (NULL == pg->frame) return;
+  if (VPOWNED & pg->flags) v__mffree(mem, pg->frame);
+  else atomic_fetch_sub(&mem->_resident, VPAGESZ);
+  if (VPCOW & pg->flags) atomic_fetch_sub(&mem->_shared, VPAGESZ);
+  if (VPMERGED & pg->flags) v__mrput(pg);
+  pg->frame = NULL;
+  pg->flags &= ~(VPOWNED | VPCOW);
+  atomic_fetch_add(&mem->_gen, 1);
+}
+
+// initialize a periodic task, not running yet
+static int v__tinit(vmtimer *t) {
+  t->_period = 0;
+  t->_fn = NULL;
+  t->_arg = NULL;
+  if (thrd_success != mtx_init(&t->_lock, mtx_plain)) return VENOMEM;
+  if (thrd_success != cnd_init(&t->_cnd)) {
+    mtx_destroy(&t->_lock);
+    return VENOMEM;
+  }
+  return VOK;
+}
+
+// the thread of a periodic task
+static int v__tthrd(void *arg) {
+  vmtimer *t = (vmtimer*)arg;
+
+  mtx_lock(&t->_lock);
+  while (0 != t->_period) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    ts.tv_sec += t->_period / 1000;
+    ts.tv_nsec += (t->_period % 1000) * 1000000;
+    if (1000000000 <= ts.tv_nsec) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+
+    // sleep through the period, unless we're stopped
+    cnd_timedwait(&t->_cnd, &t->_lock, &ts);
+    if (0 == t->_period) break;
+
+    mtx_unlock(&t->_lock);
+    t->_fn(t->_arg);
+    mtx_lock(&t->_lock);
+  }
+  mtx_unlock(&t->_lock);
+
+  return 0;
+}
+
+// run 'fn' every 'ms' milliseconds, or stop when 'ms' is 0
+static int v__tstart(vmtimer *t, vqword ms, int (*fn)(void*), void *arg) {
+
+  // stop the running one first
+  mtx_lock(&t->_lock);
+  vqword running = t->_period;
+  t->_period = 0;
+  cnd_signal(&t->_cnd);
+  mtx_unlock(&t->_lock);
+  if (0 != running) thrd_join(t->_thrd, NULL);
+
+  if (0 == ms) return VOK;
+
+  t->_period = ms;
+  t->_fn = fn;
+  t->_arg = arg;
+  if (thrd_success != thrd_create(&t->_thrd, v__tthrd, t)) {
+    t->_period = 0;
+    return VETHRD;
+  }
+
+  return VOK;
+}
+
+// stop a periodic task and release it
+static void v__tdestroy(vmtimer *t) {
+  v__tstart(t, 0, NULL, NULL);
+  mtx_destroy(&t->_lock);
+  cnd_destroy(&t->_cnd);
+}
+
+// wake a periodic task up before its period is over
+static void v__tkick(vmtimer *t) {
+  mtx_lock(&t->_lock);
+  cnd_signal(&t->_cnd);
+  mtx_unlock(&t->_lock);
+}
+
+// wake the write-back thread up once we're over the swap budget
+static inline void v__mover(vmem *mem) {
+  if (-1 != mem->_swapfd && atomic_load(&mem->_resident) > mem->budget)
+    v__tkick(&mem->_writer);
+}
+
 int vminit(vmem *mem, vword cachesz) {
   if (NULL == mem) return VERROR;
 
@@ -14,11 +286,16 @@ int vminit(vmem *mem, vword cachesz) {
   mem->page[0].ndx = -1;
   mem->page[0].flags = 0;
   mem->page[0].frame = NULL;
+  mem->page[0].blob = NULL;
 
   // setup resource lock
-  if (0 != rw_init(&mem->_lock)) {
+  brw_init(&mem->_lock);
+
+  // setup the page fault lock
+  if (thrd_success != mtx_init(&mem->_fault_lock, mtx_plain)) {
     free(mem->page);
     mem->page = NULL;
+    brw_destroy(&mem->_lock);
     return VENOMEM;
   }
 
@@ -27,7 +304,8 @@ int vminit(vmem *mem, vword cachesz) {
   if (NULL == mem->cache_pool) {
     free(mem->page);
     mem->page = NULL;
-    rw_destroy(&mem->_lock);
+    brw_destroy(&mem->_lock);
+    mtx_destroy(&mem->_fault_lock);
     return VENOMEM;
   }
 
@@ -44,17 +322,327 @@ int vminit(vmem *mem, vword cachesz) {
   mem->_used = 0;
   mem->_alloc = 1;
 
+  mem->seg = NULL;
+  mem->_seg_used = 0;
+  mem->_seg_alloc = 0;
+
+  mem->pool = NULL;
+  mem->hugepg = VHNONE;
+
+  mem->share = NULL;
+  mem->_share_used = 0;
+  mem->_share_alloc = 0;
+
+  atomic_store(&mem->_resident, 0);
+  atomic_store(&mem->_owned, 0);
+  atomic_store(&mem->_shared, 0);
+  mem->limit = 0;
+  atomic_store(&mem->_gen, 0);
+
+  // setup the dirty and access bitmaps, a word covers the single slot we have
+  mem->_dirty = (_Atomic vqword*)calloc(1, sizeof(vqword));
+  mem->_access = (_Atomic vqword*)calloc(VMSAMPLERS, sizeof(vqword));
+  if (NULL == mem->_dirty || NULL == mem->_access ||
+      VOK != v__tinit(&mem->_cold) || VOK != v__tinit(&mem->_writer) ||
+      thrd_success != mtx_init(&mem->_swap_lock, mtx_plain) ||
+      thrd_success != mtx_init(&mem->_solo_lock, mtx_plain))
+  {
+    free(mem->page);
+    mem->page = NULL;
+    free(mem->cache_pool);
+    mem->cache_pool = NULL;
+    free(mem->_dirty);
+    free(mem->_access);
+    brw_destroy(&mem->_lock);
+    mtx_destroy(&mem->_fault_lock);
+    return VENOMEM;
+  }
+  mem->_age = NULL;
+  mem->_age_alloc = 0;
+  mem->_retired = NULL;
+  mem->_retired_used = 0;
+  mem->_retired_alloc = 0;
+  atomic_store(&mem->_comp, 0);
+  atomic_store(&mem->_store, 0);
+  atomic_store(&mem->_cfaults, 0);
+  mem->ksm = NULL;
+  mem->_kage = NULL;
+  mem->_kage_alloc = 0;
+  mem->epoch = NULL;
+  atomic_store(&mem->_solo, NULL);
+  mem->_solo_rec = NULL;
+  mem->_solo_held = 0;
+  mem->_swapfd = -1;
+  mem->budget = 0;
+  mem->_sfree = NULL;
+  mem->_sfree_used = 0;
+  mem->_sfree_alloc = 0;
+  mem->_snext = 0;
+  atomic_store(&mem->_hand, 0);
+  atomic_store(&mem->_swapped, 0);
+  atomic_store(&mem->_sfaults, 0);
+  atomic_store(&mem->_swapin, 0);
+  atomic_store(&mem->_swapout, 0);
+  mem->_unmapped = NULL;
+  mem->_unmapped_used = 0;
+  mem->_unmapped_alloc = 0;
+  mem->_ckpt = 0;
+
   mem->_cache_size = cachesz;
   mem->_cache_used = 0;
-  mem->_cache_head = &mem->cache_pool[0];
-  mem->_cache_tail = &mem->cache_pool[0];
+  mem->_cache_head = NULL;
+  mem->_cache_tail = NULL;
+
+  // counted in the builds with lock statistics
+  vlname(&mem->_lock, "vmem._lock");
+  vlname(&mem->_cache_lock, "vmem._cache_lock");
 
   return VOK;
 }
 
+// unlink a cache entry from the lru list
+static inline void v__mcache_unlink(vmem *mem, _vmem_cache *ent) {
+  if (NULL != ent->prev) ent->prev->next = ent->next;
+  else mem->_cache_head = ent->next;
+  if (NULL != ent->next) ent->next->prev = ent->prev;
+  else mem->_cache_tail = ent->prev;
+  ent->prev = NULL;
+  ent->next = NULL;
+}
+
+// put a cache entry in front of the lru list
+static inline void v__mcache_push(vmem *mem, _vmem_cache *ent) {
+  ent->prev = NULL;
+  ent->next = mem->_cache_head;
+  if (NULL != mem->_cache_head) mem->_cache_head->prev = ent;
+  else mem->_cache_tail = ent;
+  mem->_cache_head = ent;
+}
+
+int vmhuge(vmem *mem, vqword sz) {
+  if (NULL == mem || NULL == mem->page) return VERROR;
+
+  // the pool can only be set up once, before any frame is allocated
+  if (NULL != mem->pool) return VERROR;
+
+  // nothing to reserve
+  if (0 == sz) return VOK;
+
+  // round it up to whole huge pages
+  sz = (sz + VHUGESZ - 1) & ~(vqword)(VHUGESZ - 1);
+
+#ifdef HAVE_MMAP
+  vmpool *pool = (vmpool*)calloc(1, sizeof(vmpool));
+  if (NULL == pool) return VENOMEM;
+  if (thrd_success != mtx_init(&pool->_lock, mtx_plain)) {
+    free(pool);
+    return VENOMEM;
+  }
+  atomic_init(&pool->_refs, 1);
+
+  void *map = MAP_FAILED;
+
+  // try the reserved huge pages first
+#ifdef MAP_HUGETLB
+  map = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (MAP_FAILED != map) {
+    pool->_map = map;
+    pool->_mapsz = sz;
+    pool->base = (vbyte*)map;
+    pool->size = sz;
+    mem->pool = pool;
+    mem->hugepg = VHTLB;
+    return VOK;
+  }
+#endif
+
+  // no reserved huge pages, map a regular region aligned to a huge page and
+  // ask the kernel to back it with transparent huge pages
+  map = mmap(NULL, sz + VHUGESZ, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  // cannot reserve the pool, keep using the regular allocator
+  if (MAP_FAILED == map) {
+    mtx_destroy(&pool->_lock);
+    free(pool);
+    return VOK;
+  }
+
+  pool->_map = map;
+  pool->_mapsz = sz + VHUGESZ;
+  pool->base = (vbyte*)(((uintptr_t)map + VHUGESZ - 1) &
+                        ~(uintptr_t)(VHUGESZ - 1));
+  pool->size = sz;
+  mem->pool = pool;
+
+#ifdef MADV_HUGEPAGE
+  if (0 == madvise(pool->base, sz, MADV_HUGEPAGE))
+    mem->hugepg = VHTHP;
+#endif
+#endif // HAVE_MMAP
+
+  return VOK;
+}
+
+static int v__mfault(vmem *mem, vmpage *pg);
+
+int vmclone(vmem *dst, vmem *src) {
+  if (NULL == dst || NULL == dst->page || NULL == src || NULL == src->page)
+    return VERROR;
+
+  // the clone should be empty, and without a pool of its own
+  if (0 != dst->_used || 0 != dst->_seg_used || NULL != dst->pool ||
+      0 != dst->_share_used)
+    return VERROR;
+
+  brw_wlock(&src->_lock);
+
+  // the swapped out pages are read back in, the clone has a swap file of its
+  // own (if any)
+  for (vqword i = 0; i < src->_alloc; i++) {
+    if (-1 == src->page[i].ndx || !(VPSWAP & src->page[i].flags)) continue;
+    int stat = v__mfault(src, &src->page[i]);
+    if (VOK != stat) {
+      brw_wunlock(&src->_lock);
+      return stat;
+    }
+  }
+
+  // the frames owned by the source go to a new share group
+  vqword nframes = 0;
+  for (vqword i = 0; i < src->_alloc; i++)
+    if (-1 != src->page[i].ndx && (VPOWNED & src->page[i].flags)) nframes++;
+
+  // allocate everything first, nothing is changed if any of these fails
+  vqword words = (src->_alloc + 63) >> 6;
+  vqword nshare = src->_share_used + (0 < nframes);
+  vmpage *page = (vmpage*)malloc(sizeof(vmpage) * src->_alloc);
+  _Atomic vqword *dirty = (_Atomic vqword*)calloc(words, sizeof(vqword));
+  _Atomic vqword *access = (_Atomic vqword*)calloc(words * VMSAMPLERS,
+                                                   sizeof(vqword));
+  vmseg *seg = 0 == src->_seg_used ? NULL :
+               (vmseg*)malloc(sizeof(vmseg) * src->_seg_used);
+  vmshare **share = 0 == nshare ? NULL :
+                    (vmshare**)malloc(sizeof(vmshare*) * nshare);
+  vmshare *sh = 0 == nframes ? NULL :
+                (vmshare*)malloc(sizeof(vmshare) + sizeof(vbyte*) * nframes);
+
+  // the source needs room for the new group too
+  if (NULL != sh && src->_share_used >= src->_share_alloc) {
+    vqword alloc = 0 == src->_share_alloc ? 4 : src->_share_alloc * 2;
+    vmshare **tmp = (vmshare**)realloc(src->share, sizeof(vmshare*) * alloc);
+    if (NULL != tmp) {
+      src->share = tmp;
+      src->_share_alloc = alloc;
+    }
+    else {
+      free(sh);
+      sh = NULL;
+    }
+  }
+
+  if (NULL == page || NULL == dirty || NULL == access ||
+      (0 != src->_seg_used && NULL == seg) ||
+      (0 != nshare && NULL == share) || (0 != nframes && NULL == sh))
+  {
+    brw_wunlock(&src->_lock);
+    free(page);
+    free(dirty);
+    free(access);
+    free(seg);
+    free(share);
+    free(sh);
+    return VENOMEM;
+  }
+
+  // share the frames of the source, its own writes are copied from now on
+  vqword shared = 0;
+  if (NULL != sh) {
+    atomic_init(&sh->_refs, 1);
+    sh->pool = src->pool;
+    sh->nframes = 0;
+    if (NULL != sh->pool) atomic_fetch_add(&sh->pool->_refs, 1);
+  }
+  for (vqword i = 0; i < src->_alloc; i++) {
+    vmpage *pg = &src->page[i];
+    if (-1 == pg->ndx || NULL == pg->frame) continue;
+    if (VPOWNED & pg->flags) {
+      sh->frames[sh->nframes++] = pg->frame;
+      atomic_fetch_sub(&src->_owned, VPAGESZ);
+    }
+    if (!(VPCOW & pg->flags)) atomic_fetch_add(&src->_shared, VPAGESZ);
+    pg->flags = (pg->flags & ~VPOWNED) | VPCOW;
+    shared += VPAGESZ;
+  }
+  if (NULL != sh) src->share[src->_share_used++] = sh;
+
+  // frame pointers cached from the source should not be written through
+  atomic_fetch_add(&src->_gen, 1);
+
+  // the clone gets the same page table, ranges, groups and pool
+  free(dst->page);
+  free(dst->_dirty);
+  free(dst->_access);
+  memcpy(page, src->page, sizeof(vmpage) * src->_alloc);
+  dst->page = page;
+
+  // the compressed and the merged pages share their contents too
+  for (vqword i = 0; i < src->_alloc; i++) {
+    if (-1 == page[i].ndx) continue;
+    if (VPCOMP & page[i].flags) {
+      atomic_fetch_add(&page[i].blob->_refs, 1);
+      atomic_fetch_add(&dst->_comp, VPAGESZ);
+      atomic_fetch_add(&dst->_store, page[i].blob->size);
+    }
+    if (VPMERGED & page[i].flags) {
+      mtx_lock(&page[i].ref->ksm->_lock);
+      atomic_fetch_add(&page[i].ref->_refs, 1);
+      page[i].ref->ksm->_pages++;
+      mtx_unlock(&page[i].ref->ksm->_lock);
+    }
+  }
+  dst->_dirty = dirty;
+  dst->_access = access;
+  dst->_alloc = src->_alloc;
+  dst->_used = src->_used;
+
+  if (NULL != seg) memcpy(seg, src->seg, sizeof(vmseg) * src->_seg_used);
+  dst->seg = seg;
+  dst->_seg_used = src->_seg_used;
+  dst->_seg_alloc = src->_seg_used;
+
+  for (vqword i = 0; i < src->_share_used; i++) {
+    share[i] = src->share[i];
+    atomic_fetch_add(&share[i]->_refs, 1);
+  }
+  dst->share = share;
+  dst->_share_used = nshare;
+  dst->_share_alloc = nshare;
+
+  dst->pool = src->pool;
+  dst->hugepg = src->hugepg;
+  if (NULL != dst->pool) atomic_fetch_add(&dst->pool->_refs, 1);
+
+  dst->limit = src->limit;
+  atomic_store(&dst->_resident, shared);
+  atomic_store(&dst->_shared, shared);
+
+  brw_wunlock(&src->_lock);
+
+  // the clone joins the dedup service of the source
+  if (NULL != src->ksm) vmksmjoin(src->ksm, dst);
+  return VOK;
+}
+
 int vmdestroy(vmem *mem) {
   if (NULL == mem || NULL == mem->page) return VERROR;
 
+  // stop the compressor and the write-back, and leave the dedup service
+  vmcompress(mem, 0);
+  v__tstart(&mem->_writer, 0, NULL, NULL);
+  if (NULL != mem->ksm) vmksmleave(mem->ksm, mem);
+
   // if mem->page is still allocated, iterate through the page table and try to
   // free them all
   if (NULL != mem->page) {
@@ -62,13 +650,7 @@ int vmdestroy(vmem *mem) {
 
       // if the page's frame is still there, and this memory owns that frame,
       // then free that
-      if (
-        -1 != mem->page[i].ndx &&
-        (VPOWNED & mem->page[i].flags) &&
-        NULL != mem->page[i].frame
-      ) {
-        free(mem->page[i].frame);
-      }
+      if (-1 != mem->page[i].ndx) v__mfdrop(mem, &mem->page[i]);
 
     }
 
@@ -86,17 +668,155 @@ int vmdestroy(vmem *mem) {
   mem->_cache_head = NULL;
   mem->_cache_tail = NULL;
 
+  // release the shared frames, then the frame pool. clones may still use them
+  for (vqword i = 0; i < mem->_share_used; i++)
+    v__msput(mem->share[i]);
+  if (NULL != mem->share)
+    free(mem->share);
+  mem->share = NULL;
+  mem->_share_used = 0;
+  mem->_share_alloc = 0;
+  v__mpput(mem->pool);
+  mem->pool = NULL;
+  mem->hugepg = VHNONE;
+
+  // free the checkpoint tracking
+  if (NULL != mem->_dirty)
+    free(mem->_dirty);
+  if (NULL != mem->_unmapped)
+    free(mem->_unmapped);
+  mem->_dirty = NULL;
+  mem->_unmapped = NULL;
+  mem->_unmapped_used = 0;
+  mem->_unmapped_alloc = 0;
+  mem->_ckpt = 0;
+
+  // free the compressor state
+  if (NULL != mem->_access)
+    free(mem->_access);
+  if (NULL != mem->_age)
+    free(mem->_age);
+  if (NULL != mem->_kage)
+    free(mem->_kage);
+  for (vqword i = 0; i < mem->_retired_used; i++)
+    free(mem->_retired[i]);
+  if (NULL != mem->_retired)
+    free(mem->_retired);
+  mem->_access = NULL;
+  mem->_age = NULL;
+  mem->_age_alloc = 0;
+  mem->_kage = NULL;
+  mem->_kage_alloc = 0;
+  mem->_retired = NULL;
+  mem->_retired_used = 0;
+  mem->_retired_alloc = 0;
+  atomic_store(&mem->_comp, 0);
+  atomic_store(&mem->_store, 0);
+  atomic_store(&mem->_cfaults, 0);
+  v__tdestroy(&mem->_cold);
+
+  // close the swap file
+#ifdef HAVE_PREAD
+  if (-1 != mem->_swapfd)
+    close(mem->_swapfd);
+#endif
+  if (NULL != mem->_sfree)
+    free(mem->_sfree);
+  mem->_swapfd = -1;
+  mem->budget = 0;
+  mem->_sfree = NULL;
+  mem->_sfree_used = 0;
+  mem->_sfree_alloc = 0;
+  mem->_snext = 0;
+  v__tdestroy(&mem->_writer);
+  mtx_destroy(&mem->_swap_lock);
+  mtx_destroy(&mem->_solo_lock);
+
+  // free the lazy ranges
+  if (NULL != mem->seg)
+    free(mem->seg);
+  mem->seg = NULL;
+  mem->_seg_used = 0;
+  mem->_seg_alloc = 0;
+
   // set these to zero
   mem->_used = 0;
   mem->_alloc = 0;
+  atomic_store(&mem->_resident, 0);
+  atomic_store(&mem->_owned, 0);
+  atomic_store(&mem->_shared, 0);
 
-  // destroy the rw lock
-  rw_destroy(&mem->_lock);
+  // destroy the locks
+  vlforget(&mem->_lock);
+  vlforget(&mem->_cache_lock);
+  brw_destroy(&mem->_lock);
+  mtx_destroy(&mem->_fault_lock);
 
   return VOK;
 }
 
-int vmmap(vmem *mem, vqword ndx, vbyte flags) {
+// make room to retire 'n' more tables, so that retiring them can't fail
+static int v__mreserve(vmem *mem, vqword n) {
+  if (mem->_retired_used + n <= mem->_retired_alloc) return VOK;
+  vqword alloc = mem->_retired_used + n;
+  void **retired = (void**)realloc(mem->_retired, sizeof(void*) * alloc);
+  if (NULL == retired) return VENOMEM;
+  mem->_retired = retired;
+  mem->_retired_alloc = alloc;
+  return VOK;
+}
+
+// retire a table that may still be used without locking. it's freed once no
+// guest thread can be using it, or when the memory is destroyed if there are
+// no epochs to tell
+static void v__mretire(vmem *mem, void *ptr) {
+  if (NULL != mem->epoch && VOK == veretire(mem->epoch, ptr, free)) return;
+  mem->_retired[mem->_retired_used++] = ptr;
+}
+
+// make sure the stack fast path sees a new generation before frames are taken
+// from under it. with epochs, we wait until every guest thread is past the
+// point where it might've checked the old one, otherwise the window where one
+// is in between is merely small
+static void v__mgrace(vmem *mem) {
+  atomic_fetch_add(&mem->_gen, 1);
+  if (NULL != mem->epoch) vesync(mem->epoch, NULL);
+}
+
+// grow the dirty and access bitmaps to 'words'. the stack fast path uses them
+// without locking, so the old ones are retired
+static int v__mgrowbits(vmem *mem, vqword oldwords, vqword words) {
+  if (VOK != v__mreserve(mem, 2)) return VENOMEM;
+
+  _Atomic vqword *dirty = (_Atomic vqword*)calloc(words, sizeof(vqword));
+  _Atomic vqword *access = (_Atomic vqword*)calloc(words * VMSAMPLERS,
+                                                   sizeof(vqword));
+  if (NULL == dirty || NULL == access) {
+    free(dirty);
+    free(access);
+    return VENOMEM;
+  }
+
+  _Atomic vqword *olddirty = mem->_dirty;
+  _Atomic vqword *oldaccess = mem->_access;
+  mem->_dirty = dirty;
+  mem->_access = access;
+
+  // marks made on the old ones before this are carried over, the later ones
+  // see the new generation and take the slow path
+  atomic_fetch_add(&mem->_gen, 1);
+  for (vqword i = 0; i < oldwords; i++)
+    atomic_store(&dirty[i], atomic_load(&olddirty[i]));
+  for (vqword i = 0; i < oldwords * VMSAMPLERS; i++)
+    atomic_store(&access[i], atomic_load(&oldaccess[i]));
+
+  v__mretire(mem, (void*)olddirty);
+  v__mretire(mem, (void*)oldaccess);
+  return VOK;
+}
+
+// map page 'ndx', optionally backed by an external (non-owned) 'frame'
+static int v__mmap(vmem *mem, vqword ndx, vbyte flags, vbyte *frame) {
   if (NULL == mem || NULL == mem->page) return VENOMEM;
 
   // invalid page index
@@ -105,81 +825,143 @@ int vmmap(vmem *mem, vqword ndx, vbyte flags) {
   // acquire the write lock, this is to prevent the possibility of having
   // multiple calls to vmmap having the same ndx to allocate separate slots for
   // that same page. we're wasting memory
-  rw_wlock(&mem->_lock);
+  brw_wlock(&mem->_lock);
 
   // ptr into an element within the page table
   vmpage *avail = NULL;
 
-  // if there's still some slots in the table is available, try to grab them
-  if (mem->_alloc > mem->_used) {
-    for (vqword i = 0; i < mem->_alloc; i++) {
+  // look for the page, and an empty slot while we're at it
+  for (vqword i = 0; i < mem->_alloc; i++) {
 
-      // the requested page ndx is already mapped! stop the operation
-      if (mem->page[i].ndx == ndx) {
-        rw_wunlock(&mem->_lock);
-        return VOK;
+    // the requested page ndx is already mapped! stop the operation, unless
+    // we're given a frame to put in place of the current one
+    if (mem->page[i].ndx == ndx) {
+      if (NULL != frame) {
+        if (NULL == mem->page[i].frame && !v__mfits(mem)) {
+          brw_wunlock(&mem->_lock);
+          return VENOMEM;
+        }
+        v__mfdrop(mem, &mem->page[i]);
+        mem->page[i].flags &= ~VPLAZY;
+        mem->page[i].frame = frame;
+        atomic_fetch_add(&mem->_resident, VPAGESZ);
+        vmdirty(mem, &mem->page[i]);
       }
+      brw_wunlock(&mem->_lock);
+      return VOK;
+    }
 
-      // check if this is an empty slot, we can use this to map the page
-      if (NULL == avail && -1 == mem->page[i].ndx) avail = &mem->page[i];
+    // check if this is an empty slot, we can use this to map the page
+    if (NULL == avail && -1 == mem->page[i].ndx) avail = &mem->page[i];
 
-    }
   }
 
-  // the page table is full, try to resize it
-  else {
-    vmpage *tmp = (vmpage*)realloc(mem->page, sizeof(vmpage) * mem->_alloc * 2);
+  // the new frame should fit within the limit
+  if (NULL != frame && !v__mfits(mem)) {
+    brw_wunlock(&mem->_lock);
+    return VENOMEM;
+  }
+
+  // the page table is full, try to resize it. the pages handed out by vmgetp
+  // may still be in use, so the old table is retired rather than freed. room
+  // is made up front for it and the two bitmaps that may go with it
+  if (NULL == avail) {
+    vmpage *tmp = VOK != v__mreserve(mem, 3) ? NULL :
+                  (vmpage*)malloc(sizeof(vmpage) * mem->_alloc * 2);
 
     // failed to re-allocate the page table
     if (NULL == tmp) {
-      rw_wunlock(&mem->_lock);
+      brw_wunlock(&mem->_lock);
       return VENOMEM;
     }
+    memcpy(tmp, mem->page, sizeof(vmpage) * mem->_alloc);
 
     // initialize the new data
     for (vqword i = 0; i < mem->_alloc; i++) {
       tmp[mem->_alloc + i].ndx = -1;
       tmp[mem->_alloc + i].flags = 0;
       tmp[mem->_alloc + i].frame = NULL;
+      tmp[mem->_alloc + i].blob = NULL;
+    }
+
+    // grow the bitmaps along with it
+    vqword words = (mem->_alloc * 2 + 63) >> 6;
+    vqword oldwords = (mem->_alloc + 63) >> 6;
+    if (words > oldwords && VOK != v__mgrowbits(mem, oldwords, words)) {
+      free(tmp);
+      brw_wunlock(&mem->_lock);
+      return VENOMEM;
     }
 
     // the end of the last allocation is now available! use it
     avail = &tmp[mem->_alloc];
     mem->_alloc *= 2;
+    v__mretire(mem, mem->page);
     mem->page = tmp;
   }
 
   // set some variables on the page
   avail->ndx = ndx;
-  avail->flags = flags;
+  avail->flags = flags & ~(VPOWNED | VPCOW);
+  avail->frame = frame;
   mem->_used++;
+  vmdirty(mem, avail);
+  if (NULL != frame) atomic_fetch_add(&mem->_resident, VPAGESZ);
 
   // release the lock, allow other tasks to access the memory
-  rw_wunlock(&mem->_lock);
+  brw_wunlock(&mem->_lock);
+  return VOK;
+}
+
+int vmmap(vmem *mem, vqword ndx, vbyte flags) {
+  return v__mmap(mem, ndx, flags, NULL);
+}
+
+int vmmapf(vmem *mem, vqword ndx, vbyte flags, vbyte *frame) {
+  if (NULL == frame) return VERROR;
+  return v__mmap(mem, ndx, flags, frame);
+}
+
+// remember an unmapped page for the next checkpoint
+static int v__mlogunmap(vmem *mem, vqword ndx) {
+  if (mem->_unmapped_used >= mem->_unmapped_alloc) {
+    vqword alloc = 0 == mem->_unmapped_alloc ? 16 : mem->_unmapped_alloc * 2;
+    vqword *tmp = (vqword*)realloc(mem->_unmapped, sizeof(vqword) * alloc);
+    if (NULL == tmp) return VENOMEM;
+    mem->_unmapped = tmp;
+    mem->_unmapped_alloc = alloc;
+  }
+  mem->_unmapped[mem->_unmapped_used++] = ndx;
   return VOK;
 }
 
 int vmunmap(vmem *mem, vqword ndx) {
   if (NULL == mem || NULL == mem->page) return VERROR;
+  int stat = VOK;
+  vmpage gone = { .ndx = -1 };
 
   // invalid page index
   if (VPAGEMX < ndx) return VESEGV;
 
   // we need a write-lock here, 'cause other thread might about to access this
   // page
-  rw_wlock(&mem->_lock);
+  brw_wlock(&mem->_lock);
 
   // find the page and unmap it
   for (vqword i = 0; i < mem->_alloc; i++) {
     if (ndx == mem->page[i].ndx) {
 
-      // if the frame of this page is not NULL and this page owns that frame,
-      // de-allocate the frame
-      if ((mem->page[i].flags & VPOWNED) && NULL != mem->page[i].frame)
-        free(mem->page[i].frame);
+      // the next checkpoint needs to know this page is gone
+      if (mem->_ckpt) {
+        stat = v__mlogunmap(mem, ndx);
+        if (VOK != stat) break;
+      }
 
-      // reset the variables in slot for later reuse
+      // the frame is dropped once nobody can be using it anymore
+      gone = mem->page[i];
       mem->page[i].frame = NULL;
+
+      // reset the variables in slot for later reuse
       mem->page[i].ndx = -1;
       mem->page[i].flags = 0;
       mem->_used--;
@@ -188,115 +970,411 @@ int vmunmap(vmem *mem, vqword ndx) {
     }
   }
 
-  rw_wunlock(&mem->_lock);
-
-  // remove the page from cache, if it is currently cached
+  // remove the page from cache, if it is currently cached. before the lock
+  // is let go, so nobody finds the slot through it once it's reused
   fmtx_lock(&mem->_cache_lock);
-  _vmem_cache *ent = mem->_cache_head;
-  for (int i = 0; i < mem->_cache_used; i++) {
+  for (_vmem_cache *ent = mem->_cache_head; NULL != ent; ent = ent->next) {
     if (ent->ndx == ndx) {
-      if (NULL != ent->prev) ent->prev->next = ent->next;
-      else mem->_cache_head = ent->next;
-      if (NULL != ent->next) ent->next->prev = ent->prev;
-      else mem->_cache_tail = ent->prev;
+      v__mcache_unlink(mem, ent);
       ent->ndx = -1;
       ent->offst = 0;
-      ent->prev = NULL;
-      ent->next = NULL;
+      mem->_cache_used--;
       break;
     }
-    if (ent->next == NULL) break;
-    ent = ent->next;
   }
   fmtx_unlock(&mem->_cache_lock);
 
+  brw_wunlock(&mem->_lock);
+
+  // if the frame of this page is not NULL and this page owns that frame,
+  // de-allocate the frame
+  if (-1 != gone.ndx) {
+    v__mgrace(mem);
+    v__mfdrop(mem, &gone);
+  }
+
+  return stat;
+}
+
+// copy the parts of the lazy ranges that overlap with a page onto a zeroed
+// 'frame', in the order they were recorded
+static void v__mfill(vmem *mem, vmpage *pg, vbyte *frame) {
+  vqword from = pg->ndx << VPAGESHIFT;
+  vqword to = from + VPAGESZ;
+  for (vqword i = 0; i < mem->_seg_used; i++) {
+    vmseg *seg = &mem->seg[i];
+    vqword lo = seg->addr > from ? seg->addr : from;
+    vqword hi = seg->addr + seg->size < to ? seg->addr + seg->size : to;
+    if (lo >= hi) continue;
+    if (NULL != seg->src)
+      memcpy(frame + (lo - from), seg->src + (lo - seg->addr), hi - lo);
+    else
+      memset(frame + (lo - from), 0, hi - lo);
+  }
+}
+
+// read the swapped out contents of a page onto 'buf'
+static int v__mswapin(vmem *mem, vmpage *pg, vbyte *buf) {
+#ifdef HAVE_PREAD
+  vqword got = 0;
+  while (got < VPAGESZ) {
+    ssize_t n = pread(mem->_swapfd, buf + got, VPAGESZ - got,
+                      (off_t)(pg->swap * VPAGESZ + got));
+    if (0 >= n) return VERROR;
+    got += n;
+  }
+  atomic_fetch_add(&mem->_swapin, VPAGESZ);
   return VOK;
+#else
+  return VERROR;
+#endif
 }
 
-int vmgetp(vmem *mem, vqword ndx, vmpage **out) {
-  if (NULL == mem || NULL == mem->page || NULL == out) return VERROR;
+// allocate the frame of a page on its first access, and populate it from the
+// lazy ranges it has
+static int v__mfault(vmem *mem, vmpage *pg) {
+  mtx_lock(&mem->_fault_lock);
+
+  // another thread got here first
+  if (NULL != pg->frame) {
+    mtx_unlock(&mem->_fault_lock);
+    return VOK;
+  }
+
+  vbyte *frame = v__mfalloc(mem);
+  if (NULL == frame) {
+    mtx_unlock(&mem->_fault_lock);
+    return VENOMEM;
+  }
+
+  // expand it if it's compressed, or populate it from the lazy ranges
+  if (VPCOMP & pg->flags) {
+    if (VOK != vlzdec(pg->blob->data, pg->blob->size, frame, VPAGESZ)) {
+      v__mffree(mem, frame);
+      mtx_unlock(&mem->_fault_lock);
+      return VERROR;
+    }
+    v__mbput(mem, pg);
+    atomic_fetch_add(&mem->_cfaults, 1);
+  }
+  else if (VPSWAP & pg->flags) {
+    if (VOK != v__mswapin(mem, pg, frame)) {
+      v__mffree(mem, frame);
+      mtx_unlock(&mem->_fault_lock);
+      return VERROR;
+    }
+    v__mwput(mem, pg);
+    atomic_fetch_add(&mem->_sfaults, 1);
+  }
+  else if (VPLAZY & pg->flags) v__mfill(mem, pg, frame);
+
+  // the contents of a page that's expanded or swapped in are the same as the
+  // ones the last checkpoint has, only the lazy ranges are new to it
+  if (VPLAZY & pg->flags) vmdirty(mem, pg);
+  pg->flags = (pg->flags & ~VPLAZY) | VPOWNED;
+  pg->frame = frame;
+  mtx_unlock(&mem->_fault_lock);
+  v__mover(mem);
+  return VOK;
+}
+
+// give a page its own copy of a frame it shares copy-on-write, before it's
+// written to
+static int v__mcow(vmem *mem, vmpage *pg) {
+  mtx_lock(&mem->_fault_lock);
+
+  // another thread got here first
+  if (!(VPCOW & pg->flags)) {
+    mtx_unlock(&mem->_fault_lock);
+    return VOK;
+  }
+
+  // the shared frame is already counted as resident
+  atomic_fetch_sub(&mem->_resident, VPAGESZ);
+  vbyte *frame = v__mfalloc(mem);
+  if (NULL == frame) {
+    atomic_fetch_add(&mem->_resident, VPAGESZ);
+    mtx_unlock(&mem->_fault_lock);
+    return VENOMEM;
+  }
+  memcpy(frame, pg->frame, VPAGESZ);
+  atomic_fetch_sub(&mem->_shared, VPAGESZ);
+
+  // the old frame is left to its share group (or its owner, if external)
+  if (VPMERGED & pg->flags) v__mrput(pg);
+  pg->flags = (pg->flags & ~VPCOW) | VPOWNED;
+  pg->frame = frame;
+  atomic_fetch_add(&mem->_gen, 1);
+  vmdirty(mem, pg);
+  mtx_unlock(&mem->_fault_lock);
+  v__mover(mem);
+  return VOK;
+}
+
+vbyte *vmpeek(vmem *mem, vmpage *pg, vbyte *buf) {
+  if (NULL != pg->frame) return pg->frame;
+  if (VPCOMP & pg->flags)
+    return VOK == vlzdec(pg->blob->data, pg->blob->size, buf, VPAGESZ) ?
+           buf : NULL;
+  if (VPSWAP & pg->flags)
+    return VOK == v__mswapin(mem, pg, buf) ? buf : NULL;
+  if (!(VPLAZY & pg->flags)) return NULL;
+  memset(buf, 0, VPAGESZ);
+  v__mfill(mem, pg, buf);
+  return buf;
+}
+
+int vmstat(vmem *mem, struct vmstats *out) {
+  if (NULL == mem || NULL == out) return VERROR;
+
+  out->mapped = mem->_used * VPAGESZ;
+  out->resident = atomic_load(&mem->_resident);
+  out->owned = atomic_load(&mem->_owned);
+  out->shared = atomic_load(&mem->_shared);
+  out->compressed = atomic_load(&mem->_comp);
+  out->store = atomic_load(&mem->_store);
+  out->cfaults = atomic_load(&mem->_cfaults);
+  out->budget = -1 == mem->_swapfd ? 0 : mem->budget;
+  out->swapped = atomic_load(&mem->_swapped);
+  out->sfaults = atomic_load(&mem->_sfaults);
+  out->swapin = atomic_load(&mem->_swapin);
+  out->swapout = atomic_load(&mem->_swapout);
+  out->limit = mem->limit;
+
+  return VOK;
+}
+
+int vmlazy(vmem *mem, vqword addr, vbyte *src, vqword sz) {
+  if (NULL == mem || NULL == mem->page) return VERROR;
+
+  // nothing to record
+  if (0 == sz) return VOK;
+
+  brw_wlock(&mem->_lock);
+
+  // grow the range list when needed
+  if (mem->_seg_used >= mem->_seg_alloc) {
+    vqword alloc = 0 == mem->_seg_alloc ? 4 : mem->_seg_alloc * 2;
+    vmseg *tmp = (vmseg*)realloc(mem->seg, sizeof(vmseg) * alloc);
+    if (NULL == tmp) {
+      brw_wunlock(&mem->_lock);
+      return VENOMEM;
+    }
+    mem->seg = tmp;
+    mem->_seg_alloc = alloc;
+  }
+
+  // mark the pages it covers, these should be mapped by now
+  vqword pgfrom = addr >> VPAGESHIFT;
+  vqword pgto = (addr + sz - 1) >> VPAGESHIFT;
+  for (vqword i = 0; i < mem->_alloc; i++) {
+    vmpage *pg = &mem->page[i];
+    if (-1 == pg->ndx || pg->ndx < pgfrom || pg->ndx > pgto) continue;
+
+    // expand the compressed and the swapped out pages first
+    if ((VPCOMP | VPSWAP) & pg->flags && VOK != v__mfault(mem, pg)) {
+      brw_wunlock(&mem->_lock);
+      return VENOMEM;
+    }
+
+    // pages that are already populated get their bytes right away
+    if (NULL != pg->frame) {
+      if (VPCOW & pg->flags && VOK != v__mcow(mem, pg)) {
+        brw_wunlock(&mem->_lock);
+        return VENOMEM;
+      }
+      vqword from = pg->ndx << VPAGESHIFT;
+      vqword lo = addr > from ? addr : from;
+      vqword hi = addr + sz < from + VPAGESZ ? addr + sz : from + VPAGESZ;
+      if (NULL != src) memcpy(pg->frame + (lo - from), src + (lo - addr),
+                              hi - lo);
+      else             memset(pg->frame + (lo - from), 0, hi - lo);
+      vmdirty(mem, pg);
+    }
+    else pg->flags |= VPLAZY;
+  }
+
+  mem->seg[mem->_seg_used].addr = addr;
+  mem->seg[mem->_seg_used].size = sz;
+  mem->seg[mem->_seg_used].src = src;
+  mem->_seg_used++;
+
+  brw_wunlock(&mem->_lock);
+  return VOK;
+}
+
+// the translations each thread used lately, in front of the shared cache. the
+// entries are only hints, they're checked against the page table when used,
+// so nothing has to invalidate them
+#define V__TLBSZ      64
+
+static _Thread_local struct {
+  vmem              *mem;
+  vqword            ndx;
+  vqword            slot;
+} v__tlb[V__TLBSZ];
+
+// remember a translation for the calling thread
+static inline void v__mtlbset(vmem *mem, vqword ndx, vqword slot) {
+  vqword at = ndx & (V__TLBSZ - 1);
+  v__tlb[at].mem = mem;
+  v__tlb[at].ndx = ndx;
+  v__tlb[at].slot = slot;
+}
+
+// find a page, the caller holds the page table lock
+static int v__mgetp(vmem *mem, vqword ndx, vmpage **out) {
 
   // invalid page index
   if (VPAGEMX < ndx) return VESEGV;
 
+  // the thread's own translations first, these write no shared memory
+  vqword at = ndx & (V__TLBSZ - 1);
+  vqword slot = v__tlb[at].slot;
+  if (mem == v__tlb[at].mem && ndx == v__tlb[at].ndx &&
+      slot < mem->_alloc && ndx == mem->page[slot].ndx)
+  {
+    *out = &mem->page[slot];
+    vmtouch(mem, slot);
+    return VOK;
+  }
+
   _vmem_cache *ent = NULL;
 
-  // check the cache first
+  // then the shared cache
   fmtx_lock(&mem->_cache_lock);
-  ent = mem->_cache_head;
-  for (int i = 0; i < mem->_cache_used; i++) {
-    if (ent->ndx == ndx) {
-      *out = mem->page + ent->offst;
-      if (NULL != ent->prev) ent->prev->next = ent->next;
-      if (NULL != ent->next) ent->next->prev = ent->prev;
-      mem->_cache_head->prev = ent;
-      ent->next = mem->_cache_head;
-      ent->prev = NULL;
-      mem->_cache_head = ent;
-      fmtx_unlock(&mem->_cache_lock);
-      // cache hit
-      return VOK;
+  for (ent = mem->_cache_head; NULL != ent; ent = ent->next) {
+    if (ent->ndx != ndx) continue;
+
+    // gone stale, its slot holds another page now. it's dropped, a miss
+    if (ent->offst >= mem->_alloc || ndx != mem->page[ent->offst].ndx) {
+      v__mcache_unlink(mem, ent);
+      ent->ndx = -1;
+      ent->offst = 0;
+      mem->_cache_used--;
+      break;
     }
-    // cache miss
-    if (ent->next == NULL) break;
-    ent = ent->next;
+
+    *out = mem->page + ent->offst;
+    vmtouch(mem, ent->offst);
+    v__mtlbset(mem, ndx, ent->offst);
+    // move it to the front
+    v__mcache_unlink(mem, ent);
+    v__mcache_push(mem, ent);
+    fmtx_unlock(&mem->_cache_lock);
+    // cache hit
+    return VOK;
   }
+  // cache miss
   fmtx_unlock(&mem->_cache_lock);
 
-  // acquire rlock
-  rw_rlock(&mem->_lock);
-
   // page table lookup, find the page and return it
   for (vqword i = 0; i < mem->_alloc; i++) {
     if (ndx == mem->page[i].ndx) {
       *out = &mem->page[i];
-      rw_runlock(&mem->_lock);
-      // page table hit, update the cache
+      vmtouch(mem, i);
+      v__mtlbset(mem, ndx, i);
 
+      // page table hit, update the cache
+      if (0 == mem->_cache_size) return VOK;
       fmtx_lock(&mem->_cache_lock);
 
       // cache is full, evict the lru
       if (mem->_cache_size <= mem->_cache_used) {
-        if (NULL != mem->_cache_tail->prev)
-          mem->_cache_tail->prev->next = NULL;
         ent = mem->_cache_tail;
-        if (NULL != mem->_cache_tail->prev)
-          mem->_cache_tail = mem->_cache_tail->prev;
-        mem->_cache_head->prev = ent;
-        ent->prev = NULL;
-        ent->next = mem->_cache_head;
-        mem->_cache_head = ent;
-        ent->ndx = ndx;
-        ent->offst = &mem->page[i] - mem->page;
-        fmtx_unlock(&mem->_cache_lock);
-        return VOK;
+        v__mcache_unlink(mem, ent);
       }
 
       // find a free entry in the pool
-      for (int i = 0; i < mem->_cache_size; i++) {
-        if (mem->cache_pool[i].ndx == -1) {
-          ent = &mem->cache_pool[i];
-          mem->_cache_head->prev = ent;
-          ent->prev = NULL;
-          ent->next = mem->_cache_head;
-          mem->_cache_head = ent;
-          ent->ndx = ndx;
-          ent->offst = &mem->page[i] - mem->page;
-          mem->_cache_used++;
-          fmtx_unlock(&mem->_cache_lock);
-          return VOK;
+      else {
+        for (int j = 0; j < mem->_cache_size; j++) {
+          if (mem->cache_pool[j].ndx == -1) {
+            ent = &mem->cache_pool[j];
+            mem->_cache_used++;
+            break;
+          }
         }
       }
 
+      ent->ndx = ndx;
+      ent->offst = i;
+      v__mcache_push(mem, ent);
+      fmtx_unlock(&mem->_cache_lock);
+      return VOK;
     }
   }
 
-  rw_runlock(&mem->_lock);
-
   // page table miss, the page does not exist, raise segmentation fault
   return VESEGV;
 }
 
+int vmsolo(vmem *mem, verec *rec) {
+  if (NULL == mem || NULL == mem->epoch || NULL == rec) return VERROR;
+
+  // a sweep going on puts it in place once it's done
+  mtx_lock(&mem->_solo_lock);
+  mem->_solo_rec = rec;
+  if (0 == mem->_solo_held) atomic_store(&mem->_solo, rec);
+  mtx_unlock(&mem->_solo_lock);
+  return VOK;
+}
+
+int vmunsolo(vmem *mem, verec *self) {
+  if (NULL == mem) return VERROR;
+
+  // the accesses it's in the middle of are over at its next quiescent point
+  mtx_lock(&mem->_solo_lock);
+  mem->_solo_rec = NULL;
+  if (NULL != atomic_exchange(&mem->_solo, NULL)) vesync(mem->epoch, self);
+  mtx_unlock(&mem->_solo_lock);
+  return VOK;
+}
+
+// hold off vmsolo while a sweep takes frames from under the thread. the lock
+// is kept through the grace period, so a sweep that comes in meanwhile waits
+// for it as well
+static void v__mhold(vmem *mem) {
+  mtx_lock(&mem->_solo_lock);
+  mem->_solo_held++;
+  if (NULL != atomic_exchange(&mem->_solo, NULL)) vesync(mem->epoch, NULL);
+  mtx_unlock(&mem->_solo_lock);
+}
+
+// the last sweep is done, the thread goes without the lock again, unless
+// vmunsolo ended it in the meantime
+static void v__mrelease(vmem *mem) {
+  mtx_lock(&mem->_solo_lock);
+  if (0 == --mem->_solo_held && NULL != mem->_solo_rec)
+    atomic_store(&mem->_solo, mem->_solo_rec);
+  mtx_unlock(&mem->_solo_lock);
+}
+
+// take the page table read lock, -1 when it's not needed. the single thread
+// accessing the memory goes without it while online, vmunsolo waits for it to
+// get past a quiescent point before anyone else takes the lock. offline, in
+// a syscall, it's not waited for and takes the lock like the others
+static inline int v__mrlock(vmem *mem) {
+  verec *solo = atomic_load(&mem->_solo);
+  if (NULL != solo &&
+      VEOFF != atomic_load_explicit(&solo->local, memory_order_relaxed))
+    return -1;
+  return brw_rlock(&mem->_lock);
+}
+
+static inline void v__mrunlock(vmem *mem, int rd) {
+  if (-1 != rd) brw_runlock(&mem->_lock, rd);
+}
+
+int vmgetp(vmem *mem, vqword ndx, vmpage **out) {
+  if (NULL == mem || NULL == mem->page || NULL == out) return VERROR;
+
+  int rd = v__mrlock(mem);
+  int stat = v__mgetp(mem, ndx, out);
+  v__mrunlock(mem, rd);
+
+  return stat;
+}
+
 int vmgetd(vmem *mem, vbyte *out, vqword addr, vqword sz, vbyte perm) {
   if (NULL == mem || NULL == mem->page || NULL == out) return VERROR;
 
@@ -309,12 +1387,12 @@ int vmgetd(vmem *mem, vbyte *out, vqword addr, vqword sz, vbyte perm) {
   // we only need to check the permission flags
   perm &= 7;
 
-  vqword ndx = addr >> 14;
-  vqword disp = addr & 0x3fff;
+  vqword ndx = addr >> VPAGESHIFT;
+  vqword disp = addr & VPAGEMASK;
   vmpage *curr = NULL;
   int stat = VOK;
 
-  rw_rlock(&mem->_lock);
+  int rd = v__mrlock(mem);
 
   for (vqword i = 0; i < sz; i++) {
     if (NULL == curr || disp >= VPAGESZ) {
@@ -322,24 +1400,24 @@ int vmgetd(vmem *mem, vbyte *out, vqword addr, vqword sz, vbyte perm) {
       if (NULL != curr) disp = 0;
 
       // attempt to get the page
-      stat = vmgetp(mem, ndx++, &curr);
+      stat = v__mgetp(mem, ndx++, &curr);
       if (VOK != stat) {
-        rw_runlock(&mem->_lock);
+        v__mrunlock(mem, rd);
         return stat;
       }
 
       // check for permissions
       if ((curr->flags & perm) != perm) {
-        rw_runlock(&mem->_lock);
+        v__mrunlock(mem, rd);
         return VEACCES;
       }
 
       // initialize the page if needed
       if (NULL == curr->frame) {
-        curr->frame = (vbyte*)malloc(VPAGESZ);
-        if (NULL == curr->frame) {
-          rw_runlock(&mem->_lock);
-          return VENOMEM;
+        stat = v__mfault(mem, curr);
+        if (VOK != stat) {
+          v__mrunlock(mem, rd);
+          return stat;
         }
       }
 
@@ -348,7 +1426,7 @@ int vmgetd(vmem *mem, vbyte *out, vqword addr, vqword sz, vbyte perm) {
     out[i] = curr->frame[disp++];
   }
 
-  rw_runlock(&mem->_lock);
+  v__mrunlock(mem, rd);
   return VOK;
 }
 
@@ -364,12 +1442,12 @@ int vmsetd(vmem *mem, vbyte *in, vqword addr, vqword sz, vbyte perm) {
   // we only need to check the permission flags
   perm &= 7;
 
-  vqword ndx = addr >> 14;
-  vqword disp = addr & 0x3fff;
+  vqword ndx = addr >> VPAGESHIFT;
+  vqword disp = addr & VPAGEMASK;
   vmpage *curr = NULL;
   int stat = VOK;
 
-  rw_rlock(&mem->_lock);
+  int rd = v__mrlock(mem);
 
   for (vqword i = 0; i < sz; i++) {
     if (NULL == curr || disp >= VPAGESZ) {
@@ -377,33 +1455,98 @@ int vmsetd(vmem *mem, vbyte *in, vqword addr, vqword sz, vbyte perm) {
       if (NULL != curr) disp = 0;
 
       // attempt to get the page
-      stat = vmgetp(mem, ndx++, &curr);
+      stat = v__mgetp(mem, ndx++, &curr);
       if (VOK != stat) {
-        rw_runlock(&mem->_lock);
+        v__mrunlock(mem, rd);
         return stat;
       }
 
       // check for permissions
       if ((curr->flags & perm) != perm) {
-        rw_runlock(&mem->_lock);
+        v__mrunlock(mem, rd);
         return VEACCES;
       }
 
       // initialize the page if needed
       if (NULL == curr->frame) {
-        curr->frame = (vbyte*)malloc(VPAGESZ);
-        if (NULL == curr->frame) {
-          rw_runlock(&mem->_lock);
-          return VENOMEM;
+        stat = v__mfault(mem, curr);
+        if (VOK != stat) {
+          v__mrunlock(mem, rd);
+          return stat;
         }
       }
 
+      // copy the frame if it's shared
+      if (VPCOW & curr->flags) {
+        stat = v__mcow(mem, curr);
+        if (VOK != stat) {
+          v__mrunlock(mem, rd);
+          return stat;
+        }
+      }
+      vmdirty(mem, curr);
+
     }
     // copy the byte
     curr->frame[disp++] = in[i];
   }
 
-  rw_runlock(&mem->_lock);
+  v__mrunlock(mem, rd);
+  return VOK;
+}
+
+// NOTE:
+// - the guest memory is little endian, the host atomics work on it as is. so
+//   the host is assumed to be little endian too
+#define V__MATOMIC(type, at, op, val, cmp)                                    \
+  do {                                                                        \
+    _Atomic type *p = (_Atomic type*)(at);                                    \
+    type old = (type)(cmp);                                                   \
+    switch (op) {                                                             \
+      case VMAXCHG: old = atomic_exchange(p, (type)*(val)); break;            \
+      case VMAADD:  old = atomic_fetch_add(p, (type)*(val)); break;           \
+      default:      atomic_compare_exchange_strong(p, &old, (type)*(val));    \
+    }                                                                         \
+    *(val) = old;                                                             \
+  } while (0)
+
+int vmatomic(vmem *mem, vqword addr, vqword sz, int op, vqword *val,
+             vqword cmp)
+{
+  if (NULL == mem || NULL == mem->page || NULL == val) return VERROR;
+  if (1 != sz && 2 != sz && 4 != sz && 8 != sz) return VERROR;
+
+  // access to 0x0 (NULL) is not allowed
+  if (0 == addr) return VENULL;
+
+  // naturally aligned, so it's within a page and a single host access
+  if (0 != (addr & (sz - 1))) return VEALIGN;
+
+  vmpage *pg = NULL;
+  int rd = v__mrlock(mem);
+
+  // it's read and written, like by vmsetd
+  int stat = v__mgetp(mem, addr >> VPAGESHIFT, &pg);
+  if (VOK == stat && (pg->flags & (VPREAD | VPWRITE)) != (VPREAD | VPWRITE))
+    stat = VEACCES;
+  if (VOK == stat && NULL == pg->frame) stat = v__mfault(mem, pg);
+  if (VOK == stat && (VPCOW & pg->flags)) stat = v__mcow(mem, pg);
+  if (VOK != stat) {
+    v__mrunlock(mem, rd);
+    return stat;
+  }
+  vmdirty(mem, pg);
+
+  // the frame stays put while the lock is held
+  vbyte *at = pg->frame + (addr & VPAGEMASK);
+  switch (sz) {
+    case 1:   V__MATOMIC(uint8_t, at, op, val, cmp); break;
+    case 2:   V__MATOMIC(uint16_t, at, op, val, cmp); break;
+    case 4:   V__MATOMIC(uint32_t, at, op, val, cmp); break;
+    default:  V__MATOMIC(uint64_t, at, op, val, cmp);
+  }
+
+  v__mrunlock(mem, rd);
   return VOK;
 }
 
@@ -416,12 +1559,12 @@ int vmfilld(vmem *mem, vqword addr, vqword sz, vbyte c) {
   // nothing to write
   if (0 == sz) return VOK;
 
-  vqword ndx = addr >> 14;
-  vqword disp = addr & 0x3fff;
+  vqword ndx = addr >> VPAGESHIFT;
+  vqword disp = addr & VPAGEMASK;
   vmpage *curr = NULL;
   int stat = VOK;
 
-  rw_rlock(&mem->_lock);
+  int rd = v__mrlock(mem);
 
   for (vqword i = 0; i < sz; i++) {
     if (NULL == curr || disp >= VPAGESZ) {
@@ -429,26 +1572,732 @@ int vmfilld(vmem *mem, vqword addr, vqword sz, vbyte c) {
       if (NULL != curr) disp = 0;
 
       // attempt to get the page
-      stat = vmgetp(mem, ndx++, &curr);
+      stat = v__mgetp(mem, ndx++, &curr);
       if (VOK != stat) {
-        rw_runlock(&mem->_lock);
+        v__mrunlock(mem, rd);
         return stat;
       }
 
       // initialize the page if needed
       if (NULL == curr->frame) {
-        curr->frame = (vbyte*)malloc(VPAGESZ);
-        if (NULL == curr->frame) {
-          rw_runlock(&mem->_lock);
-          return VENOMEM;
+        stat = v__mfault(mem, curr);
+        if (VOK != stat) {
+          v__mrunlock(mem, rd);
+          return stat;
         }
       }
 
+      // copy the frame if it's shared
+      if (VPCOW & curr->flags) {
+        stat = v__mcow(mem, curr);
+        if (VOK != stat) {
+          v__mrunlock(mem, rd);
+          return stat;
+        }
+      }
+      vmdirty(mem, curr);
+
     }
     // copy the byte
     curr->frame[disp++] = c;
   }
 
-  rw_runlock(&mem->_lock);
+  v__mrunlock(mem, rd);
+  return VOK;
+}
+
+// a page is cold after this many samples without being accessed
+#define V__CAGE       2
+
+// pages compressed at once, between taking the page table lock
+#define V__CBATCH     64
+
+// the access bits of the sampler 'who' for page 'slot', see VMSAMPLERS
+static inline _Atomic vqword *v__maccess(vmem *mem, int who, vqword slot) {
+  return &mem->_access[(slot >> 6) * VMSAMPLERS + who];
+}
+
+// age the pages by the access bits of the sampler 'who', into its own ages,
+// and start its next sample. the others' bits are left alone
+static int v__msample(vmem *mem, int who, vbyte **ages, vqword *alloc) {
+  brw_wlock(&mem->_lock);
+  if (*alloc < mem->_alloc) {
+    vbyte *age = (vbyte*)realloc(*ages, mem->_alloc);
+    if (NULL == age) {
+      brw_wunlock(&mem->_lock);
+      return VENOMEM;
+    }
+    memset(age + *alloc, 0, mem->_alloc - *alloc);
+    *ages = age;
+    *alloc = mem->_alloc;
+  }
+  vbyte *age = *ages;
+  for (vqword i = 0; i < mem->_alloc; i++) {
+    vqword used = atomic_load(v__maccess(mem, who, i)) &
+                  ((vqword)1 << (i & 63));
+    if (used || -1 == mem->page[i].ndx) age[i] = 0;
+    else if (0xff > age[i]) age[i]++;
+  }
+  for (vqword i = 0; i < mem->_alloc; i += 64)
+    atomic_store(v__maccess(mem, who, i), 0);
+  brw_wunlock(&mem->_lock);
+  return VOK;
+}
+
+int vmcold(vmem *mem) {
+  if (NULL == mem || NULL == mem->page) return VERROR;
+
+  vqword slot[V__CBATCH];
+  vbyte *frame[V__CBATCH];
+  vmblob *blob[V__CBATCH];
+  int stat = VOK;
+
+  vbyte *buf = (vbyte*)malloc(VPAGESZ);
+  if (NULL == buf) return VENOMEM;
+
+  // the pages are taken from under the thread going without the lock
+  v__mhold(mem);
+
+  stat = v__msample(mem, VMSCOLD, &mem->_age, &mem->_age_alloc);
+
+  // compress the cold pages, a batch at a time. the guest keeps running while
+  // we're at it, the pages it touches in the meantime are left alone
+  vqword next = 0;
+  while (VOK == stat) {
+    vqword n = 0;
+
+    int rd = brw_rlock(&mem->_lock);
+    for (; next < mem->_age_alloc && n < V__CBATCH; next++) {
+      vmpage *pg = &mem->page[next];
+      if (-1 == pg->ndx || V__CAGE > mem->_age[next]) continue;
+      if (!(VPOWNED & pg->flags) || NULL == pg->frame) continue;
+
+      // a page that doesn't shrink by a quarter is not worth it, try it again
+      // once it's cold again
+      vqword sz = vlzenc(pg->frame, VPAGESZ, buf, VPAGESZ - VPAGESZ / 4);
+      if (0 == sz) {
+        mem->_age[next] = 0;
+        continue;
+      }
+
+      blob[n] = (vmblob*)malloc(sizeof(vmblob) + sz);
+      if (NULL == blob[n]) {
+        stat = VENOMEM;
+        break;
+      }
+      atomic_init(&blob[n]->_refs, 1);
+      blob[n]->size = sz;
+      memcpy(blob[n]->data, buf, sz);
+      slot[n] = next;
+      frame[n] = pg->frame;
+      n++;
+    }
+    brw_runlock(&mem->_lock, rd);
+    if (0 == n) break;
+
+    // swap the frames for their compressed contents. the stack fast path marks
+    // the page before checking the generation, we do it the other way around
+    v__mgrace(mem);
+    brw_wlock(&mem->_lock);
+    for (vqword i = 0; i < n; i++) {
+      vmpage *pg = &mem->page[slot[i]];
+      vqword bit = (vqword)1 << (slot[i] & 63);
+      if ((atomic_load(v__maccess(mem, VMSCOLD, slot[i])) & bit) ||
+          frame[i] != pg->frame || !(VPOWNED & pg->flags))
+      {
+        free(blob[i]);
+        continue;
+      }
+      v__mffree(mem, pg->frame);
+      pg->frame = NULL;
+      pg->blob = blob[i];
+      pg->flags = (pg->flags & ~VPOWNED) | VPCOMP;
+      atomic_fetch_add(&mem->_comp, VPAGESZ);
+      atomic_fetch_add(&mem->_store, blob[i]->size);
+    }
+    brw_wunlock(&mem->_lock);
+  }
+
+  v__mrelease(mem);
+  free(buf);
+  return stat;
+}
+
+// the compressor task
+static int v__mcold(void *arg) {
+  return vmcold((vmem*)arg);
+}
+
+int vmcompress(vmem *mem, vqword ms) {
+  if (NULL == mem) return VERROR;
+  return v__tstart(&mem->_cold, ms, v__mcold, mem);
+}
+
+// the most frames written out at once
+#define V__SBATCH     64
+
+// the write-back period, it's woken up early once we're over the budget
+#define V__SPERIOD    100
+
+int vmswapout(vmem *mem) {
+  if (NULL == mem || NULL == mem->page || -1 == mem->_swapfd) return VERROR;
+
+  vqword slot[V__SBATCH];
+  vqword swap[V__SBATCH];
+  vbyte *frame[V__SBATCH];
+  int stat = VOK;
+
+  vbyte *buf = (vbyte*)malloc(VPAGESZ * V__SBATCH);
+  if (NULL == buf) return VENOMEM;
+
+  // the frames are taken from under the thread going without the lock
+  v__mhold(mem);
+
+  while (VOK == stat && atomic_load(&mem->_resident) > mem->budget) {
+    vqword want = (atomic_load(&mem->_resident) - mem->budget + VPAGESZ - 1) /
+                  VPAGESZ;
+    if (want > V__SBATCH) want = V__SBATCH;
+    vqword n = 0;
+
+    // sweep the clock, the pages accessed since it last went by get a second
+    // chance. twice around is enough to find any frame we can write out
+    int rd = brw_rlock(&mem->_lock);
+    for (vqword i = 0; i < mem->_alloc * 2 && n < want; i++) {
+      vqword at = atomic_fetch_add(&mem->_hand, 1) % mem->_alloc;
+      vmpage *pg = &mem->page[at];
+      if (-1 == pg->ndx || !(VPOWNED & pg->flags) || NULL == pg->frame)
+        continue;
+
+      vqword bit = (vqword)1 << (at & 63);
+      if (atomic_fetch_and(v__maccess(mem, VMSSWAP, at), ~bit) & bit)
+        continue;
+
+      memcpy(buf + n * VPAGESZ, pg->frame, VPAGESZ);
+      slot[n] = at;
+      frame[n] = pg->frame;
+      n++;
+    }
+    brw_runlock(&mem->_lock, rd);
+    if (0 == n) break;
+
+    // write them out, the guest keeps running meanwhile
+    vqword written = 0;
+    for (; written < n; written++) {
+      swap[written] = v__msalloc(mem);
+#ifdef HAVE_PREAD
+      vbyte *data = buf + written * VPAGESZ;
+      vqword put = 0;
+      while (put < VPAGESZ) {
+        ssize_t r = pwrite(mem->_swapfd, data + put, VPAGESZ - put,
+                           (off_t)(swap[written] * VPAGESZ + put));
+        if (0 >= r) break;
+        put += r;
+      }
+      if (VPAGESZ == put) {
+        atomic_fetch_add(&mem->_swapout, VPAGESZ);
+        continue;
+      }
+#endif
+      v__msfree(mem, swap[written]);
+      stat = VERROR;
+      break;
+    }
+
+    // drop the frames, unless they were accessed in the meantime. the same
+    // handshake with the stack fast path as the compressor's
+    vqword dropped = 0;
+    v__mgrace(mem);
+    brw_wlock(&mem->_lock);
+    for (vqword i = 0; i < written; i++) {
+      vmpage *pg = &mem->page[slot[i]];
+      vqword bit = (vqword)1 << (slot[i] & 63);
+      if ((atomic_load(v__maccess(mem, VMSSWAP, slot[i])) & bit) ||
+          frame[i] != pg->frame || !(VPOWNED & pg->flags))
+      {
+        v__msfree(mem, swap[i]);
+        continue;
+      }
+      v__mffree(mem, pg->frame);
+      pg->frame = NULL;
+      pg->swap = swap[i];
+      pg->flags = (pg->flags & ~VPOWNED) | VPSWAP;
+      atomic_fetch_add(&mem->_swapped, VPAGESZ);
+      dropped++;
+    }
+    brw_wunlock(&mem->_lock);
+
+    // everything we found is in use, let it be for now
+    if (0 == dropped) break;
+  }
+
+  v__mrelease(mem);
+  free(buf);
+  return stat;
+}
+
+// the write-back task
+static int v__mswap(void *arg) {
+  return vmswapout((vmem*)arg);
+}
+
+int vmswap(vmem *mem, const char *path, vqword budget) {
+  if (NULL == mem || NULL == mem->page || NULL == path ||
+      -1 != mem->_swapfd)
+    return VERROR;
+
+#ifdef HAVE_PREAD
+  // nobody else needs to see it, it's gone once we're done with it
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (-1 == fd) return VERROR;
+  unlink(path);
+
+  mem->_swapfd = fd;
+  mem->budget = budget;
+  int stat = v__tstart(&mem->_writer, V__SPERIOD, v__mswap, mem);
+  if (VOK != stat) {
+    close(fd);
+    mem->_swapfd = -1;
+  }
+  return stat;
+#else
+  return VERROR;
+#endif
+}
+
+// the initial buckets of the merged frames table, a power of two
+#define V__KBUCKETS   4096
+
+// a frame that may be merged
+struct v__kcand {
+  vmem              *mem;
+  vqword            slot;
+  vqword            hash;
+  vbyte             *frame;
+};
+
+// hash the contents of a frame
+static vqword v__khash(vbyte *frame) {
+  vqword h = 0xcbf29ce484222325ull;
+  for (vqword i = 0; i < VPAGESZ; i += 8) {
+    vqword q;
+    memcpy(&q, frame + i, 8);
+    h = (h ^ q) * 0x100000001b3ull;
+  }
+  return h ^ (h >> 29);
+}
+
+static int v__kcmp(const void *a, const void *b) {
+  vqword x = ((const struct v__kcand*)a)->hash;
+  vqword y = ((const struct v__kcand*)b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+// find a merged frame with the given contents, locked by the caller
+static vmref *v__kfind(vmksm *ksm, vqword hash, vbyte *frame) {
+  vmref *ref = ksm->table[hash & (ksm->_buckets - 1)];
+  for (; NULL != ref; ref = ref->next)
+    if (hash == ref->hash && (NULL == frame ||
+        0 == memcmp(ref->frame, frame, VPAGESZ)))
+      return ref;
+  return NULL;
+}
+
+// double the buckets once the table gets crowded, locked by the caller
+static void v__kgrow(vmksm *ksm) {
+  if (ksm->_frames < ksm->_buckets * 2) return;
+
+  vqword buckets = ksm->_buckets * 2;
+  vmref **table = (vmref**)calloc(buckets, sizeof(vmref*));
+  if (NULL == table) return; // just slower
+
+  for (vqword i = 0; i < ksm->_buckets; i++) {
+    while (NULL != ksm->table[i]) {
+      vmref *ref = ksm->table[i];
+      ksm->table[i] = ref->next;
+      ref->next = table[ref->hash & (buckets - 1)];
+      table[ref->hash & (buckets - 1)] = ref;
+    }
+  }
+  free(ksm->table);
+  ksm->table = table;
+  ksm->_buckets = buckets;
+}
+
+// merge the frame of a candidate, if it's still the same
+static int v__kmerge(vmksm *ksm, struct v__kcand *c) {
+  vmem *mem = c->mem;
+
+  brw_wlock(&mem->_lock);
+  vmpage *pg = &mem->page[c->slot];
+
+  // it was dropped, or changed hands in the meantime
+  if (-1 == pg->ndx || c->frame != pg->frame || !(VPOWNED & pg->flags)) {
+    brw_wunlock(&mem->_lock);
+    return VOK;
+  }
+
+  // same as swapping the frames out for the compressor, the writable pages
+  // that were accessed since they were hashed are left alone. the scan went
+  // through the grace period already
+  if (VPWRITE & pg->flags) {
+    vqword bit = (vqword)1 << (c->slot & 63);
+    if (atomic_load(v__maccess(mem, VMSKSM, c->slot)) & bit) {
+      brw_wunlock(&mem->_lock);
+      return VOK;
+    }
+  }
+
+  mtx_lock(&ksm->_lock);
+  vmref *ref = v__kfind(ksm, c->hash, pg->frame);
+  if (NULL == ref) {
+    ref = (vmref*)malloc(sizeof(vmref));
+    vbyte *frame = (vbyte*)malloc(VPAGESZ);
+    if (NULL == ref || NULL == frame) {
+      mtx_unlock(&ksm->_lock);
+      brw_wunlock(&mem->_lock);
+      free(ref);
+      free(frame);
+      return VENOMEM;
+    }
+    memcpy(frame, pg->frame, VPAGESZ);
+    atomic_init(&ref->_refs, 0);
+    ref->hash = c->hash;
+    ref->frame = frame;
+    ref->ksm = ksm;
+    ref->next = ksm->table[c->hash & (ksm->_buckets - 1)];
+    ksm->table[c->hash & (ksm->_buckets - 1)] = ref;
+    ksm->_frames++;
+    v__kgrow(ksm);
+  }
+  atomic_fetch_add(&ref->_refs, 1);
+  ksm->_pages++;
+  mtx_unlock(&ksm->_lock);
+
+  // the merged frame is shared copy-on-write, like the frames of a clone
+  v__mffree(mem, pg->frame);
+  atomic_fetch_add(&mem->_resident, VPAGESZ);
+  atomic_fetch_add(&mem->_shared, VPAGESZ);
+  pg->frame = ref->frame;
+  pg->ref = ref;
+  pg->flags = (pg->flags & ~VPOWNED) | VPCOW | VPMERGED;
+  atomic_fetch_add(&mem->_gen, 1);
+
+  brw_wunlock(&mem->_lock);
+  return VOK;
+}
+
+int vmksminit(vmksm *ksm) {
+  if (NULL == ksm) return VERROR;
+
+  ksm->table = (vmref**)calloc(V__KBUCKETS, sizeof(vmref*));
+  if (NULL == ksm->table) return VENOMEM;
+  ksm->_buckets = V__KBUCKETS;
+  ksm->_frames = 0;
+  ksm->_pages = 0;
+  ksm->mem = NULL;
+  ksm->_mem_used = 0;
+  ksm->_mem_alloc = 0;
+
+  if (thrd_success != mtx_init(&ksm->_lock, mtx_plain)) {
+    free(ksm->table);
+    return VENOMEM;
+  }
+  if (thrd_success != mtx_init(&ksm->_scan, mtx_plain)) {
+    mtx_destroy(&ksm->_lock);
+    free(ksm->table);
+    return VENOMEM;
+  }
+  if (VOK != v__tinit(&ksm->_timer)) {
+    mtx_destroy(&ksm->_scan);
+    mtx_destroy(&ksm->_lock);
+    free(ksm->table);
+    return VENOMEM;
+  }
+
+  return VOK;
+}
+
+int vmksmdestroy(vmksm *ksm) {
+  if (NULL == ksm || NULL == ksm->table) return VERROR;
+
+  // stop scanning first, the memories may be gone after it
+  vmksmrun(ksm, 0);
+
+  // some memories still use the frames
+  if (0 != ksm->_mem_used || 0 != ksm->_frames) return VERROR;
+
+  v__tdestroy(&ksm->_timer);
+  mtx_destroy(&ksm->_scan);
+  mtx_destroy(&ksm->_lock);
+  free(ksm->table);
+  free(ksm->mem);
+  ksm->table = NULL;
+  ksm->mem = NULL;
+
+  return VOK;
+}
+
+int vmksmjoin(vmksm *ksm, vmem *mem) {
+  if (NULL == ksm || NULL == mem || NULL != mem->ksm) return VERROR;
+
+  mtx_lock(&ksm->_scan);
+  if (ksm->_mem_used >= ksm->_mem_alloc) {
+    vqword alloc = 0 == ksm->_mem_alloc ? 4 : ksm->_mem_alloc * 2;
+    vmem **list = (vmem**)realloc(ksm->mem, alloc * sizeof(vmem*));
+    if (NULL == list) {
+      mtx_unlock(&ksm->_scan);
+      return VENOMEM;
+    }
+    ksm->mem = list;
+    ksm->_mem_alloc = alloc;
+  }
+  ksm->mem[ksm->_mem_used++] = mem;
+  mem->ksm = ksm;
+  mtx_unlock(&ksm->_scan);
+
+  return VOK;
+}
+
+int vmksmleave(vmksm *ksm, vmem *mem) {
+  if (NULL == ksm || NULL == mem || ksm != mem->ksm) return VERROR;
+
+  mtx_lock(&ksm->_scan);
+  for (vqword i = 0; i < ksm->_mem_used; i++) {
+    if (mem != ksm->mem[i]) continue;
+    ksm->mem[i] = ksm->mem[--ksm->_mem_used];
+    break;
+  }
+  mem->ksm = NULL;
+  mtx_unlock(&ksm->_scan);
+
+  return VOK;
+}
+
+int vmksmscan(vmksm *ksm) {
+  if (NULL == ksm || NULL == ksm->table) return VERROR;
+
+  struct v__kcand *cand = NULL;
+  vqword used = 0;
+  vqword alloc = 0;
+  vqword held = 0;
+  int stat = VOK;
+
+  // the memories stay joined through the scan
+  mtx_lock(&ksm->_scan);
+
+  // collect the candidates, with the hash of their contents
+  for (vqword m = 0; VOK == stat && m < ksm->_mem_used; m++) {
+    vmem *mem = ksm->mem[m];
+    v__mhold(mem);           // its frames may be merged
+    held++;
+    stat = v__msample(mem, VMSKSM, &mem->_kage, &mem->_kage_alloc);
+
+    int rd = brw_rlock(&mem->_lock);
+    for (vqword i = 0; VOK == stat && i < mem->_alloc; i++) {
+      vmpage *pg = &mem->page[i];
+      if (-1 == pg->ndx || !(VPOWNED & pg->flags) || NULL == pg->frame)
+        continue;
+      if ((VPWRITE & pg->flags) && V__CAGE > mem->_kage[i]) continue;
+
+      if (used >= alloc) {
+        vqword n = 0 == alloc ? 64 : alloc * 2;
+        void *list = realloc(cand, n * sizeof(*cand));
+        if (NULL == list) {
+          stat = VENOMEM;
+          break;
+        }
+        cand = (struct v__kcand*)list;
+        alloc = n;
+      }
+      cand[used].mem = mem;
+      cand[used].slot = i;
+      cand[used].hash = v__khash(pg->frame);
+      cand[used].frame = pg->frame;
+      used++;
+    }
+    brw_runlock(&mem->_lock, rd);
+  }
+
+  // the identical frames end up next to each other
+  if (VOK == stat && 0 < used) qsort(cand, used, sizeof(*cand), v__kcmp);
+
+  // the frames of the writable pages are about to be swapped
+  for (vqword m = 0; VOK == stat && 0 < used && m < ksm->_mem_used; m++)
+    v__mgrace(ksm->mem[m]);
+
+  for (vqword i = 0; VOK == stat && i < used;) {
+    vqword end = i + 1;
+    while (end < used && cand[end].hash == cand[i].hash) end++;
+
+    // a frame on its own is only merged with one that's merged already
+    int merge = end - i > 1;
+    if (!merge) {
+      mtx_lock(&ksm->_lock);
+      merge = NULL != v__kfind(ksm, cand[i].hash, NULL);
+      mtx_unlock(&ksm->_lock);
+    }
+
+    for (; merge && VOK == stat && i < end; i++)
+      stat = v__kmerge(ksm, &cand[i]);
+    i = end;
+  }
+
+  for (vqword m = 0; m < held; m++) v__mrelease(ksm->mem[m]);
+  mtx_unlock(&ksm->_scan);
+  free(cand);
+  return stat;
+}
+
+// the dedup task
+static int v__kscan(void *arg) {
+  return vmksmscan((vmksm*)arg);
+}
+
+int vmksmrun(vmksm *ksm, vqword ms) {
+  if (NULL == ksm || NULL == ksm->table) return VERROR;
+  return v__tstart(&ksm->_timer, ms, v__kscan, ksm);
+}
+
+int vmksmstat(vmksm *ksm, struct vmksmstats *out) {
+  if (NULL == ksm || NULL == out) return VERROR;
+
+  mtx_lock(&ksm->_lock);
+  out->frames = ksm->_frames;
+  out->pages = ksm->_pages;
+  out->saved = (ksm->_pages - ksm->_frames) * VPAGESZ;
+  mtx_unlock(&ksm->_lock);
+
   return VOK;
 }
+
+// checkpoint records
+#define V__CKEND      0x0
+#define V__CKPAGE     0x1   /* a page, followed by its frame */
+#define V__CKZERO     0x2   /* a page that's not populated yet */
+#define V__CKUNMAP    0x3   /* an unmapped page */
+
+// find the slot of a page, without locking
+static vmpage *v__mfind(vmem *mem, vqword ndx) {
+  for (vqword i = 0; i < mem->_alloc; i++)
+    if (ndx == mem->page[i].ndx) return &mem->page[i];
+  return NULL;
+}
+
+int vmckpt(vmem *mem, FILE *out) {
+  if (NULL == mem || NULL == mem->page || NULL == out) return VERROR;
+
+  // 00 56 59 43, the abi version and the page size
+  vbyte hdr[6] = { 0x00, 0x56, 0x59, 0x43, VVERSION, VPAGESHIFT };
+  vbyte rec[10];
+  vbyte *buf = NULL;
+  int stat = VOK;
+
+  brw_wlock(&mem->_lock);
+
+  if (1 != fwrite(hdr, sizeof(hdr), 1, out)) stat = VERROR;
+
+  // the pages that were unmapped since the last checkpoint
+  for (vqword i = 0; VOK == stat && i < mem->_unmapped_used; i++) {
+    rec[0] = V__CKUNMAP;
+    v__uwq(rec + 1, mem->_unmapped[i]);
+    rec[9] = 0;
+    if (1 != fwrite(rec, sizeof(rec), 1, out)) stat = VERROR;
+  }
+
+  // the pages that were changed, or all of them on the first checkpoint
+  for (vqword i = 0; VOK == stat && i < mem->_alloc; i++) {
+    vmpage *pg = &mem->page[i];
+    if (-1 == pg->ndx) continue;
+    if (mem->_ckpt &&
+        !(atomic_load(&mem->_dirty[i >> 6]) & ((vqword)1 << (i & 63))))
+      continue;
+
+    // lazy, compressed and swapped out pages are written as if they're
+    // populated, without populating them
+    if (((VPLAZY | VPCOMP | VPSWAP) & pg->flags) && NULL == buf &&
+        NULL == (buf = (vbyte*)malloc(VPAGESZ)))
+    {
+      stat = VENOMEM;
+      break;
+    }
+    vbyte *data = vmpeek(mem, pg, buf);
+
+    rec[0] = NULL != data ? V__CKPAGE : V__CKZERO;
+    v__uwq(rec + 1, pg->ndx);
+    rec[9] = pg->flags & 7;
+    if (1 != fwrite(rec, sizeof(rec), 1, out) ||
+        (NULL != data && 1 != fwrite(data, VPAGESZ, 1, out)))
+      stat = VERROR;
+  }
+
+  // the end of the checkpoint
+  rec[0] = V__CKEND;
+  if (VOK == stat && 1 != fwrite(rec, 1, 1, out)) stat = VERROR;
+
+  // start tracking from here. cached frames are invalidated, so that the
+  // stores bypassing vmsetd are marked again
+  if (VOK == stat) {
+    for (vqword i = 0; i < (mem->_alloc + 63) >> 6; i++)
+      atomic_store(&mem->_dirty[i], 0);
+    mem->_unmapped_used = 0;
+    mem->_ckpt = 1;
+    atomic_fetch_add(&mem->_gen, 1);
+  }
+
+  brw_wunlock(&mem->_lock);
+  if (NULL != buf) free(buf);
+  return stat;
+}
+
+int vmrestore(vmem *mem, FILE *in) {
+  if (NULL == mem || NULL == mem->page || NULL == in) return VERROR;
+
+  vbyte hdr[6];
+  vbyte rec[10];
+  int stat = VOK;
+
+  // check the header
+  if (1 != fread(hdr, sizeof(hdr), 1, in)) return VEHDR;
+  if (memcmp(hdr, &(char[]){ 0x00, 0x56, 0x59, 0x43 }, 4) != 0)
+    return VEMAGIC;
+  if (VVERSION != hdr[4]) return VEREV;
+  if (VPAGESHIFT != hdr[5]) return VEMALF;
+
+  while (VOK == stat) {
+    if (1 != fread(rec, 1, 1, in)) return VEMALF;
+    if (V__CKEND == rec[0]) break;
+    if (1 != fread(rec + 1, sizeof(rec) - 1, 1, in)) return VEMALF;
+
+    vqword ndx = v__urq(rec + 1);
+    vbyte flags = rec[9] & 7;
+
+    if (V__CKUNMAP == rec[0]) {
+      stat = vmunmap(mem, ndx);
+      continue;
+    }
+    if (V__CKPAGE != rec[0] && V__CKZERO != rec[0]) return VEMALF;
+
+    stat = vmmap(mem, ndx, flags);
+    if (VOK != stat) break;
+
+    brw_wlock(&mem->_lock);
+    vmpage *pg = v__mfind(mem, ndx);
+    pg->flags = (pg->flags & ~(7 | VPLAZY)) | flags;
+
+    // a page that's not populated yet reads as zeroes
+    if (V__CKZERO == rec[0]) v__mfdrop(mem, pg);
+
+    // read the frame in place, external frames are not ours to write on
+    else {
+      if (!(VPOWNED & pg->flags)) v__mfdrop(mem, pg);
+      if (NULL == pg->frame) stat = v__mfault(mem, pg);
+      if (VOK == stat && 1 != fread(pg->frame, VPAGESZ, 1, in))
+        stat = VEMALF;
+    }
+
+    vmdirty(mem, pg);
+    brw_wunlock(&mem->_lock);
+  }
+
+  return stat;
+}
@@ -1,27 +1,164 @@
 #ifndef _VYT_MEM_H
 #define _VYT_MEM_H
 #include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
 #include "vyt.h"
 #include "locks.h"
+#include "epoch.h"
+
+/* the compressed contents of a cold page, shared by the clones */
+typedef struct {
+  _Atomic vqword    _refs;
+  vqword            size;
+  vbyte             data[];
+} vmblob;
+
+/* a thread running a task periodically */
+typedef struct {
+  thrd_t            _thrd;
+  vqword            _period;    /* in ms, 0 if not running */
+  int               (*_fn)(void*);
+  void              *_arg;
+  mtx_t             _lock;
+  cnd_t             _cnd;
+} vmtimer;
+
+/* a frame merged by the dedup service, shared by the identical pages */
+typedef struct _vmref_s {
+  _Atomic vqword    _refs;
+  vqword            hash;
+  vbyte             *frame;
+  struct _vmksm_s   *ksm;
+  struct _vmref_s   *next;
+} vmref;
 
 typedef struct {
   vqword            ndx;
-  vbyte             flags;
+  vword             flags;
   vbyte             *frame;
+  union {
+    vmblob          *blob; /* set instead of the frame when compressed */
+    vmref           *ref;  /* the merged frame, when VPMERGED */
+    vqword          swap;  /* the slot in the swap file, when VPSWAP */
+  };
 } vmpage;
 
+typedef struct {
+  vqword            addr;
+  vqword            size;
+  vbyte             *src;  /* NULL when zero-filled */
+} vmseg;
+
+typedef struct {
+  vbyte             *base;
+  vqword            size;
+  vqword            _next; /* bump offset of the never used frames */
+  vbyte             *_free; /* recycled frames, linked through their frames */
+  void              *_map;
+  vqword            _mapsz;
+  _Atomic vqword    _refs; /* memories and share groups using the pool */
+  mtx_t             _lock;
+} vmpool;
+
+/* frames shared copy-on-write by a memory and its clones, freed once the last
+ * memory holding the group is destroyed */
+typedef struct {
+  _Atomic vqword    _refs;
+  vmpool            *pool; /* where the frames came from, NULL if none */
+  vqword            nframes;
+  vbyte             *frames[];
+} vmshare;
+
 typedef struct _cache_entry_s {
-  int               ndx;
+  vqword            ndx;
   uintptr_t         offst; /* vmem->page + ent->offst */
   struct _cache_entry_s *prev;
   struct _cache_entry_s *next;
 } _vmem_cache;
 
-typedef struct {
+typedef struct _vmem_s {
   vmpage            *page;
   vqword            _used;
   vqword            _alloc;
-  rw_t              _lock;
+  brw_t             _lock;
+
+  /* lazily populated ranges */
+  vmseg             *seg;
+  vqword            _seg_used;
+  vqword            _seg_alloc;
+  mtx_t             _fault_lock;
+
+  /* frame pool, NULL when there's none */
+  vmpool            *pool;
+  vbyte             hugepg;
+
+  /* share groups of the copy-on-write frames */
+  vmshare           **share;
+  vqword            _share_used;
+  vqword            _share_alloc;
+
+  /* accounting, in bytes */
+  _Atomic vqword    _resident; /* frames in use */
+  _Atomic vqword    _owned;    /* frames allocated by the memory itself */
+  _Atomic vqword    _shared;   /* frames shared copy-on-write */
+  vqword            limit;     /* max resident bytes, 0 for no limit */
+
+  /* bumped whenever a frame is dropped, to invalidate cached frame ptrs */
+  _Atomic vqword    _gen;
+
+  /* the epochs of the guest threads, NULL if there are none. the old tables
+   * are freed through it, and frames are only taken from under the stack fast
+   * path after a grace period */
+  vepoch            *epoch;
+
+  /* the record of the single thread accessing the memory, NULL when there
+   * may be more of them. see vmsolo */
+  _Atomic(verec*)   _solo;
+
+  /* the record given to vmsolo, and the sweeps that hold it off while they
+   * take frames from under it. it's back in _solo once they're done */
+  mtx_t             _solo_lock;
+  verec             *_solo_rec;
+  vqword            _solo_held;
+
+  /* cold page compression. a bit for each page slot, set when accessed, for
+   * each of the samplers (see VMSAMPLERS) */
+  _Atomic vqword    *_access;
+  vbyte             *_age;      /* samples since the last access */
+  vqword            _age_alloc;
+  void              **_retired; /* old tables, when there are no epochs */
+  vqword            _retired_used;
+  vqword            _retired_alloc;
+  _Atomic vqword    _comp;      /* bytes of the pages held compressed */
+  _Atomic vqword    _store;     /* bytes they take compressed */
+  _Atomic vqword    _cfaults;   /* decompressions */
+  struct _vmksm_s   *ksm;       /* the dedup service joined, if any */
+  vbyte             *_kage;     /* its samples since the last access */
+  vqword            _kage_alloc;
+  vmtimer           _cold;      /* the compressor */
+
+  /* swapping, the frames over the budget are written out to the swap file */
+  int               _swapfd;    /* -1 when not swapping */
+  vqword            budget;     /* resident bytes to keep within */
+  vqword            *_sfree;    /* slots of the swap file free for reuse */
+  vqword            _sfree_used;
+  vqword            _sfree_alloc;
+  vqword            _snext;     /* slots used so far */
+  _Atomic vqword    _hand;      /* where the clock sweep goes on */
+  mtx_t             _swap_lock; /* the slots */
+  _Atomic vqword    _swapped;   /* bytes of the pages swapped out */
+  _Atomic vqword    _sfaults;   /* swap-ins */
+  _Atomic vqword    _swapin;    /* bytes read from the swap file */
+  _Atomic vqword    _swapout;   /* bytes written to it */
+  vmtimer           _writer;    /* the write-back thread */
+
+  /* pages changed since the last checkpoint, a bit for each page slot */
+  _Atomic vqword    *_dirty;
+  vqword            *_unmapped; /* pages unmapped since the last checkpoint */
+  vqword            _unmapped_used;
+  vqword            _unmapped_alloc;
+  vbyte             _ckpt;      /* set once the first checkpoint is written */
 
   /* used in caching */
   _vmem_cache       *cache_pool;
@@ -32,15 +169,86 @@ typedef struct {
   fmtx_t            _cache_lock;
 } vmem;
 
+/* the dedup service, merges the identical frames of the memories joined */
+typedef struct _vmksm_s {
+  vmref             **table;    /* merged frames, by their hash */
+  vqword            _buckets;
+  vqword            _frames;
+  vqword            _pages;
+  mtx_t             _lock;      /* the table */
+
+  /* memories joined */
+  vmem              **mem;
+  vqword            _mem_used;
+  vqword            _mem_alloc;
+  mtx_t             _scan;      /* held through a scan, and by join/leave */
+
+  vmtimer           _timer;     /* background scanning */
+} vmksm;
+
+/* dedup service usage */
+struct vmksmstats {
+  vqword            frames;     /* merged frames */
+  vqword            pages;      /* pages sharing them */
+  vqword            saved;      /* bytes saved */
+};
+
+/* memory usage, in bytes */
+struct vmstats {
+  vqword            mapped;
+  vqword            resident;
+  vqword            owned;
+  vqword            shared;
+  vqword            limit;
+  vqword            compressed; /* the size of the compressed pages */
+  vqword            store;      /* the bytes they take */
+  vqword            cfaults;    /* decompressions */
+  vqword            budget;     /* the swap budget, 0 when not swapping */
+  vqword            swapped;    /* the size of the pages swapped out */
+  vqword            sfaults;    /* swap-ins */
+  vqword            swapin;     /* bytes read from the swap file */
+  vqword            swapout;    /* bytes written to it */
+};
+
+/* the page size, chosen at build time with -DVPAGESHIFT=n. supported sizes
+ * are 4 KiB (12), 16 KiB (14), 64 KiB (16) and 2 MiB (21). small pages waste
+ * less memory on sparse guests, big ones need fewer translations */
+#ifndef VPAGESHIFT
+#define VPAGESHIFT  14
+#endif
+#if VPAGESHIFT != 12 && VPAGESHIFT != 14 && VPAGESHIFT != 16 && \
+    VPAGESHIFT != 21
+#error "VPAGESHIFT must be 12 (4 KiB), 14 (16 KiB), 16 (64 KiB) or 21 (2 MiB)"
+#endif
+
 /* some constants */
-#define VPAGESZ     16384
-#define VPAGEMX     0x3ffffffffffff
+#define VPAGESZ     ((vqword)1 << VPAGESHIFT)
+#define VPAGEMASK   (VPAGESZ - 1)
+#define VPAGEMX     (~(vqword)0 >> VPAGESHIFT)
 
 /* page flags */
 #define VPREAD      (1)
 #define VPWRITE     (1<<1)
 #define VPEXEC      (1<<2)
 #define VPOWNED     (1<<3)
+#define VPLAZY      (1<<4)  /* populated from the ranges on first access */
+#define VPCOW       (1<<5)  /* frame is shared, copied on the first write */
+#define VPCOMP      (1<<6)  /* compressed, expanded on the next access */
+#define VPMERGED    (1<<7)  /* frame merged by the dedup service */
+#define VPSWAP      (1<<8)  /* written out to the swap file */
+
+/* huge page backing */
+#define VHUGESZ     (2 * 1024 * 1024)
+#define VHNONE      0     /* regular host pages */
+#define VHTHP       1     /* transparent huge pages (madvise) */
+#define VHTLB       2     /* reserved huge pages (hugetlbfs) */
+
+/* the services sampling the page accesses, each clears access bits of its
+ * own. a word of each, covering 64 page slots, sits side by side */
+#define VMSCOLD     0     /* the compressor */
+#define VMSSWAP     1     /* the clock of the swap writer */
+#define VMSKSM      2     /* the dedup scan */
+#define VMSAMPLERS  3
 
 /**
  * initialize memory page table and the cache by 'cachesz' entries. set
@@ -48,6 +256,21 @@ typedef struct {
  */
 int vminit(vmem *mem, vword cachesz);
 
+/**
+ * back the frames with a contiguous pool of 'sz' bytes on VHUGESZ host pages.
+ * 'mem->hugepg' tells whether huge pages were actually obtained, frames come
+ * from regular host pages when they weren't, or when the pool runs out
+ */
+int vmhuge(vmem *mem, vqword sz);
+
+/**
+ * make 'dst', a freshly initialized memory, a clone of 'src'. the frames are
+ * not copied, both memories share them copy-on-write, along with the frame
+ * pool and the lazy ranges of 'src'. the guest threads of 'src' should be
+ * stopped while cloning
+ */
+int vmclone(vmem *dst, vmem *src);
+
 /**
  * destroy memory page table
  */
@@ -58,11 +281,53 @@ int vmdestroy(vmem *mem);
  */
 int vmmap(vmem *mem, vqword ndx, vbyte flags);
 
+/**
+ * map memory at given index, backed by an external frame of VPAGESZ bytes.
+ * the frame is not owned by the memory (it is never freed by vmunmap or
+ * vmdestroy), so it must stay valid as long as the page is mapped
+ */
+int vmmapf(vmem *mem, vqword ndx, vbyte flags, vbyte *frame);
+
 /**
  * un-map memory at given index
  */
 int vmunmap(vmem *mem, vqword ndx);
 
+/**
+ * record 'sz' bytes at 'addr' to be populated from 'src' (or zero-filled when
+ * 'src' is NULL) the first time their pages are accessed. the pages must be
+ * mapped already, and 'src' must stay valid until the memory is destroyed
+ */
+int vmlazy(vmem *mem, vqword addr, vbyte *src, vqword sz);
+
+/**
+ * get the contents of a page without populating it. returns its frame, or
+ * 'buf' (of VPAGESZ bytes) filled from the lazy ranges of the page or from
+ * its compressed contents. returns NULL if the page is not populated and
+ * reads as zeroes
+ */
+vbyte *vmpeek(vmem *mem, vmpage *pg, vbyte *buf);
+
+/**
+ * get the memory usage. frames that can't fit within 'mem->limit' are not
+ * allocated, their accesses fail with VENOMEM instead
+ */
+int vmstat(vmem *mem, struct vmstats *out);
+
+/**
+ * let the thread 'rec' access the memory without the page table read lock,
+ * while it's online in 'mem->epoch'. it should be the only thread accessing
+ * it, the background services hold this off while they sweep the memory
+ */
+int vmsolo(vmem *mem, verec *rec);
+
+/**
+ * end vmsolo for good, once the thread is past the accesses it started
+ * without the lock. 'self' is the caller's own record if it takes part in the
+ * epochs
+ */
+int vmunsolo(vmem *mem, verec *self);
+
 /**
  * find page from memory, at given the index
  */
@@ -78,9 +343,126 @@ int vmgetd(vmem *mem, vbyte *out, vqword addr, vqword sz, vbyte perm);
  */
 int vmsetd(vmem *mem, vbyte *in, vqword addr, vqword sz, vbyte perm);
 
+/* atomic operations, see vmatomic */
+#define VMAXCHG     0     /* exchange */
+#define VMAADD      1     /* fetch and add */
+#define VMACAS      2     /* compare and swap */
+
+/**
+ * do the atomic operation 'op' on the 'sz' bytes (1, 2, 4 or 8) at 'addr',
+ * which must be naturally aligned. it's done with the host atomics on the
+ * frame, sequentially consistent. 'val' is the operand, it's set to the value
+ * found in memory. VMACAS only stores 'val' if 'cmp' was found
+ */
+int vmatomic(vmem *mem, vqword addr, vqword sz, int op, vqword *val,
+             vqword cmp);
+
 /**
  * fill 'sz' bytes of memory at 'addr' with a constant byte 'c'
  */
 int vmfilld(vmem *mem, vqword addr, vqword sz, vbyte c);
 
+/**
+ * sample the access bits, and compress the pages that weren't accessed in the
+ * last two samples. the pages are expanded again the next time they are
+ * accessed. this is what the compressor thread runs every period
+ */
+int vmcold(vmem *mem);
+
+/**
+ * start a thread that runs vmcold every 'ms' milliseconds, or stop it when
+ * 'ms' is 0. it is stopped by vmdestroy too
+ */
+int vmcompress(vmem *mem, vqword ms);
+
+/**
+ * swap the frames out to a file at 'path' (created, or truncated, and removed
+ * right away), keeping the resident frames within 'budget' bytes. a thread
+ * writes the least recently used frames back in the background, and the
+ * pages are read back in the next time they are accessed. unlike
+ * 'mem->limit', the budget may be overrun until the thread catches up
+ */
+int vmswap(vmem *mem, const char *path, vqword budget);
+
+/**
+ * write the least recently used frames out to the swap file until the
+ * resident frames fit within the budget. this is what the write-back thread
+ * runs
+ */
+int vmswapout(vmem *mem);
+
+/**
+ * initialize a dedup service. it should be destroyed after every memory that
+ * has joined it, as their merged frames belong to it
+ */
+int vmksminit(vmksm *ksm);
+
+/**
+ * destroy a dedup service
+ */
+int vmksmdestroy(vmksm *ksm);
+
+/**
+ * let the service merge the frames of a memory. a memory joins one service at
+ * most, and leaves it when it's destroyed
+ */
+int vmksmjoin(vmksm *ksm, vmem *mem);
+
+/**
+ * stop merging the frames of a memory. the frames merged so far stay shared
+ */
+int vmksmleave(vmksm *ksm, vmem *mem);
+
+/**
+ * merge the identical frames of the memories joined. the frames of the pages
+ * that are not writable are candidates, along with the ones of writable pages
+ * that went unaccessed for two samples. merged frames are shared copy-on-write
+ */
+int vmksmscan(vmksm *ksm);
+
+/**
+ * start a thread that runs vmksmscan every 'ms' milliseconds, or stop it when
+ * 'ms' is 0. it is stopped by vmksmdestroy too
+ */
+int vmksmrun(vmksm *ksm, vqword ms);
+
+/**
+ * get the usage of a dedup service
+ */
+int vmksmstat(vmksm *ksm, struct vmksmstats *out);
+
+/**
+ * write a checkpoint of the memory onto 'out'. the first one has all the
+ * mapped pages, the ones after it only have the pages that were changed,
+ * mapped or unmapped since the previous checkpoint. the guest threads should
+ * be stopped while writing it
+ */
+int vmckpt(vmem *mem, FILE *out);
+
+/**
+ * apply a checkpoint read from 'in'. to rebuild a memory, apply the
+ * checkpoints in the order they were written
+ */
+int vmrestore(vmem *mem, FILE *in);
+
+/* mark the page as changed since the last checkpoint */
+static inline void vmdirty(vmem *mem, vmpage *pg) {
+  vqword slot = pg - mem->page;
+  vqword bit = (vqword)1 << (slot & 63);
+  _Atomic vqword *word = &mem->_dirty[slot >> 6];
+
+  // avoid writing to the shared word if it's already marked
+  if (!(atomic_load_explicit(word, memory_order_relaxed) & bit))
+    atomic_fetch_or(word, bit);
+}
+
+/* mark the page at 'slot' as accessed, for each of the samplers */
+static inline void vmtouch(vmem *mem, vqword slot) {
+  vqword bit = (vqword)1 << (slot & 63);
+  _Atomic vqword *word = &mem->_access[(slot >> 6) * VMSAMPLERS];
+  for (int i = 0; i < VMSAMPLERS; i++)
+    if (!(atomic_load(&word[i]) & bit))
+      atomic_fetch_or(&word[i], bit);
+}
+
 #endif // _VYT_MEM_H
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "snap.h"
+#include "mem.h"
+#include "utils.h"
+
+// NOTE:
+// - see the "snapshot format:" and "snapshot header:" blocks of the spec
+// - the size of the header, including the registers, and of a page entry
+#define V__SNHDRSZ    (22 + 8 * 16)
+#define V__SNENTSZ    17
+
+int vsnap(vproc *proc, vthrd *thr, FILE *out) {
+  if (NULL == proc || NULL == thr || NULL == out) return VERROR;
+
+  vmem *mem = &proc->mem;
+  vbyte hdr[V__SNHDRSZ];
+  vbyte ent[V__SNENTSZ];
+  int stat = VOK;
+
+  // count the pages
+  vqword npages = 0;
+  for (vqword i = 0; i < mem->_alloc; i++)
+    if (-1 != mem->page[i].ndx) npages++;
+
+  // the frames start at the first page boundary after the page table
+  vqword foffst = V__SNHDRSZ + npages * V__SNENTSZ;
+  foffst = (foffst + VPAGEMASK) & ~VPAGEMASK;
+
+  // the header, 00 56 59 53
+  memcpy(hdr, &(char[]){ 0x00, 0x56, 0x59, 0x53 }, 4);
+  v__uwb(hdr + 4, VVERSION);
+  v__uwb(hdr + 5, VPAGESHIFT);
+  v__uwq(hdr + 6, npages);
+  v__uwq(hdr + 14, foffst);
+  for (int i = 0; i < 16; i++)
+    v__uwq(hdr + 22 + i * 8, thr->reg[i]);
+
+  // the restored thread is told that it's restored
+  v__uwq(hdr + 22 + R8 * 8, 1);
+
+  if (1 != fwrite(hdr, sizeof(hdr), 1, out)) return VERROR;
+
+  // the page table
+  vqword off = foffst;
+  for (vqword i = 0; i < mem->_alloc; i++) {
+    vmpage *pg = &mem->page[i];
+    if (-1 == pg->ndx) continue;
+    int has = NULL != pg->frame || ((VPLAZY | VPCOMP | VPSWAP) & pg->flags);
+    v__uwq(ent, pg->ndx);
+    v__uwb(ent + 8, pg->flags & 7);
+    v__uwq(ent + 9, has ? off : 0);
+    if (has) off += VPAGESZ;
+    if (1 != fwrite(ent, sizeof(ent), 1, out)) return VERROR;
+  }
+
+  // pad up to the frames
+  for (vqword pos = V__SNHDRSZ + npages * V__SNENTSZ; pos < foffst; pos++)
+    if (EOF == fputc(0, out)) return VERROR;
+
+  // and the frames, in the same order as the page table
+  vbyte *buf = (vbyte*)malloc(VPAGESZ);
+  if (NULL == buf) return VENOMEM;
+  for (vqword i = 0; VOK == stat && i < mem->_alloc; i++) {
+    vmpage *pg = &mem->page[i];
+    if (-1 == pg->ndx) continue;
+    vbyte *data = vmpeek(mem, pg, buf);
+    if (NULL != data && 1 != fwrite(data, VPAGESZ, 1, out)) stat = VERROR;
+  }
+  free(buf);
+
+  return stat;
+}
+
+int vsnapload(vproc *proc, vbyte *image, vqword sz) {
+  if (NULL == proc || NULL == image || VSINIT != atomic_load(&proc->state))
+    return VERROR;
+
+  // image too short to fit the header
+  if (V__SNHDRSZ > sz) return VEHDR;
+
+  // check the header
+  if (memcmp(image, &(char[]){ 0x00, 0x56, 0x59, 0x53 }, 4) != 0)
+    return VEMAGIC;
+  if (v__urb(image + 4) != VVERSION) return VEREV;
+  if (v__urb(image + 5) != VPAGESHIFT) return VEMALF;
+
+  vqword npages = v__urq(image + 6);
+  vqword foffst = v__urq(image + 14);
+  if (npages > (sz - V__SNHDRSZ) / V__SNENTSZ) return VEMALF;
+
+  // the registers of the snapshot thread
+  vthrd *thr = v__thrd(proc, 0);
+  for (int i = 0; i < 16; i++)
+    thr->reg[i] = v__urq(image + 22 + i * 8);
+  thr->flags = VTRESUME;
+
+  // map the pages, their frames are in the image itself
+  vbyte *ent = image + V__SNHDRSZ;
+  for (vqword i = 0; i < npages; i++, ent += V__SNENTSZ) {
+    vqword ndx = v__urq(ent);
+    vbyte flags = v__urb(ent + 8) & 7;
+    vqword off = v__urq(ent + 9);
+    int stat = VOK;
+
+    // not populated yet
+    if (0 == off) {
+      stat = vmmap(&proc->mem, ndx, flags);
+    } else {
+      if (off < foffst || off > sz || sz - off < VPAGESZ) return VEMALF;
+      stat = vmmapf(&proc->mem, ndx, flags, image + off);
+    }
+    if (VOK != stat) return stat;
+  }
+
+  atomic_store(&proc->state, VSLOAD);
+  return VOK;
+}
@@ -0,0 +1,23 @@
+#ifndef _VYT_SNAP_H
+#define _VYT_SNAP_H
+#include <stdio.h>
+#include "vyt.h"
+#include "exec.h"
+
+/**
+ * write a snapshot of the process onto 'out': its pages, their frames and
+ * the registers of 'thr', the only thread that should be running. the frames
+ * are aligned to VPAGESZ within the file, so the snapshot can be mapped
+ * straight into memory when restored
+ */
+int vsnap(vproc *proc, vthrd *thr, FILE *out);
+
+/**
+ * restore a snapshot into an initialized process context, in place of vload.
+ * the pages are backed by 'image' itself (like vloadmap), so it must stay
+ * valid until the process is destroyed. vrun resumes the snapshot thread
+ * right after the syscall that took it, with r8 set to 1
+ */
+int vsnapload(vproc *proc, vbyte *image, vqword sz);
+
+#endif // _VYT_SNAP_H
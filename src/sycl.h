@@ -1,8 +1,10 @@
 #ifndef _VYT_SYCL_H
 #define _VYT_SYCL_H
+#include <stdio.h>
 #include <stdatomic.h>
 #include "vyt.h"
 #include "exec.h"
+#include "snap.h"
 
 static inline int VSYCL_exit(vproc *proc, vthrd *thr) {
   // stop the current thread's execution
@@ -16,4 +18,144 @@ static inline int VSYCL_exit(vproc *proc, vthrd *thr) {
   return VOK;
 }
 
+static inline int VSYCL_snap(vproc *proc, vthrd *thr) {
+  thr->reg[R8] = 0;
+  thr->reg[R9] = VOK;
+
+  // no snapshot was asked for
+  if (NULL == proc->opts || NULL == proc->opts->snapfile) return VOK;
+
+  // only a lone thread can be snapshot. the guest is told in r9, it keeps
+  // running without one
+  amtx_lock(&proc->_thrd_lock);
+  vdword used = proc->_thrd_used;
+  amtx_unlock(&proc->_thrd_lock);
+  if (1 != used) {
+    thr->reg[R9] = (vqword)VETHRD;
+    return VOK;
+  }
+
+  FILE *out = fopen(proc->opts->snapfile, "wb");
+  if (NULL == out) {
+    thr->reg[R9] = (vqword)VERROR;
+    return VOK;
+  }
+  thr->reg[R9] = (vqword)vsnap(proc, thr, out);
+  if (0 != fclose(out) && VOK == thr->reg[R9])
+    thr->reg[R9] = (vqword)VERROR;
+
+  return VOK;
+}
+
+static inline int VSYCL_tmake(vproc *proc, vthrd *thr) {
+  int tid = 0;
+  int stat = vstart(proc, &tid, thr->reg[R1], thr->reg[R2]);
+
+  thr->reg[R8] = VOK == stat ? (vqword)tid : 0;
+  thr->reg[R9] = (vqword)stat;
+  return VOK;
+}
+
+static inline int VSYCL_tjoin(vproc *proc, vthrd *thr) {
+  vdword tid = (vdword)thr->reg[R1];
+  thr->reg[R8] = 0;
+  thr->reg[R9] = VOK;
+
+  // the daemons can't be joined, and a thread can't join itself
+  amtx_lock(&proc->_thrd_lock);
+  vthrd *other = v__thrd(proc, tid);
+  vqword runs = NULL == other ? 0 : other->_runs;
+  int bad = NULL == other || thr == other || other->_daemon;
+  amtx_unlock(&proc->_thrd_lock);
+  if (bad) {
+    thr->reg[R9] = (vqword)VETHRD;
+    return VOK;
+  }
+
+  // sleep until it's gone, its ctx may be running another thread by then. a
+  // task is parked instead
+  mtx_lock(&proc->_exit_lock);
+  while (VSACTIVE == atomic_load(&proc->state) && !atomic_load(&thr->_kill)) {
+    amtx_lock(&proc->_thrd_lock);
+    int gone = other != v__thrd(proc, tid) || runs != other->_runs;
+    amtx_unlock(&proc->_thrd_lock);
+    if (gone || v__tpark(proc, thr)) break;
+    cnd_wait(&proc->_exit, &proc->_exit_lock);
+  }
+  mtx_unlock(&proc->_exit_lock);
+
+  return VOK;
+}
+
+static inline int VSYCL_tdaem(vproc *proc, vthrd *thr) {
+  vdword tid = (vdword)thr->reg[R1];
+  thr->reg[R8] = 0;
+  thr->reg[R9] = VOK;
+
+  // once only the daemons are left, the process is done
+  amtx_lock(&proc->_thrd_lock);
+  vthrd *other = v__thrd(proc, tid);
+  if (NULL == other) {
+    thr->reg[R9] = (vqword)VETHRD;
+  }
+  else if (!other->_daemon) {
+    other->_daemon = 1;
+    proc->_thrd_daemons++;
+    if (proc->_thrd_daemons == proc->_thrd_used)
+      atomic_store(&proc->state, VSDONE);
+  }
+  amtx_unlock(&proc->_thrd_lock);
+
+  // the ones joining it give up
+  v__pwake(proc);
+  return VOK;
+}
+
+static inline int VSYCL_tkill(vproc *proc, vthrd *thr) {
+  vdword tid = (vdword)thr->reg[R1];
+  thr->reg[R8] = 0;
+  thr->reg[R9] = VOK;
+
+  amtx_lock(&proc->_thrd_lock);
+  vthrd *other = v__thrd(proc, tid);
+  if (NULL == other) thr->reg[R9] = (vqword)VETHRD;
+  else atomic_store(&other->_kill, 1);
+  amtx_unlock(&proc->_thrd_lock);
+
+  // it may be sleeping in tjoin, or on a futex
+  v__pwake(proc);
+  v__fcancel(proc);
+  return VOK;
+}
+
+static inline int VSYCL_tyld(vproc *proc, vthrd *thr) {
+  (void)proc;
+  thr->reg[R8] = 0;
+  thr->reg[R9] = VOK;
+
+  // it's given up once the instruction's done
+  thr->_sw = V__SWYIELD;
+  return VOK;
+}
+
+static inline int VSYCL_tself(vproc *proc, vthrd *thr) {
+  (void)proc;
+  thr->reg[R8] = thr->tid;
+  thr->reg[R9] = VOK;
+  return VOK;
+}
+
+static inline int VSYCL_fwait(vproc *proc, vthrd *thr) {
+  // the timeout is in microseconds, 0 for none
+  thr->reg[R9] = (vqword)v__fwait(proc, thr, thr->reg[R1],
+                                  (vdword)thr->reg[R2], thr->reg[R3] * 1000);
+  return VOK;
+}
+
+static inline int VSYCL_fwake(vproc *proc, vthrd *thr) {
+  thr->reg[R8] = v__fwake(proc, thr->reg[R1], thr->reg[R2]);
+  thr->reg[R9] = VOK;
+  return VOK;
+}
+
 #endif // _VYT_SYCL_H
@@ -12,6 +12,7 @@ int vperr(int ret) {
     case VENOMEM: msg = "out of memory"; break;
     case VESEGV:  msg = "segmentation fault"; break;
     case VEACCES: msg = "permission denied"; break;
+    case VEALIGN: msg = "misaligned access"; break;
     case VEHDR:   msg = "failed to read header"; break;
     case VEMAGIC: msg = "unsupported format"; break;
     case VEREV:   msg = "version mismatch"; break;
@@ -16,6 +16,7 @@ typedef uint64_t vqword;
 #define VENOMEM     (-3)
 #define VESEGV      (-4)
 #define VEACCES     (-5)
+#define VEALIGN     (-6)
 #define VEHDR       (-10)
 #define VEMAGIC     (-11)
 #define VEREV       (-12)
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include "__test.h"
 
 // some variables
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "__test.h"
+#include "../src/vyt.h"
+#include "../src/locks.h"
+
+#include <time.h>
+
+// acquire and release rounds, the contended ones are split among the threads
+#define ROUNDS    (1 << 20)
+#define CROUNDS   (1 << 15)
+#define MAXTHRDS  64
+
+// the locks under test, behind the same interface
+typedef struct {
+  const char *name;
+  void (*lock)(void*);
+  void (*unlock)(void*);
+} lockops;
+
+static void fmtx_lock_(void *l)   { fmtx_lock((fmtx_t*)l); }
+static void fmtx_unlock_(void *l) { fmtx_unlock((fmtx_t*)l); }
+static void tmtx_lock_(void *l)   { tmtx_lock((tmtx_t*)l); }
+static void tmtx_unlock_(void *l) { tmtx_unlock((tmtx_t*)l); }
+static void amtx_lock_(void *l)   { amtx_lock((amtx_t*)l); }
+static void amtx_unlock_(void *l) { amtx_unlock((amtx_t*)l); }
+static void mtx_lock_(void *l)    { mtx_lock((mtx_t*)l); }
+static void mtx_unlock_(void *l)  { mtx_unlock((mtx_t*)l); }
+
+static lockops ops[] = {
+  { "fmtx",  fmtx_lock_, fmtx_unlock_ },
+  { "tmtx",  tmtx_lock_, tmtx_unlock_ },
+  { "amtx",  amtx_lock_, amtx_unlock_ },
+  { "mtx_t", mtx_lock_,  mtx_unlock_  },
+};
+
+// any of them, initialized for the lock at 'i'
+typedef union {
+  fmtx_t f;
+  tmtx_t t;
+  amtx_t a;
+  mtx_t  m;
+} anylock;
+
+static void init_lock(anylock *l, int i) {
+  memset(l, 0, sizeof(*l));
+  switch (i) {
+    case 0: fmtx_init(&l->f); break;
+    case 1: tmtx_init(&l->t); break;
+    case 2: amtx_init(&l->a); break;
+    case 3: mtx_init(&l->m, mtx_plain); break;
+  }
+}
+
+static void destroy_lock(anylock *l, int i) {
+  if (3 == i) mtx_destroy(&l->m);
+}
+
+// what the threads share
+typedef struct {
+  lockops *ops;
+  anylock lock;
+  int rounds;
+  _Atomic int ready;
+  _Atomic int go;
+  vqword counter;
+} bench;
+
+// returns the nanoseconds elapsed since 'start'
+static uint64_t elapsed_since(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1000000000ull +
+         (end.tv_nsec - start->tv_nsec);
+}
+
+static int worker(void *arg) {
+  bench *b = (bench*)arg;
+
+  // start together
+  atomic_fetch_add(&b->ready, 1);
+  while (!atomic_load(&b->go))
+    thrd_yield();
+
+  for (int i = 0; i < b->rounds; i++) {
+    b->ops->lock(&b->lock);
+    b->counter++;
+    b->ops->unlock(&b->lock);
+  }
+  return 0;
+}
+
+// uncontended: a single thread takes and releases the lock
+TEST(uncontended) {
+  for (int i = 0; i < (int)(sizeof(ops) / sizeof(*ops)); i++) {
+    anylock l;
+    struct timespec start;
+    init_lock(&l, i);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < ROUNDS; r++) {
+      ops[i].lock(&l);
+      ops[i].unlock(&l);
+    }
+    uint64_t ns = elapsed_since(&start);
+    destroy_lock(&l, i);
+
+    printf("%-6s    %6.1f ns/acquire\n", ops[i].name, (double)ns / ROUNDS);
+  }
+  return 1;
+}
+
+// contended: the threads fight over the lock, around a tiny critical section
+TEST(contended) {
+  thrd_t thrd[MAXTHRDS];
+
+  printf("lock      threads  ns/acquire\n");
+  for (int i = 0; i < (int)(sizeof(ops) / sizeof(*ops)); i++) {
+    for (int n = 1; n <= MAXTHRDS; n *= 2) {
+      bench b;
+      struct timespec start;
+      int spawned = 0;
+
+      b.ops = &ops[i];
+      b.rounds = CROUNDS / n;
+      b.counter = 0;
+      atomic_init(&b.ready, 0);
+      atomic_init(&b.go, 0);
+      init_lock(&b.lock, i);
+
+      for (; spawned < n; spawned++)
+        if (thrd_success != thrd_create(&thrd[spawned], worker, &b)) break;
+      while (atomic_load(&b.ready) < spawned)
+        thrd_yield();
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      atomic_store(&b.go, 1);
+      for (int t = 0; t < spawned; t++)
+        thrd_join(thrd[t], NULL);
+      uint64_t ns = elapsed_since(&start);
+      destroy_lock(&b.lock, i);
+
+      // a lock that lets two threads in loses some increments
+      if (!TEST_ASSERT(spawned == n, "failed to spawn the threads") ||
+          !TEST_EXPECT_EQ(b.counter, (vqword)b.rounds * n))
+        return 0;
+
+      printf("%-6s    %7d  %10.1f\n", ops[i].name, n,
+             (double)ns / ((vqword)b.rounds * n));
+    }
+  }
+  return 1;
+}
+
+int test(const char *suite_name) {
+  TEST_RUN(uncontended);
+  TEST_RUN(contended);
+
+  // exit code
+  return 0;
+}
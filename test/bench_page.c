@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "__test.h"
+#include "../src/vyt.h"
+#include "../src/mem.h"
+
+#include <time.h>
+#include <threads.h>
+
+// the size of the region that we're going to stream through and randomly
+// access, and the address space that the sparse guest spreads over
+#define REGIONSZ  ((vqword)16 << 20)
+#define SPARSESZ  ((vqword)1 << 30)
+#define SPARSEN   512
+
+// the reads split among the threads of the threaded run, and the most threads
+#define THRDREADS (1 << 20)
+#define MAXTHRDS  8
+
+// returns the nanoseconds elapsed since 'start'
+static uint64_t elapsed_since(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1000000000ull +
+         (end.tv_nsec - start->tv_nsec);
+}
+
+// returns the bytes taken by the frames of the memory
+static vqword resident_bytes(vmem *mem) {
+  vqword n = 0;
+  for (vqword i = 0; i < mem->_alloc; i++)
+    if (-1 != mem->page[i].ndx && NULL != mem->page[i].frame) n++;
+  return n * VPAGESZ;
+}
+
+// maps every page in [addr, addr + sz)
+static int map_range(vmem *mem, vqword addr, vqword sz) {
+  for (vqword pg = addr >> VPAGESHIFT; pg <= (addr + sz - 1) >> VPAGESHIFT;
+       pg++)
+  {
+    int stat = vmmap(mem, pg, VPREAD | VPWRITE);
+    if (VOK != stat) return stat;
+  }
+  return VOK;
+}
+
+// translation overhead: stream through a region, then access it randomly
+TEST(translation) {
+  int stat = VOK;
+  vmem mem;
+
+  stat = vminit(&mem, 24);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+
+  // the region starts at the second page, 0x0 is not accessible
+  stat = map_range(&mem, VPAGESZ, REGIONSZ);
+  if (VOK == stat) stat = vmfilld(&mem, VPAGESZ, REGIONSZ, 0x5a);
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the region")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  struct timespec start;
+  vbyte buf[8];
+  int count = REGIONSZ / 8;
+
+  // sequential qword reads
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < count && VOK == stat; i++)
+    stat = vmgetd(&mem, buf, VPAGESZ + (vqword)i * 8, 8, VPREAD);
+  uint64_t seq = elapsed_since(&start);
+
+  // random qword reads
+  srand(1);
+  count /= 16;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < count && VOK == stat; i++) {
+    vqword off = ((vqword)rand() * 8) % REGIONSZ;
+    stat = vmgetd(&mem, buf, VPAGESZ + off, 8, VPREAD);
+  }
+  uint64_t rnd = elapsed_since(&start);
+
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_EXPECT_EQ(buf[0], 0x5a))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  printf("page:     %llu bytes\n", (unsigned long long)VPAGESZ);
+  printf("pages:    %llu\n", (unsigned long long)mem._used);
+  printf("seq:      %llu ns/access\n",
+         (unsigned long long)(seq / (REGIONSZ / 8)));
+  printf("random:   %llu ns/access\n", (unsigned long long)(rnd / count));
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+// memory waste: touch a single byte at scattered places
+TEST(sparse_waste) {
+  int stat = VOK;
+  vmem mem;
+
+  stat = vminit(&mem, 24);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+
+  srand(2);
+  for (int i = 0; i < SPARSEN && VOK == stat; i++) {
+    vqword addr = 1 + ((vqword)rand() * 4096) % (SPARSESZ - 1);
+    vbyte c = i;
+    stat = map_range(&mem, addr, 1);
+    if (VOK == stat) stat = vmsetd(&mem, &c, addr, 1, VPWRITE);
+  }
+  if (!TEST_ASSERT(VOK == stat, "failed to touch the memory")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vqword res = resident_bytes(&mem);
+  printf("page:     %llu bytes\n", (unsigned long long)VPAGESZ);
+  printf("touched:  %d bytes\n", SPARSEN);
+  printf("resident: %llu KiB\n", (unsigned long long)(res >> 10));
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+// what the reader threads share
+typedef struct {
+  vmem *mem;
+  int reads;
+  _Atomic unsigned seed;
+  _Atomic int failed;
+} readers;
+
+static int reader(void *arg) {
+  readers *r = (readers*)arg;
+  unsigned seed = atomic_fetch_add(&r->seed, 1);
+  vbyte buf[8];
+
+  for (int i = 0; i < r->reads; i++) {
+    seed = seed * 1103515245 + 12345;
+    vqword off = ((vqword)seed * 8) % REGIONSZ;
+    if (VOK != vmgetd(r->mem, buf, VPAGESZ + off, 8, VPREAD)) {
+      atomic_store(&r->failed, 1);
+      break;
+    }
+  }
+  return 0;
+}
+
+// threaded reads: the same random accesses, split among more and more threads
+TEST(threaded) {
+  int stat = VOK;
+  vmem mem;
+
+  stat = vminit(&mem, 24);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+
+  stat = map_range(&mem, VPAGESZ, REGIONSZ);
+  if (VOK == stat) stat = vmfilld(&mem, VPAGESZ, REGIONSZ, 0x5a);
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the region")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  for (int n = 1; n <= MAXTHRDS; n *= 2) {
+    thrd_t thrd[MAXTHRDS];
+    struct timespec start;
+    readers r = { .mem = &mem, .reads = THRDREADS / n, .seed = 1 };
+    int spawned = 0;
+    atomic_init(&r.failed, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; spawned < n; spawned++)
+      if (thrd_success != thrd_create(&thrd[spawned], reader, &r)) break;
+    for (int t = 0; t < spawned; t++)
+      thrd_join(thrd[t], NULL);
+    uint64_t ns = elapsed_since(&start);
+
+    if (!TEST_ASSERT(spawned == n, "failed to spawn the threads") ||
+        !TEST_ASSERT(!atomic_load(&r.failed), "vmgetd failed"))
+    {
+      vmdestroy(&mem);
+      return 0;
+    }
+    printf("threads:  %d, %llu ns/access\n", n,
+           (unsigned long long)(ns / ((vqword)r.reads * n)));
+  }
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+int test(const char *suite_name) {
+  TEST_RUN(translation);
+  TEST_RUN(sparse_waste);
+  TEST_RUN(threaded);
+
+  // exit code
+  return 0;
+}
@@ -1,8 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "__test.h"
 #include "../src/vyt.h"
 #include "../src/exec.h"
 #include "../src/mem.h"
+#include "../src/snap.h"
 
 // a test to verify that our program loader works as expected
 TEST(program_loader) {
@@ -70,7 +73,702 @@ TEST(program_loader) {
   return 1;
 }
 
+// a test to verify that page-aligned segments are mapped without copying
+TEST(zero_copy_loader) {
+  int stat = VOK;
+  vproc p;
+
+  // startup options
+  struct vopts opt = {
+    .stacksz = 0,           // no need to allocate stack
+  };
+
+  // initialize the process
+  stat = vpinit(&p, &opt);
+  if (!TEST_ASSERT(VOK == stat, "vpinit failed")) {
+    return 0;
+  }
+
+  // the image: header and load table on the first page, followed by one full
+  // page and 4 more bytes of payload
+  vqword sz = VPAGESZ * 3;
+  vbyte *prog = (vbyte*)aligned_alloc(VPAGESZ, sz);
+  if (!TEST_ASSERT(NULL != prog, "aligned_alloc failed")) {
+    vpdestroy(&p);
+    return 0;
+  }
+  memset(prog, 0, sz);
+  memcpy(prog, (vbyte[]){
+    0x00, 0x56, 0x59, 0x54,                         // the header
+    0x01,                                           // abi version
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // entry point
+    VLLOAD,                                         // load type (from payload)
+    VPREAD | VPWRITE,                               // flags
+  }, 15);
+  v__uwq(prog + 15, VPAGESZ);                       // file offset
+  v__uwq(prog + 23, VPAGESZ);                       // memory address
+  v__uwq(prog + 31, VPAGESZ + 4);                   // size to load
+  memset(prog + VPAGESZ, 0xab, VPAGESZ + 4);
+
+  // try load the sample program
+  stat = vloadmap(&p, prog, sz);
+  if (!TEST_ASSERT(VOK == stat, "vloadmap failed")) {
+    vperr(stat);
+    vpdestroy(&p);
+    free(prog);
+    return 0;
+  }
+
+  // the first page should be backed by the image itself
+  vmpage *pg = NULL;
+  stat = vmgetp(&p.mem, 1, &pg);
+  if (!TEST_ASSERT(VOK == stat, "vmgetp failed") ||
+      !TEST_ASSERT(prog + VPAGESZ == pg->frame, "page was copied") ||
+      !TEST_EXPECT_FALSE(pg->flags & VPOWNED))
+  {
+    vpdestroy(&p);
+    free(prog);
+    return 0;
+  }
+
+  // the trailing partial page is copied
+  vbyte buf[4];
+  stat = vmgetd(&p.mem, buf, VPAGESZ * 2, 4, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_ASSERT(memcmp(prog + VPAGESZ * 2, buf, 4) == 0,
+                   "data unmatched from what we stored"))
+  {
+    vpdestroy(&p);
+    free(prog);
+    return 0;
+  }
+
+  // test succeded! the image outlives the process
+  vpdestroy(&p);
+  free(prog);
+  return 1;
+}
+
+// a test to verify that a page an earlier segment put something in isn't
+// mapped from the image by a later one
+TEST(zero_copy_shared) {
+  int stat = VOK;
+  vproc p;
+
+  // startup options
+  struct vopts opt = {
+    .stacksz = 0,           // no need to allocate stack
+  };
+
+  // initialize the process
+  stat = vpinit(&p, &opt);
+  if (!TEST_ASSERT(VOK == stat, "vpinit failed")) {
+    return 0;
+  }
+
+  // the image: the first segment zeroes the end of the first page, the second
+  // one loads two full pages over it
+  vqword sz = VPAGESZ * 3;
+  vbyte *prog = (vbyte*)aligned_alloc(VPAGESZ, sz);
+  if (!TEST_ASSERT(NULL != prog, "aligned_alloc failed")) {
+    vpdestroy(&p);
+    return 0;
+  }
+  memset(prog, 0, sz);
+  memcpy(prog, (vbyte[]){
+    0x00, 0x56, 0x59, 0x54,                         // the header
+    0x01,                                           // abi version
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // entry point
+  }, 13);
+  prog[13] = VLINIT;                                // load type (zeroes)
+  prog[14] = VPREAD | VPWRITE;                      // flags
+  v__uwq(prog + 15, 0);                             // file offset
+  v__uwq(prog + 23, VPAGESZ * 2 - 16);              // memory address
+  v__uwq(prog + 31, 16);                            // size to load
+  prog[39] = VLLOAD;                                // load type (payload)
+  prog[40] = VPREAD | VPWRITE;                      // flags
+  v__uwq(prog + 41, VPAGESZ);                       // file offset
+  v__uwq(prog + 49, VPAGESZ);                       // memory address
+  v__uwq(prog + 57, VPAGESZ * 2);                   // size to load
+  memset(prog + VPAGESZ, 0xab, VPAGESZ * 2);
+
+  // try load the sample program
+  stat = vloadmap(&p, prog, sz);
+  if (!TEST_ASSERT(VOK == stat, "vloadmap failed")) {
+    vperr(stat);
+    vpdestroy(&p);
+    free(prog);
+    return 0;
+  }
+
+  // the shared page is populated, in the order of the segments
+  vbyte buf[16];
+  vmpage *pg = NULL;
+  stat = vmgetd(&p.mem, buf, VPAGESZ * 2 - 16, 16, VPREAD);
+  if (VOK == stat) stat = vmgetp(&p.mem, 1, &pg);
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_ASSERT(memcmp(prog + VPAGESZ, buf, 16) == 0,
+                   "data unmatched from what we stored") ||
+      !TEST_ASSERT(prog + VPAGESZ != pg->frame, "shared page was mapped") ||
+      !TEST_EXPECT_TRUE(pg->flags & VPOWNED))
+  {
+    vpdestroy(&p);
+    free(prog);
+    return 0;
+  }
+
+  // the page only the second one covers is still backed by the image
+  stat = vmgetp(&p.mem, 2, &pg);
+  if (!TEST_ASSERT(VOK == stat, "vmgetp failed") ||
+      !TEST_ASSERT(prog + VPAGESZ * 2 == pg->frame, "page was copied"))
+  {
+    vpdestroy(&p);
+    free(prog);
+    return 0;
+  }
+
+  // test succeded! the image outlives the process
+  vpdestroy(&p);
+  free(prog);
+  return 1;
+}
+
+// a test to verify that stack accesses agree across the fast and slow paths
+TEST(stack_fast_path) {
+  int stat = VOK;
+  vproc p;
+
+  // startup options
+  struct vopts opt = {
+    .stacksz = 0,           // we map the stack ourselves
+  };
+
+  // initialize the process
+  stat = vpinit(&p, &opt);
+  if (!TEST_ASSERT(VOK == stat, "vpinit failed")) {
+    return 0;
+  }
+
+  // two stack pages, with the stack pointer a few slots above the boundary
+  vthrd *thr = v__thrd(&p, 0);
+  thr->_stframe = NULL;
+  thr->reg[RSP] = VPAGESZ * 2 + 24;
+  stat = vmmap(&p.mem, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&p.mem, 2, VPREAD | VPWRITE);
+  if (!TEST_ASSERT(VOK == stat, "vmmap failed")) {
+    vpdestroy(&p);
+    return 0;
+  }
+
+  // push across the page boundary
+  vbyte buf[8];
+  for (vqword i = 0; i < 8 && VOK == stat; i++) {
+    v__uwq(buf, 0x1111111111111111 * i);
+    stat = vstpush(&p, thr, buf, 8);
+  }
+  if (!TEST_ASSERT(VOK == stat, "vstpush failed") ||
+      !TEST_EXPECT_EQ(thr->reg[RSP], VPAGESZ * 2 - 40))
+  {
+    vpdestroy(&p);
+    return 0;
+  }
+
+  // the general path should see what the fast path stored
+  stat = vmgetd(&p.mem, buf, VPAGESZ * 2 + 8, 8, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_EXPECT_EQ(v__urq(buf), 0x1111111111111111))
+  {
+    vpdestroy(&p);
+    return 0;
+  }
+
+  // and pop them back
+  for (vqword i = 8; i-- > 0 && VOK == stat; ) {
+    stat = vstpop(&p, thr, buf, 8);
+    if (VOK == stat && !TEST_EXPECT_EQ(v__urq(buf), 0x1111111111111111 * i))
+      stat = VERROR;
+  }
+  if (!TEST_ASSERT(VOK == stat, "vstpop failed") ||
+      !TEST_EXPECT_EQ(thr->reg[RSP], VPAGESZ * 2 + 24))
+  {
+    vpdestroy(&p);
+    return 0;
+  }
+
+  // a dropped frame should not be used by the fast path anymore
+  stat = vmunmap(&p.mem, 2);
+  if (!TEST_ASSERT(VOK == stat, "vmunmap failed") ||
+      !TEST_EXPECT_EQ(vstpop(&p, thr, buf, 8), VESEGV))
+  {
+    vpdestroy(&p);
+    return 0;
+  }
+
+  // test succeded!
+  vpdestroy(&p);
+  return 1;
+}
+
+// a test to verify that a snapshot restores the memory and the registers
+TEST(snapshot_restore) {
+  int stat = VOK;
+  vproc p, q;
+
+  // startup options
+  struct vopts opt = {
+    .stacksz = 0,           // no need to allocate stack
+  };
+
+  // initialize the processes
+  stat = vpinit(&p, &opt);
+  if (!TEST_ASSERT(VOK == stat, "vpinit failed")) {
+    return 0;
+  }
+  stat = vpinit(&q, &opt);
+  if (!TEST_ASSERT(VOK == stat, "vpinit failed")) {
+    vpdestroy(&p);
+    return 0;
+  }
+
+  // a populated page, and one that was never touched
+  vthrd *thr = v__thrd(&p, 0);
+  thr->reg[R1] = 0xdeadbeef;
+  thr->reg[RIP] = VPAGESZ + 3;
+  stat = vmmap(&p.mem, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&p.mem, 2, VPREAD);
+  if (VOK == stat) stat = vmsetd(&p.mem, (vbyte[]){ 0xca, 0xfe }, VPAGESZ + 5,
+                                 2, VPWRITE);
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the memory")) {
+    vpdestroy(&p);
+    vpdestroy(&q);
+    return 0;
+  }
+
+  // take the snapshot
+  FILE *f = tmpfile();
+  stat = NULL == f ? VERROR : vsnap(&p, thr, f);
+  vpdestroy(&p);
+  if (!TEST_ASSERT(VOK == stat, "vsnap failed")) {
+    if (NULL != f) fclose(f);
+    vpdestroy(&q);
+    return 0;
+  }
+
+  // read it back, the frames are page aligned within the file
+  long sz = ftell(f);
+  vbyte *image = (vbyte*)aligned_alloc(VPAGESZ, (sz + VPAGEMASK) & ~VPAGEMASK);
+  rewind(f);
+  if (!TEST_ASSERT(NULL != image && 1 == fread(image, sz, 1, f),
+                   "failed to read the snapshot"))
+  {
+    fclose(f);
+    free(image);
+    vpdestroy(&q);
+    return 0;
+  }
+  fclose(f);
+
+  // restore it into the other process
+  stat = vsnapload(&q, image, sz);
+  if (!TEST_ASSERT(VOK == stat, "vsnapload failed")) {
+    vperr(stat);
+    free(image);
+    vpdestroy(&q);
+    return 0;
+  }
+
+  // the registers, telling the thread that it's been restored
+  thr = v__thrd(&q, 0);
+  if (!TEST_EXPECT_EQ(thr->reg[R1], 0xdeadbeef) ||
+      !TEST_EXPECT_EQ(thr->reg[RIP], VPAGESZ + 3) ||
+      !TEST_EXPECT_EQ(thr->reg[R8], 1) ||
+      !TEST_EXPECT_TRUE(VTRESUME & thr->flags))
+  {
+    vpdestroy(&q);
+    free(image);
+    return 0;
+  }
+
+  // and the memory, backed by the image
+  vbyte buf[2];
+  vmpage *pg = NULL;
+  stat = vmgetd(&q.mem, buf, VPAGESZ + 5, 2, VPREAD);
+  if (VOK == stat) stat = vmgetp(&q.mem, 1, &pg);
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_EXPECT_EQ(buf[0], 0xca) || !TEST_EXPECT_EQ(buf[1], 0xfe) ||
+      !TEST_ASSERT(0 == ((vqword)(pg->frame - image) & VPAGEMASK),
+                   "frame is not page aligned"))
+  {
+    vpdestroy(&q);
+    free(image);
+    return 0;
+  }
+
+  // the untouched page is still there, and still unpopulated
+  stat = vmgetp(&q.mem, 2, &pg);
+  if (!TEST_ASSERT(VOK == stat, "vmgetp failed") ||
+      !TEST_EXPECT_TRUE(NULL == pg->frame) ||
+      !TEST_EXPECT_EQ(pg->flags & 7, VPREAD))
+  {
+    vpdestroy(&q);
+    free(image);
+    return 0;
+  }
+
+  // test succeded! the image outlives the process
+  vpdestroy(&q);
+  free(image);
+  return 1;
+}
+
+// waits until the thread 'tid' is gone
+static void wait_gone(vproc *p, int tid) {
+  for (;;) {
+    amtx_lock(&p->_thrd_lock);
+    vthrd *thr = v__thrd(p, tid);
+    amtx_unlock(&p->_thrd_lock);
+    if (NULL == thr) return;
+    thrd_yield();
+  }
+}
+
+// a test to verify that the threads that are gone leave their tid and ctx
+// behind for the next ones
+TEST(thread_slots) {
+  int stat = VOK;
+  vproc p;
+
+  // startup options
+  struct vopts opt = {
+    .stacksz = 0,           // no need to allocate stack
+  };
+
+  // initialize the process
+  stat = vpinit(&p, &opt);
+  if (!TEST_ASSERT(VOK == stat, "vpinit failed")) {
+    return 0;
+  }
+
+  // a loop that keeps the process alive, followed by an exit
+  vbyte prog[0x28 + 16];
+  vqword code = VPAGESZ;
+  memset(prog, 0, sizeof(prog));
+  memcpy(prog, (vbyte[]){
+    0x00, 0x56, 0x59, 0x54,                         // the header
+    0x01,                                           // abi version
+  }, 5);
+  v__uwq(prog + 5, code);                           // entry point
+  prog[13] = VLLOAD;                                // load type
+  prog[14] = VPREAD | VPEXEC;                       // flags
+  v__uwq(prog + 15, 0x28);                          // file offset
+  v__uwq(prog + 23, code);                          // memory address
+  v__uwq(prog + 31, 16);                            // size to load
+  memcpy(prog + 0x28, (vbyte[]){ 0x0f, 0x00, 0x13 }, 3);   // jmp code
+  v__uwq(prog + 0x2b, code);
+  memcpy(prog + 0x33, (vbyte[]){ 0x01, 0x00, 0x05, 0x01, 0x00 }, 5); // exit
+
+  stat = vload(&p, prog, sizeof(prog));
+  int spin = 0;
+  if (VOK == stat) stat = vstart(&p, &spin, code, 0);
+  if (!TEST_ASSERT(VOK == stat, "failed to start the process") ||
+      !TEST_EXPECT_EQ(spin, 1))
+  {
+    atomic_store(&p.state, VSDONE);
+    vpdestroy(&p);
+    return 0;
+  }
+
+  // each short thread takes over the ctx of the one before it
+  vthrd *first = NULL;
+  for (int i = 0; VOK == stat && i < 64; i++) {
+    int tid = 0;
+    stat = vstart(&p, &tid, code + 11, 0);
+    if (VOK != stat) break;
+    if (NULL == first) first = v__thrd(&p, tid);
+    if (!TEST_EXPECT_EQ(tid, 2)) stat = VERROR;
+    wait_gone(&p, tid);
+  }
+  amtx_lock(&p._thrd_lock);
+  vthrd *pooled = p._thrd_pool;
+  vdword next = p._thrd_next;
+  amtx_unlock(&p._thrd_lock);
+
+  // stop the loop, and wait for it to leave
+  atomic_store(&p.state, VSDONE);
+  wait_gone(&p, spin);
+  while (0 < atomic_load(&p.alive))
+    thrd_yield();
+
+  if (!TEST_ASSERT(VOK == stat, "vstart failed") ||
+      !TEST_EXPECT_EQ(next, 3) ||
+      !TEST_ASSERT(first == pooled, "the thread ctx was not reused"))
+  {
+    vpdestroy(&p);
+    return 0;
+  }
+
+  // test succeded!
+  vpdestroy(&p);
+  return 1;
+}
+
+// a test to verify that the threads run as tasks, on fewer host threads than
+// there are guest threads. main parks in tjoin until the thread it made exits
+TEST(tasks) {
+  vbyte prog[] = {
+    0x00, 0x56, 0x59, 0x54,                         // the header
+    0x01,                                           // abi version
+    0x01, 0, 0, 0, 0, 0, 0, 0,                      // entry point
+    VLLOAD, VPREAD | VPEXEC,                        // the code
+    0x42, 0, 0, 0, 0, 0, 0, 0,
+    0x01, 0, 0, 0, 0, 0, 0, 0,
+    0x3d, 0, 0, 0, 0, 0, 0, 0,
+    VLINIT, VPREAD | VPWRITE,                       // the data
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0x40, 0, 0, 0, 0, 0,
+    0x08, 0, 0, 0, 0, 0, 0, 0,
+    0x00,
+    0x03, 0x00, 0x2b, 0x01, 0x2d, 0, 0, 0, 0, 0, 0, 0,     // mov r1, worker
+    0x01, 0x00, 0x05, 0x0a, 0x00,                   // tmake
+    0x03, 0x00, 0x4b, 0x01, 0x08,                   // mov r1, r8
+    0x01, 0x00, 0x05, 0x0b, 0x00,                   // tjoin
+    0x03, 0x00, 0x88, 0x01, 0, 0, 0x40, 0, 0, 0, 0, 0,     // mov r1, [data]
+    0x01, 0x00, 0x05, 0x01, 0x00,                   // exit
+    0x03, 0x00, 0x30, 0, 0, 0x40, 0, 0, 0, 0, 0, 0x2a,     // mov [data], 42
+    0x01, 0x00, 0x05, 0x01, 0x00,                   // exit
+  };
+
+  // a single worker runs main first, the others may run either
+  for (vdword n = 1; n <= 3; n++) {
+    vproc p;
+    struct vopts opt = {
+      .stacksz = VPAGESZ,
+      .tasks   = n,
+    };
+
+    int stat = vpinit(&p, &opt);
+    if (!TEST_ASSERT(VOK == stat, "vpinit failed")) return 0;
+    stat = vload(&p, prog, sizeof(prog));
+    if (VOK == stat) stat = vrun(&p);
+
+    // the parked tjoin runs again, but it's counted once
+    if (!TEST_ASSERT(VOK == stat, "the program failed") ||
+        !TEST_EXPECT_EQ(atomic_load(&p.exitcode), 42) ||
+        !TEST_EXPECT_EQ(atomic_load(&p.nexec), 8))
+    {
+      if (VSDONE != atomic_load(&p.state)) atomic_store(&p.state, VSDONE);
+      vpdestroy(&p);
+      return 0;
+    }
+    vpdestroy(&p);
+  }
+
+  // test succeded!
+  return 1;
+}
+
+// a test to verify that a task spinning in a loop is preempted, by either
+// quantum, so main gets its turn back on the one worker there is. the spinning
+// one is a daemon, it stops with main
+TEST(preemption) {
+  vbyte prog[] = {
+    0x00, 0x56, 0x59, 0x54,                         // the header
+    0x01,                                           // abi version
+    0x01, 0, 0, 0, 0, 0, 0, 0,                      // entry point
+    VLLOAD, VPREAD | VPEXEC,                        // the code
+    0x28, 0, 0, 0, 0, 0, 0, 0,
+    0x01, 0, 0, 0, 0, 0, 0, 0,
+    0x3c, 0, 0, 0, 0, 0, 0, 0,
+    0x00,
+    0x03, 0x00, 0x2b, 0x01, 0x32, 0, 0, 0, 0, 0, 0, 0,     // mov r1, spin
+    0x01, 0x00, 0x05, 0x0a, 0x00,                   // tmake
+    0x03, 0x00, 0x4b, 0x01, 0x08,                   // mov r1, r8
+    0x01, 0x00, 0x05, 0x0c, 0x00,                   // tdaem
+    0x01, 0x00, 0x05, 0x0e, 0x00,                   // tyld
+    0x03, 0x00, 0x2b, 0x01, 0x2a, 0, 0, 0, 0, 0, 0, 0,     // mov r1, 42
+    0x01, 0x00, 0x05, 0x01, 0x00,                   // exit
+    0x0f, 0x00, 0x13, 0x32, 0, 0, 0, 0, 0, 0, 0,    // spin: jmp spin
+  };
+
+  struct vopts opts[] = {
+    { .stacksz = VPAGESZ, .tasks = 1, .quantum = 100 },
+    { .stacksz = VPAGESZ, .tasks = 1, .quantum = ~(vqword)0,
+      .quantumus = 1000 },
+  };
+
+  for (int i = 0; i < 2; i++) {
+    vproc p;
+    int stat = vpinit(&p, &opts[i]);
+    if (!TEST_ASSERT(VOK == stat, "vpinit failed")) return 0;
+    stat = vload(&p, prog, sizeof(prog));
+    if (VOK == stat) stat = vrun(&p);
+
+    if (!TEST_ASSERT(VOK == stat, "the program failed") ||
+        !TEST_EXPECT_EQ(atomic_load(&p.exitcode), 42))
+    {
+      if (VSDONE != atomic_load(&p.state)) atomic_store(&p.state, VSDONE);
+      vpdestroy(&p);
+      return 0;
+    }
+    vpdestroy(&p);
+  }
+
+  // test succeded!
+  return 1;
+}
+
+// a test to verify that a daemon sleeping on a futex doesn't hold the process
+// up, either on a host thread of its own or as a task
+TEST(futex_daemon) {
+  vbyte prog[] = {
+    0x00, 0x56, 0x59, 0x54,                         // the header
+    0x01,                                           // abi version
+    0x01, 0, 0, 0, 0, 0, 0, 0,                      // entry point
+    VLLOAD, VPREAD | VPEXEC,                        // the code
+    0x42, 0, 0, 0, 0, 0, 0, 0,
+    0x01, 0, 0, 0, 0, 0, 0, 0,
+    0x65, 0, 0, 0, 0, 0, 0, 0,
+    VLINIT, VPREAD | VPWRITE,                       // the futex
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0x40, 0, 0, 0, 0, 0,
+    0x08, 0, 0, 0, 0, 0, 0, 0,
+    0x00,
+    0x03, 0x00, 0x2b, 0x01, 0x32, 0, 0, 0, 0, 0, 0, 0,     // mov r1, sleep
+    0x01, 0x00, 0x05, 0x0a, 0x00,                   // tmake
+    0x03, 0x00, 0x4b, 0x01, 0x08,                   // mov r1, r8
+    0x01, 0x00, 0x05, 0x0c, 0x00,                   // tdaem
+    0x01, 0x00, 0x05, 0x0e, 0x00,                   // tyld
+    0x03, 0x00, 0x2b, 0x01, 0x2a, 0, 0, 0, 0, 0, 0, 0,     // mov r1, 42
+    0x01, 0x00, 0x05, 0x01, 0x00,                   // exit
+    0x03, 0x00, 0x2b, 0x01, 0, 0, 0x40, 0, 0, 0, 0, 0,     // sleep: mov r1, futex
+    0x03, 0x00, 0x2b, 0x02, 0, 0, 0, 0, 0, 0, 0, 0,        // mov r2, 0
+    0x03, 0x00, 0x2b, 0x03, 0, 0, 0, 0, 0, 0, 0, 0,        // mov r3, 0
+    0x01, 0x00, 0x05, 0x11, 0x00,                   // fwait
+    0x0f, 0x00, 0x13, 0x32, 0, 0, 0, 0, 0, 0, 0,    // jmp sleep
+  };
+
+  for (vdword n = 0; n < 2; n++) {
+    vproc p;
+    struct vopts opt = {
+      .stacksz = VPAGESZ,
+      .tasks   = n,
+    };
+
+    int stat = vpinit(&p, &opt);
+    if (!TEST_ASSERT(VOK == stat, "vpinit failed")) return 0;
+    stat = vload(&p, prog, sizeof(prog));
+    if (VOK == stat) stat = vrun(&p);
+
+    if (!TEST_ASSERT(VOK == stat, "the program failed") ||
+        !TEST_EXPECT_EQ(atomic_load(&p.exitcode), 42))
+    {
+      if (VSDONE != atomic_load(&p.state)) atomic_store(&p.state, VSDONE);
+      vpdestroy(&p);
+      return 0;
+    }
+    vpdestroy(&p);
+  }
+
+  // test succeded!
+  return 1;
+}
+
+// a test to verify that the deterministic mode runs the threads the same way
+// every time, however many workers and whatever time quantum are asked for.
+// the two threads race on a counter, main times out on a futex meanwhile
+TEST(deterministic) {
+  vbyte prog[] = {
+    0x00, 0x56, 0x59, 0x54,                         // the header
+    0x01,                                           // abi version
+    0x01, 0, 0, 0, 0, 0, 0, 0,                      // entry point
+    VLLOAD, VPREAD | VPEXEC,                        // the code
+    0x42, 0, 0, 0, 0, 0, 0, 0,
+    0x01, 0, 0, 0, 0, 0, 0, 0,
+    0x0d, 0x01, 0, 0, 0, 0, 0, 0,
+    VLINIT, VPREAD | VPWRITE,                       // the counter, the futex
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0x40, 0, 0, 0, 0, 0,
+    0x08, 0, 0, 0, 0, 0, 0, 0,
+    0x00,
+    0x03, 0x00, 0x2b, 0x01, 0xac, 0, 0, 0, 0, 0, 0, 0,     // mov r1, work
+    0x01, 0x00, 0x05, 0x0a, 0x00,                   // tmake
+    0x03, 0x00, 0x4b, 0x05, 0x08,                   // mov r5, r8
+    0x03, 0x00, 0x2b, 0x03, 0xe8, 0x03, 0, 0, 0, 0, 0, 0,  // mov r3, 1000
+    0x03, 0x00, 0x8a, 0x04, 0, 0, 0x40, 0, 0, 0, 0, 0,     // loop: mov r4, [ctr]
+    0x1e, 0x00, 0x2a, 0x04, 0x01, 0, 0, 0,          // add r4, 1
+    0x0f, 0x00, 0x13, 0x45, 0, 0, 0, 0, 0, 0, 0,    // jmp store
+    0x33, 0x00, 0x00,                               // fence
+    0x03, 0x00, 0x52, 0, 0, 0x40, 0, 0, 0, 0, 0, 0x04,     // store: mov [ctr], r4
+    0x1f, 0x00, 0x2b, 0x03, 0x01, 0, 0, 0, 0, 0, 0, 0,     // sub r3, 1
+    0x11, 0x00, 0x13, 0x23, 0, 0, 0, 0, 0, 0, 0,    // jne loop
+    0x03, 0x00, 0x2b, 0x01, 0x04, 0, 0x40, 0, 0, 0, 0, 0,  // mov r1, futex
+    0x03, 0x00, 0x2b, 0x02, 0, 0, 0, 0, 0, 0, 0, 0,        // mov r2, 0
+    0x03, 0x00, 0x2b, 0x03, 0x05, 0, 0, 0, 0, 0, 0, 0,     // mov r3, 5
+    0x01, 0x00, 0x05, 0x11, 0x00,                   // fwait
+    0x03, 0x00, 0x4b, 0x01, 0x05,                   // mov r1, r5
+    0x01, 0x00, 0x05, 0x0b, 0x00,                   // tjoin
+    0x03, 0x00, 0x8a, 0x01, 0, 0, 0x40, 0, 0, 0, 0, 0,     // mov r1, [ctr]
+    0x01, 0x00, 0x05, 0x01, 0x00,                   // exit
+    0x03, 0x00, 0x2b, 0x03, 0xe8, 0x03, 0, 0, 0, 0, 0, 0,  // work: mov r3, 1000
+    0x03, 0x00, 0x8a, 0x04, 0, 0, 0x40, 0, 0, 0, 0, 0,     // loop: mov r4, [ctr]
+    0x1e, 0x00, 0x2a, 0x04, 0x01, 0, 0, 0,          // add r4, 1
+    0x0f, 0x00, 0x13, 0xda, 0, 0, 0, 0, 0, 0, 0,    // jmp store
+    0x33, 0x00, 0x00,                               // fence
+    0x03, 0x00, 0x52, 0, 0, 0x40, 0, 0, 0, 0, 0, 0x04,     // store: mov [ctr], r4
+    0x1f, 0x00, 0x2b, 0x03, 0x01, 0, 0, 0, 0, 0, 0, 0,     // sub r3, 1
+    0x11, 0x00, 0x13, 0xb8, 0, 0, 0, 0, 0, 0, 0,    // jne loop
+    0x03, 0x00, 0x2b, 0x01, 0, 0, 0, 0, 0, 0, 0, 0,        // mov r1, 0
+    0x01, 0x00, 0x05, 0x01, 0x00,                   // exit
+  };
+
+  struct vopts opts[] = {
+    { .stacksz = VPAGESZ, .deterministic = 1, .quantum = 7 },
+    { .stacksz = VPAGESZ, .deterministic = 1, .quantum = 7 },
+    { .stacksz = VPAGESZ, .deterministic = 1, .quantum = 7, .tasks = 3,
+      .quantumus = 1 },
+  };
+  vqword nexec[3];
+  int exitcode[3];
+
+  for (int i = 0; i < 3; i++) {
+    vproc p;
+    int stat = vpinit(&p, &opts[i]);
+    if (!TEST_ASSERT(VOK == stat, "vpinit failed")) return 0;
+    stat = vload(&p, prog, sizeof(prog));
+    if (VOK == stat) stat = vrun(&p);
+    nexec[i] = atomic_load(&p.nexec);
+    exitcode[i] = atomic_load(&p.exitcode);
+
+    if (!TEST_ASSERT(VOK == stat, "the program failed") ||
+        !TEST_EXPECT_EQ(nexec[i], nexec[0]) ||
+        !TEST_EXPECT_EQ(exitcode[i], exitcode[0]))
+    {
+      if (VSDONE != atomic_load(&p.state)) atomic_store(&p.state, VSDONE);
+      vpdestroy(&p);
+      return 0;
+    }
+    vpdestroy(&p);
+  }
+  printf("counter:  %d, %llu instructions\n", exitcode[0],
+         (unsigned long long)nexec[0]);
+
+  // the threads did interleave, some of the increments are lost
+  if (!TEST_EXPECT_LT(exitcode[0], 2000)) return 0;
+
+  // test succeded!
+  return 1;
+}
+
 int test(const char *suite_name) {
   TEST_RUN(program_loader);
+  TEST_RUN(zero_copy_loader);
+  TEST_RUN(zero_copy_shared);
+  TEST_RUN(stack_fast_path);
+  TEST_RUN(snapshot_restore);
+  TEST_RUN(thread_slots);
+  TEST_RUN(tasks);
+  TEST_RUN(preemption);
+  TEST_RUN(futex_daemon);
+  TEST_RUN(deterministic);
   return 0;
 }
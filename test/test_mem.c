@@ -1,7 +1,10 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "__test.h"
 #include "../src/vyt.h"
 #include "../src/mem.h"
+#include "../src/utils.h"
 
 #include <time.h>
 
@@ -90,6 +93,822 @@ TEST(mem_prot) {
   return 1;
 }
 
+// a test to verify the atomic operations, in the operand size and on naturally
+// aligned addresses only
+TEST(atomics) {
+  int stat = VOK;
+  vmem mem;
+
+  // initialize the page table
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+
+  // a writable page, and a read-only one
+  stat = vmmap(&mem, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&mem, 2, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "vmmap failed")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vqword at = VPAGESZ + 8;
+  vqword v1 = 0x1122334455667788, v2 = 5, v3 = 0x88, v4 = 0x99, v5 = 1;
+  vbyte buf[8];
+
+  // exchange, add to the lowest byte without carrying, then cas it twice
+  int s1 = vmatomic(&mem, at, 8, VMAXCHG, &v1, 0);
+  int s2 = vmatomic(&mem, at, 1, VMAADD, &v2, 0);
+  int s3 = vmatomic(&mem, at, 1, VMACAS, &v3, 0x8d);
+  int s4 = vmatomic(&mem, at, 1, VMACAS, &v4, 0x8d);
+  vmgetd(&mem, buf, at, 8, VPREAD);
+  if (!TEST_EXPECT_EQ(s1 | s2 | s3 | s4, VOK) ||
+      !TEST_EXPECT_EQ(v1, 0) ||
+      !TEST_EXPECT_EQ(v2, 0x88) ||
+      !TEST_EXPECT_EQ(v3, 0x8d) ||
+      !TEST_EXPECT_EQ(v4, 0x88) ||
+      !TEST_EXPECT_EQ(v__urq(buf), 0x1122334455667788))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // misaligned, read-only and unmapped
+  if (!TEST_EXPECT_EQ(vmatomic(&mem, at + 2, 4, VMAADD, &v5, 0), VEALIGN) ||
+      !TEST_EXPECT_EQ(vmatomic(&mem, 2 * VPAGESZ, 4, VMAADD, &v5, 0),
+                      VEACCES) ||
+      !TEST_EXPECT_NE(vmatomic(&mem, 3 * VPAGESZ, 4, VMAADD, &v5, 0), VOK))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+// a test to verify that lazy ranges are populated on the first access only
+TEST(lazy_populate) {
+  int stat = VOK;
+  vmem mem;
+
+  // initialize the page table
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+
+  // map the pages 0 and 1
+  stat = vmmap(&mem, 0, VPREAD);
+  if (VOK == stat) stat = vmmap(&mem, 1, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "vmmap failed")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // record a range across both pages, then zero-fill part of it
+  vbyte src[] = { 0xde, 0xad, 0xbe, 0xef };
+  stat = vmlazy(&mem, VPAGESZ - 2, src, 4);
+  if (VOK == stat) stat = vmlazy(&mem, VPAGESZ - 1, NULL, 1);
+  if (!TEST_ASSERT(VOK == stat, "vmlazy failed")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // nothing should be populated yet
+  vmpage *pg = NULL;
+  stat = vmgetp(&mem, 1, &pg);
+  if (!TEST_ASSERT(VOK == stat, "vmgetp failed") ||
+      !TEST_EXPECT_TRUE(NULL == pg->frame))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // read it back, in the order they were recorded
+  vbyte buf[4];
+  stat = vmgetd(&mem, buf, VPAGESZ - 2, 4, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_ASSERT(memcmp(buf, (vbyte[]){ 0xde, 0x00, 0xbe, 0xef }, 4) == 0,
+                   "data unmatched from what we recorded"))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+// a test to verify that frames come from the huge page pool, and recycled
+TEST(huge_pool) {
+  int stat = VOK;
+  vmem mem;
+
+  // initialize the page table, with a pool of a single huge page
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+  stat = vmhuge(&mem, 1);
+  if (!TEST_ASSERT(VOK == stat, "vmhuge failed") ||
+      !TEST_ASSERT(NULL != mem.pool, "no pool reserved"))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+  printf("hugepg:   %d\n", mem.hugepg);
+
+  // touch a page, its frame should be from the pool
+  vmpage *pg = NULL;
+  stat = vmmap(&mem, 3, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmfilld(&mem, 3 * VPAGESZ, VPAGESZ, 0xff);
+  if (VOK == stat) stat = vmgetp(&mem, 3, &pg);
+  if (!TEST_ASSERT(VOK == stat, "failed to touch the page") ||
+      !TEST_EXPECT_EQ(pg->frame, mem.pool->base))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // re-mapping it should reuse the same frame, zeroed again
+  vbyte c = 0xff;
+  stat = vmunmap(&mem, 3);
+  if (VOK == stat) stat = vmmap(&mem, 3, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmgetd(&mem, &c, 3 * VPAGESZ, 1, VPREAD);
+  if (VOK == stat) stat = vmgetp(&mem, 3, &pg);
+  if (!TEST_ASSERT(VOK == stat, "failed to re-touch the page") ||
+      !TEST_EXPECT_EQ(pg->frame, mem.pool->base) ||
+      !TEST_EXPECT_EQ(c, 0))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+// a test to verify the memory accounting, and the resident limit
+TEST(mem_limit) {
+  int stat = VOK;
+  vmem mem;
+  struct vmstats ms;
+
+  // initialize the page table, allowing two resident frames
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+  mem.limit = VPAGESZ * 2;
+
+  // map three pages, one of them on an external frame
+  static vbyte ext[VPAGESZ];
+  stat = vmmap(&mem, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&mem, 2, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmapf(&mem, 3, VPREAD, ext);
+  if (!TEST_ASSERT(VOK == stat, "vmmap failed")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // the first page fits, the second one doesn't
+  vbyte c = 1;
+  stat = vmsetd(&mem, &c, VPAGESZ, 1, VPWRITE);
+  if (!TEST_ASSERT(VOK == stat, "vmsetd failed") ||
+      !TEST_EXPECT_EQ(vmsetd(&mem, &c, VPAGESZ * 2, 1, VPWRITE), VENOMEM))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vmstat(&mem, &ms);
+  if (!TEST_EXPECT_EQ(ms.mapped, VPAGESZ * 3) ||
+      !TEST_EXPECT_EQ(ms.resident, VPAGESZ * 2) ||
+      !TEST_EXPECT_EQ(ms.owned, VPAGESZ))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // release the external frame, the second page should fit now
+  stat = vmunmap(&mem, 3);
+  if (VOK == stat) stat = vmsetd(&mem, &c, VPAGESZ * 2, 1, VPWRITE);
+  if (!TEST_ASSERT(VOK == stat, "vmsetd failed after unmapping")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vmstat(&mem, &ms);
+  if (!TEST_EXPECT_EQ(ms.resident, VPAGESZ * 2) ||
+      !TEST_EXPECT_EQ(ms.owned, VPAGESZ * 2))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+// a test to verify that a clone shares the frames until either side writes
+TEST(cow_clone) {
+  int stat = VOK;
+  vmem mem, copy;
+  struct vmstats ms;
+
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+  stat = vminit(&copy, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // two populated pages
+  vbyte c = 0x11;
+  stat = vmmap(&mem, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&mem, 2, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmsetd(&mem, &c, VPAGESZ, 1, VPWRITE);
+  if (VOK == stat) stat = vmsetd(&mem, &c, VPAGESZ * 2, 1, VPWRITE);
+  if (VOK == stat) stat = vmclone(&copy, &mem);
+  if (!TEST_ASSERT(VOK == stat, "failed to clone the memory")) {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  // both sides should be on the same frames
+  vmpage *pg = NULL, *cpg = NULL;
+  stat = vmgetp(&mem, 1, &pg);
+  if (VOK == stat) stat = vmgetp(&copy, 1, &cpg);
+  vmstat(&copy, &ms);
+  if (!TEST_ASSERT(VOK == stat, "vmgetp failed") ||
+      !TEST_EXPECT_EQ(pg->frame, cpg->frame) ||
+      !TEST_EXPECT_EQ(ms.shared, VPAGESZ * 2) ||
+      !TEST_EXPECT_EQ(ms.owned, 0))
+  {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  // the writes of the clone stay in the clone, and the other way around
+  c = 0x22;
+  stat = vmsetd(&copy, &c, VPAGESZ, 1, VPWRITE);
+  c = 0x33;
+  if (VOK == stat) stat = vmsetd(&mem, &c, VPAGESZ * 2, 1, VPWRITE);
+  if (!TEST_ASSERT(VOK == stat, "vmsetd failed") ||
+      !TEST_EXPECT_NE(pg->frame, cpg->frame) ||
+      !TEST_EXPECT_EQ(pg->frame[0], 0x11) ||
+      !TEST_EXPECT_EQ(cpg->frame[0], 0x22))
+  {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  // the shared frames outlive the source
+  vmdestroy(&mem);
+  stat = vmgetd(&copy, &c, VPAGESZ * 2, 1, VPREAD);
+  vmstat(&copy, &ms);
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_EXPECT_EQ(c, 0x11) ||
+      !TEST_EXPECT_EQ(ms.shared, VPAGESZ) ||
+      !TEST_EXPECT_EQ(ms.resident, VPAGESZ * 2))
+  {
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  vmdestroy(&copy);
+  return 1;
+}
+
+// a test to verify that the cold pages are compressed, and expanded back
+TEST(cold_pages) {
+  int stat = VOK;
+  vmem mem;
+  struct vmstats ms;
+
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+
+  // a table that compresses well, one that doesn't, and one that's in use
+  vbyte *data = (vbyte*)malloc(VPAGESZ * 2);
+  if (!TEST_ASSERT(NULL != data, "malloc failed")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+  srand(3);
+  for (vqword i = 0; i < VPAGESZ; i++) {
+    data[i] = i % 251 < 16 ? i % 7 : 0;
+    data[VPAGESZ + i] = rand();
+  }
+  stat = vmmap(&mem, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&mem, 2, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&mem, 3, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmsetd(&mem, data, VPAGESZ, VPAGESZ * 2, VPWRITE);
+  if (VOK == stat) stat = vmfilld(&mem, VPAGESZ * 3, VPAGESZ, 0x11);
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the memory")) {
+    vmdestroy(&mem);
+    free(data);
+    return 0;
+  }
+
+  // two samples, the last page is used in between
+  vbyte c = 0;
+  stat = vmcold(&mem);
+  if (VOK == stat) stat = vmgetd(&mem, &c, VPAGESZ * 3, 1, VPREAD);
+  if (VOK == stat) stat = vmcold(&mem);
+  if (VOK == stat) stat = vmcold(&mem);
+  vmstat(&mem, &ms);
+  printf("store:    %llu bytes for a page\n", (unsigned long long)ms.store);
+  if (!TEST_ASSERT(VOK == stat, "vmcold failed") ||
+      !TEST_EXPECT_EQ(ms.compressed, VPAGESZ) ||
+      !TEST_EXPECT_LT(ms.store, VPAGESZ / 4) ||
+      !TEST_EXPECT_EQ(ms.resident, VPAGESZ * 2))
+  {
+    vmdestroy(&mem);
+    free(data);
+    return 0;
+  }
+
+  // reading them back expands them
+  vbyte *buf = (vbyte*)malloc(VPAGESZ * 3);
+  stat = NULL == buf ? VENOMEM : vmgetd(&mem, buf, VPAGESZ, VPAGESZ * 3,
+                                        VPREAD);
+  vmstat(&mem, &ms);
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_ASSERT(0 == memcmp(buf, data, VPAGESZ * 2), "data unmatched") ||
+      !TEST_EXPECT_EQ(buf[VPAGESZ * 3 - 1], 0x11) ||
+      !TEST_EXPECT_EQ(ms.compressed, 0) ||
+      !TEST_EXPECT_EQ(ms.cfaults, 1))
+  {
+    vmdestroy(&mem);
+    free(data);
+    free(buf);
+    return 0;
+  }
+
+  vmdestroy(&mem);
+  free(data);
+  free(buf);
+  return 1;
+}
+
+// a test to verify that identical pages of different memories are merged,
+// and split again when written
+TEST(dedup) {
+  int stat = VOK;
+  vmem a, b;
+  vmksm ksm;
+  struct vmksmstats ks;
+
+  stat = vmksminit(&ksm);
+  if (!TEST_ASSERT(VOK == stat, "vmksminit failed")) {
+    return 0;
+  }
+  stat = vminit(&a, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    vmksmdestroy(&ksm);
+    return 0;
+  }
+  stat = vminit(&b, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    vmdestroy(&a);
+    vmksmdestroy(&ksm);
+    return 0;
+  }
+
+  // the first pages are the same, the second ones are not
+  stat = vmmap(&a, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&a, 2, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&b, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&b, 2, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmfilld(&a, VPAGESZ, VPAGESZ, 0x22);
+  if (VOK == stat) stat = vmfilld(&b, VPAGESZ, VPAGESZ, 0x22);
+  if (VOK == stat) stat = vmfilld(&a, VPAGESZ * 2, VPAGESZ, 0x33);
+  if (VOK == stat) stat = vmfilld(&b, VPAGESZ * 2, VPAGESZ, 0x44);
+  if (VOK == stat) stat = vmksmjoin(&ksm, &a);
+  if (VOK == stat) stat = vmksmjoin(&ksm, &b);
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the memories")) {
+    vmdestroy(&a);
+    vmdestroy(&b);
+    vmksmdestroy(&ksm);
+    return 0;
+  }
+
+  // the writable pages are merged once they went cold
+  for (int i = 0; VOK == stat && i < 3; i++)
+    stat = vmksmscan(&ksm);
+  vmksmstat(&ksm, &ks);
+  if (!TEST_ASSERT(VOK == stat, "vmksmscan failed") ||
+      !TEST_ASSERT(a.page[0].frame == b.page[0].frame, "frames not merged") ||
+      !TEST_ASSERT(a.page[1].frame != b.page[1].frame, "frames merged") ||
+      !TEST_EXPECT_EQ(ks.frames, 1) ||
+      !TEST_EXPECT_EQ(ks.pages, 2) ||
+      !TEST_EXPECT_EQ(ks.saved, VPAGESZ))
+  {
+    vmdestroy(&a);
+    vmdestroy(&b);
+    vmksmdestroy(&ksm);
+    return 0;
+  }
+
+  // writing splits the page off, the other one is left as it was
+  vbyte c = 0x55;
+  stat = vmsetd(&a, &c, VPAGESZ, 1, VPWRITE);
+  if (VOK == stat) stat = vmgetd(&b, &c, VPAGESZ, 1, VPREAD);
+  vmksmstat(&ksm, &ks);
+  if (!TEST_ASSERT(VOK == stat, "failed to access the memories") ||
+      !TEST_EXPECT_EQ(c, 0x22) ||
+      !TEST_EXPECT_EQ(ks.pages, 1))
+  {
+    vmdestroy(&a);
+    vmdestroy(&b);
+    vmksmdestroy(&ksm);
+    return 0;
+  }
+
+  // the service goes after the memories
+  vmdestroy(&a);
+  vmdestroy(&b);
+  vmksmstat(&ksm, &ks);
+  stat = vmksmdestroy(&ksm);
+  if (!TEST_EXPECT_EQ(ks.frames, 0) ||
+      !TEST_ASSERT(VOK == stat, "vmksmdestroy failed"))
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+// a test to verify that the frames over the budget are swapped out, and read
+// back in when accessed
+TEST(swapping) {
+  int stat = VOK;
+  vmem mem;
+  struct vmstats ms;
+
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+
+  // eight pages, two of them may stay
+  stat = vmswap(&mem, "swap.tmp", VPAGESZ * 2);
+  for (vqword i = 1; VOK == stat && i <= 8; i++) {
+    stat = vmmap(&mem, i, VPREAD | VPWRITE);
+    if (VOK == stat) stat = vmfilld(&mem, VPAGESZ * i, VPAGESZ, i);
+  }
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the memory")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  stat = vmswapout(&mem);
+  vmstat(&mem, &ms);
+  if (!TEST_ASSERT(VOK == stat, "vmswapout failed") ||
+      !TEST_EXPECT_LE(ms.resident, VPAGESZ * 2) ||
+      !TEST_EXPECT_GE(ms.swapped, VPAGESZ * 6) ||
+      !TEST_EXPECT_GE(ms.swapout, VPAGESZ * 6))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  // reading them back brings them in
+  vbyte c = 0;
+  for (vqword i = 1; VOK == stat && i <= 8; i++) {
+    stat = vmgetd(&mem, &c, VPAGESZ * i + VPAGESZ - 1, 1, VPREAD);
+    if (VOK == stat && c != i) stat = VERROR;
+  }
+  vmstat(&mem, &ms);
+  if (!TEST_ASSERT(VOK == stat, "data unmatched") ||
+      !TEST_EXPECT_GE(ms.sfaults, 6) ||
+      !TEST_EXPECT_GE(ms.swapin, VPAGESZ * 6))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+// counts what the epochs freed
+static _Atomic int freed;
+static void count_free(void *ptr) {
+  atomic_fetch_add(&freed, 1);
+  free(ptr);
+}
+
+// a test to verify that what's retired is only freed once the threads taking
+// part are past it, and that the old page tables go through the epochs
+TEST(epochs) {
+  int stat = VOK;
+  vepoch ep;
+  verec rec;
+  vmem mem;
+
+  stat = veinit(&ep);
+  if (!TEST_ASSERT(VOK == stat, "veinit failed")) {
+    return 0;
+  }
+  atomic_store(&freed, 0);
+  vejoin(&ep, &rec);
+
+  // still in the epoch it was retired in
+  stat = veretire(&ep, malloc(8), count_free);
+  if (!TEST_ASSERT(VOK == stat, "veretire failed") ||
+      !TEST_EXPECT_EQ(atomic_load(&freed), 0))
+  {
+    veleave(&ep, &rec);
+    vedestroy(&ep);
+    return 0;
+  }
+
+  // past a quiescent point, the next one retired collects it
+  vequiesce(&ep, &rec);
+  veretire(&ep, malloc(8), count_free);
+  if (!TEST_EXPECT_EQ(atomic_load(&freed), 1)) {
+    veleave(&ep, &rec);
+    vedestroy(&ep);
+    return 0;
+  }
+
+  // an offline thread holds nothing back, nor does the caller of vesync
+  veoffline(&rec);
+  veretire(&ep, malloc(8), count_free);
+  veonline(&ep, &rec);
+  vesync(&ep, &rec);
+  if (!TEST_EXPECT_EQ(atomic_load(&freed), 3)) {
+    veleave(&ep, &rec);
+    vedestroy(&ep);
+    return 0;
+  }
+
+  // grow the page table, its old copies are retired
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    veleave(&ep, &rec);
+    vedestroy(&ep);
+    return 0;
+  }
+  mem.epoch = &ep;
+  for (vqword i = 1; VOK == stat && i <= 64; i++) {
+    stat = vmmap(&mem, i, VPREAD | VPWRITE);
+    if (VOK == stat) stat = vmfilld(&mem, VPAGESZ * i, 8, i);
+    if (VOK == stat) vequiesce(&ep, &rec);
+  }
+  vbyte c = 0;
+  if (VOK == stat) stat = vmgetd(&mem, &c, VPAGESZ * 33, 1, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the memory") ||
+      !TEST_EXPECT_EQ(c, 33) ||
+      !TEST_EXPECT_EQ(mem._retired_used, 0))
+  {
+    vmdestroy(&mem);
+    veleave(&ep, &rec);
+    vedestroy(&ep);
+    return 0;
+  }
+
+  vmdestroy(&mem);
+  veleave(&ep, &rec);
+  vedestroy(&ep);
+  return 1;
+}
+
+// a test to verify that growing the page table without epochs keeps every
+// old table and bitmap aside until the memory is destroyed
+TEST(table_growth) {
+  int stat = VOK;
+  vmem mem;
+
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+
+  // past 64 pages the bitmaps grow along with the table, more than once
+  for (vqword i = 1; VOK == stat && i <= 300; i++) {
+    stat = vmmap(&mem, i, VPREAD | VPWRITE);
+    if (VOK == stat) stat = vmfilld(&mem, VPAGESZ * i, 8, i & 0xff);
+  }
+  vbyte c = 0;
+  if (VOK == stat) stat = vmgetd(&mem, &c, VPAGESZ * 257, 1, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the memory") ||
+      !TEST_EXPECT_EQ(c, 1) ||
+      !TEST_ASSERT(mem._retired_used <= mem._retired_alloc,
+                   "retired more tables than there's room for"))
+  {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  vmdestroy(&mem);
+  return 1;
+}
+
+// a test to verify that the single thread of a memory goes without the page
+// table lock while online, and that the compressor only holds it off
+TEST(solo) {
+  int stat = VOK;
+  vepoch ep;
+  verec rec;
+  vmem mem;
+  vbyte c = 0;
+
+  stat = veinit(&ep);
+  if (VOK == stat) stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "failed to initialize")) {
+    return 0;
+  }
+
+  // there's no epoch to wait on yet
+  if (!TEST_ASSERT(VERROR == vmsolo(&mem, &rec), "vmsolo without epochs")) {
+    vmdestroy(&mem);
+    vedestroy(&ep);
+    return 0;
+  }
+  mem.epoch = &ep;
+  vejoin(&ep, &rec);
+  stat = vmmap(&mem, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmsolo(&mem, &rec);
+  if (!TEST_ASSERT(VOK == stat, "failed to setup the memory")) {
+    veleave(&ep, &rec);
+    vmdestroy(&mem);
+    vedestroy(&ep);
+    return 0;
+  }
+
+  // a writer holding the lock doesn't keep it out
+  brw_wlock(&mem._lock);
+  stat = vmfilld(&mem, VPAGESZ, 8, 0x2a);
+  if (VOK == stat) stat = vmgetd(&mem, &c, VPAGESZ + 7, 1, VPREAD);
+  brw_wunlock(&mem._lock);
+  if (!TEST_ASSERT(VOK == stat, "access failed") ||
+      !TEST_EXPECT_EQ(c, 0x2a))
+  {
+    veleave(&ep, &rec);
+    vmdestroy(&mem);
+    vedestroy(&ep);
+    return 0;
+  }
+
+  // the compressor isn't held back by it offline, and puts it back after
+  veoffline(&rec);
+  stat = vmcold(&mem);
+  veonline(&ep, &rec);
+  if (!TEST_ASSERT(VOK == stat, "vmcold failed") ||
+      !TEST_ASSERT(&rec == atomic_load(&mem._solo), "not solo anymore"))
+  {
+    veleave(&ep, &rec);
+    vmdestroy(&mem);
+    vedestroy(&ep);
+    return 0;
+  }
+
+  // nor is the caller of vmunsolo, and ending it again is fine. once it's
+  // ended, the compressor leaves it that way
+  stat = vmunsolo(&mem, &rec);
+  if (VOK == stat) stat = vmunsolo(&mem, NULL);
+  veoffline(&rec);
+  if (VOK == stat) stat = vmcold(&mem);
+  veonline(&ep, &rec);
+  if (VOK == stat) stat = vmgetd(&mem, &c, VPAGESZ, 1, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "vmunsolo failed") ||
+      !TEST_ASSERT(NULL == atomic_load(&mem._solo), "still solo"))
+  {
+    veleave(&ep, &rec);
+    vmdestroy(&mem);
+    vedestroy(&ep);
+    return 0;
+  }
+
+  veleave(&ep, &rec);
+  vmdestroy(&mem);
+  vedestroy(&ep);
+  return 1;
+}
+
+// a test to verify that checkpoints only carry the changes, and that applying
+// them in order rebuilds the memory
+TEST(checkpoints) {
+  int stat = VOK;
+  vmem mem, copy;
+
+  stat = vminit(&mem, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    return 0;
+  }
+  stat = vminit(&copy, 0);
+  if (!TEST_ASSERT(VOK == stat, "vminit failed")) {
+    vmdestroy(&mem);
+    return 0;
+  }
+
+  FILE *full = tmpfile();
+  FILE *delta = tmpfile();
+  if (!TEST_ASSERT(NULL != full && NULL != delta, "tmpfile failed")) {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  // three pages, the last one is never touched
+  vbyte c = 0x11;
+  stat = vmmap(&mem, 1, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&mem, 2, VPREAD | VPWRITE);
+  if (VOK == stat) stat = vmmap(&mem, 3, VPREAD);
+  if (VOK == stat) stat = vmsetd(&mem, &c, VPAGESZ, 1, VPWRITE);
+  if (VOK == stat) stat = vmsetd(&mem, &c, VPAGESZ * 2, 1, VPWRITE);
+  if (VOK == stat) stat = vmckpt(&mem, full);
+  if (!TEST_ASSERT(VOK == stat, "failed to write the first checkpoint")) {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  // change one page, and unmap another
+  c = 0x22;
+  stat = vmsetd(&mem, &c, VPAGESZ * 2 + 1, 1, VPWRITE);
+  if (VOK == stat) stat = vmunmap(&mem, 3);
+  if (VOK == stat) stat = vmckpt(&mem, delta);
+  if (!TEST_ASSERT(VOK == stat, "failed to write the second checkpoint")) {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  // the delta has the header, a page, an unmap record and the end
+  long fullsz = ftell(full);
+  long deltasz = ftell(delta);
+  if (!TEST_EXPECT_EQ(deltasz, 6 + 10 + VPAGESZ + 10 + 1) ||
+      !TEST_EXPECT_EQ(fullsz, 6 + (10 + VPAGESZ) * 2 + 10 + 1))
+  {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  // rebuild the memory from both of them
+  rewind(full);
+  rewind(delta);
+  stat = vmrestore(&copy, full);
+  if (VOK == stat) stat = vmrestore(&copy, delta);
+  if (!TEST_ASSERT(VOK == stat, "vmrestore failed")) {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  vbyte buf[2];
+  vmpage *pg = NULL;
+  stat = vmgetd(&copy, buf, VPAGESZ * 2, 2, VPREAD);
+  if (!TEST_ASSERT(VOK == stat, "vmgetd failed") ||
+      !TEST_EXPECT_EQ(buf[0], 0x11) ||
+      !TEST_EXPECT_EQ(buf[1], 0x22) ||
+      !TEST_EXPECT_EQ(vmgetp(&copy, 3, &pg), VESEGV))
+  {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  // compressing the pages and reading them back changes nothing
+  struct vmstats ms;
+  rewind(delta);
+  stat = vmcold(&mem);
+  if (VOK == stat) stat = vmcold(&mem);
+  if (VOK == stat) stat = vmcold(&mem);
+  vmstat(&mem, &ms);
+  if (VOK == stat) stat = vmgetd(&mem, buf, VPAGESZ, 1, VPREAD);
+  if (VOK == stat) stat = vmgetd(&mem, buf, VPAGESZ * 2, 1, VPREAD);
+  if (VOK == stat) stat = vmckpt(&mem, delta);
+  if (!TEST_ASSERT(VOK == stat, "failed to write the third checkpoint") ||
+      !TEST_EXPECT_EQ(ms.compressed, VPAGESZ * 2) ||
+      !TEST_EXPECT_EQ(ftell(delta), 6 + 1))
+  {
+    vmdestroy(&mem);
+    vmdestroy(&copy);
+    return 0;
+  }
+
+  fclose(full);
+  fclose(delta);
+  vmdestroy(&mem);
+  vmdestroy(&copy);
+  return 1;
+}
+
 // a performance test for lru caching
 TEST(perf_test) {
   int stat = VOK;
@@ -128,6 +947,18 @@ TEST(perf_test) {
 int test(const char *suite_name) {
   TEST_RUN(storing_data);
   TEST_RUN(mem_prot);
+  TEST_RUN(atomics);
+  TEST_RUN(lazy_populate);
+  TEST_RUN(huge_pool);
+  TEST_RUN(mem_limit);
+  TEST_RUN(cow_clone);
+  TEST_RUN(cold_pages);
+  TEST_RUN(dedup);
+  TEST_RUN(swapping);
+  TEST_RUN(epochs);
+  TEST_RUN(table_growth);
+  TEST_RUN(solo);
+  TEST_RUN(checkpoints);
   TEST_RUN(perf_test);
 
   // exit code